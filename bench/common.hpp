@@ -0,0 +1,114 @@
+#ifndef _BENCH_COMMON_H
+#define _BENCH_COMMON_H
+
+// What the benchmarks share: failing with a message and parsing their options, and for the ones
+// that drive a server over the loopback, starting, waiting for and stopping the server.
+
+#include <cerrno>
+#include <cstdint>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+namespace bench {
+    using bench_clock = std::chrono::steady_clock;
+
+    // Exits after printing `what` and the error in `errno`.
+    [[noreturn]] inline void fail(const std::string& what) {
+        std::cerr << what << ": " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Exits after printing `what` and the usage of the program.
+    [[noreturn]] inline void usage_error(const std::string& what, const char *usage) {
+        std::cerr << what << std::endl << usage;
+        exit(EXIT_FAILURE);
+    }
+
+    // Parses a positive number, or a non-negative one if `allow_zero` is set.
+    inline double parse_number(const char *s, const char *usage, bool allow_zero = false) {
+        char *end;
+        double n = strtod(s, &end);
+        if (*end || end == s || !(allow_zero ? n >= 0 : n > 0))
+            usage_error("invalid number '" + std::string(s) + "'", usage);
+        return n;
+    }
+
+    // Parses a non-negative integer, like a seed or a count.
+    inline uint64_t parse_integer(const char *s, const char *usage) {
+        char *end;
+        unsigned long long n = strtoull(s, &end, 10);
+        if (*end || end == s || *s == '-') usage_error("invalid number '" + std::string(s) + "'", usage);
+        return n;
+    }
+
+    inline int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            bench_clock::now().time_since_epoch()).count();
+    }
+
+    // Starts the server at `path`, listening on `port`, with its output discarded.
+    inline pid_t start_server(const char *path, uint16_t port, const std::vector<const char*>& options) {
+        pid_t pid = fork();
+        if (pid < 0) fail("fork failed");
+        if (pid == 0) {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            std::string port_arg = std::to_string(port);
+            std::vector<const char*> args = { path, "--port", port_arg.c_str() };
+            args.insert(args.end(), options.begin(), options.end());
+            args.push_back(nullptr);
+            execv(path, const_cast<char**>(args.data()));
+            _exit(127);
+        }
+        return pid;
+    }
+
+    // Interrupts the server, like Ctrl-C, and waits for it to exit.
+    inline void stop_server(pid_t pid) {
+        kill(pid, SIGINT);
+        waitpid(pid, nullptr, 0);
+    }
+
+    // Returns a blocking socket connected to `port` on the loopback, or -1 if nothing is listening.
+    inline int connect_to(uint16_t port) {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) fail("socket failed");
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // Waits up to 5 s for something to listen on `port`.
+    inline void await_server(uint16_t port) {
+        int probe = -1;
+        for (int i = 0; i < 100 && probe < 0; i++) {
+            probe = connect_to(port);
+            if (probe < 0) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        if (probe < 0) fail("the server isn't listening");
+        close(probe);
+    }
+}
+
+#endif
@@ -0,0 +1,120 @@
+// Measures the memory the server holds for each idle connection: starts the server, opens many
+// connections that register and then stay quiet, and divides the growth of the resident memory of
+// the server by the number of connections. Fails if it's over the budget. Run by `make footprint`,
+// with a server built without sanitizers.
+//
+//     idle_footprint <server binary> [connections] [port] [server options...]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.hpp"
+
+namespace {
+    using namespace bench;
+
+    // The most an idle connection may take.
+    const constexpr size_t budget_bytes = 1024;
+
+    // Connections opened before measuring, so the memory the server allocates once (like the
+    // buffers of the first connections) doesn't count.
+    const constexpr size_t warmup_connections = 500;
+
+    size_t resident_bytes(pid_t pid) {
+        std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.rfind("VmRSS:", 0) == 0) return std::stoul(line.substr(6)) * 1024;
+        }
+        fail("no VmRSS in /proc/<pid>/status");
+    }
+
+    void send_all(int fd, const std::string& s) {
+        size_t sent = 0;
+        while (sent < s.size()) {
+            ssize_t n = send(fd, s.data() + sent, s.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) fail("send failed");
+            sent += n;
+        }
+    }
+
+    // Waits for the PONG that answers the PING sent after the registration, which means the
+    // server handled everything sent before it.
+    void await_pong(int fd) {
+        std::string received;
+        char buf[512];
+        while (received.find("PONG") == std::string::npos) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) fail("recv failed");
+            received.append(buf, n);
+        }
+    }
+
+    // Opens `n` connections that register and go idle, one at a time, so the listen backlog of
+    // the server never overflows.
+    void open_idle(uint16_t port, size_t n, std::vector<int>& fds) {
+        for (size_t i = 0; i < n; i++) {
+            int fd = connect_to(port);
+            if (fd < 0) fail("connect failed");
+            std::string nick = "idle" + std::to_string(fds.size());
+            send_all(fd, "NICK " + nick + "\r\nUSER " + nick + " host server :Idle Lurker\r\nPING\r\n");
+            await_pong(fd);
+            fds.push_back(fd);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <server binary> [connections] [port] [server options...]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    size_t connections = argc > 2 ? std::stoul(argv[2]) : 8000;
+    uint16_t port = argc > 3 ? std::stoul(argv[3]) : 6697;
+
+    // Both the server and this process hold a descriptor per connection.
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) fail("getrlimit failed");
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0) fail("setrlimit failed");
+    if (connections + warmup_connections + 64 > limit.rlim_cur) {
+        connections = limit.rlim_cur - warmup_connections - 64;
+        std::cerr << "limited to " << connections << " connections by RLIMIT_NOFILE" << std::endl;
+    }
+
+    pid_t server = start_server(argv[1], port,
+                                std::vector<const char*>(argv + std::min(argc, 4), argv + argc));
+    await_server(port);
+
+    std::vector<int> fds;
+    open_idle(port, warmup_connections, fds);
+    size_t before = resident_bytes(server);
+    open_idle(port, connections, fds);
+    size_t after = resident_bytes(server);
+
+    double per_connection = (double)(after - before) / connections;
+    std::printf("%zu idle connections: %zu KiB resident before, %zu KiB after\n", connections,
+                before / 1024, after / 1024);
+    std::printf("%.0f bytes per idle connection (budget %zu)\n", per_connection, budget_bytes);
+
+    for (int fd : fds) close(fd);
+    stop_server(server);
+
+    return per_connection <= budget_bytes ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,431 @@
+// A load generator: connects thousands of clients to the server over loopback, from a few
+// threads with an epoll loop each, puts them in channels, has every client send PRIVMSGs at a
+// steady rate, and reports the throughput and the latency of the deliveries. Each message
+// carries the time it was sent, so the latency is measured by the clients it's delivered to,
+// which share the clock of the sender. Run by `make bench`, against a server built without
+// sanitizers.
+//
+//     irc_bench [options] [-- server options...]
+//
+// With `--server <binary>`, the server is started with the given options (and `--port`), and
+// stopped at the end. Otherwise, a server must already be listening on the port.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "common.hpp"
+#include "histogram.hpp"
+
+namespace {
+    using namespace bench;
+
+    struct options {
+        uint16_t port = 6698;
+        const char *server = nullptr;
+        std::vector<const char*> server_options;
+        size_t threads = 4;
+        // Channels as (members, count) pairs.
+        std::vector<std::pair<size_t, size_t>> channels = { { 50, 20 } };
+        double rate = 1;
+        size_t size = 64;
+        double warmup = 2;
+        double duration = 10;
+    };
+
+    const char *usage =
+        "usage: irc_bench [options] [-- server options...]\n"
+        "  --port <port>              port of the server (default: 6698)\n"
+        "  --server <binary>          start this server, with the server options\n"
+        "  --threads <n>              client threads (default: 4)\n"
+        "  --channels <members>x<count>[,...]\n"
+        "                             channels and their sizes, every client joins one\n"
+        "                             (default: 50x20)\n"
+        "  --rate <messages/s>        messages sent by each client per second (default: 1)\n"
+        "  --size <bytes>             size of the text of the messages (default: 64)\n"
+        "  --warmup <s>               time sending before measuring (default: 2)\n"
+        "  --duration <s>             time measured (default: 10)\n";
+
+    std::vector<std::pair<size_t, size_t>> parse_channels(std::string_view s) {
+        std::vector<std::pair<size_t, size_t>> channels;
+        while (!s.empty()) {
+            auto item = s.substr(0, s.find(','));
+            s.remove_prefix(std::min(s.size(), item.size() + 1));
+            size_t members = 0, count = 0;
+            char rest;
+            if (sscanf(std::string(item).c_str(), "%zux%zu%c", &members, &count, &rest) != 2
+             || members == 0 || count == 0)
+                usage_error("invalid channels '" + std::string(item) + "'", usage);
+            channels.emplace_back(members, count);
+        }
+        return channels;
+    }
+
+    options parse_options(int argc, char *argv[]) {
+        options opts;
+        for (int i = 1; i < argc; i++) {
+            std::string_view arg = argv[i];
+            if (arg == "--") {
+                opts.server_options.assign(argv + i + 1, argv + argc);
+                break;
+            }
+            if (i + 1 >= argc) usage_error("missing value for '" + std::string(arg) + "'", usage);
+            const char *value = argv[++i];
+
+            if      (arg == "--port")     opts.port = parse_number(value, usage);
+            else if (arg == "--server")   opts.server = value;
+            else if (arg == "--threads")  opts.threads = parse_number(value, usage);
+            else if (arg == "--channels") opts.channels = parse_channels(value);
+            else if (arg == "--rate")     opts.rate = parse_number(value, usage);
+            else if (arg == "--size")     opts.size = parse_number(value, usage);
+            else if (arg == "--warmup")   opts.warmup = parse_number(value, usage);
+            else if (arg == "--duration") opts.duration = parse_number(value, usage);
+            else usage_error("unknown option '" + std::string(arg) + "'", usage);
+        }
+        return opts;
+    }
+
+    // The phases of a run, driven by the main thread.
+    enum class phase {
+        joining,
+        warmup,
+        measuring,
+        draining,
+        done,
+    };
+
+    // Shared by every client thread.
+    struct run_state {
+        std::atomic<phase> current = phase::joining;
+        std::atomic<size_t> joined = 0;
+        // Only the messages sent between these are measured.
+        std::atomic<int64_t> measure_from = INT64_MAX;
+        std::atomic<int64_t> measure_until = INT64_MAX;
+    };
+
+    struct client {
+        int fd = -1;
+        std::string nick;
+        std::string channel;
+        size_t members = 0;
+        bool joined = false;
+        // A partial line received, and what couldn't be sent yet.
+        std::string in;
+        std::string out;
+        bool want_write = false;
+    };
+
+    // The counters of a client thread, added up at the end.
+    struct thread_results {
+        // Delivery latencies, bucketed like the latencies of the server.
+        irc::histogram latency;
+        uint64_t sent = 0;
+        uint64_t expected = 0;
+        uint64_t delivered = 0;
+        uint64_t bytes_received = 0;
+    };
+
+    class client_thread {
+    public:
+        client_thread(const options& opts, run_state& state, size_t index)
+            : _opts(opts), _state(state), _index(index) { }
+
+        void add(std::string channel, size_t members) {
+            client c;
+            c.nick = "b" + std::to_string(_index) + "_" + std::to_string(_clients.size());
+            c.channel = std::move(channel);
+            c.members = members;
+            _clients.push_back(std::move(c));
+        }
+
+        size_t size() const { return _clients.size(); }
+        const thread_results& results() const { return _results; }
+
+        void run() {
+            _epfd = epoll_create1(EPOLL_CLOEXEC);
+            if (_epfd < 0) fail("epoll_create1 failed");
+            connect_all();
+
+            // Spread the messages of the thread evenly over time, taking turns between clients.
+            double interval_ns = 1e9 / (_opts.rate * _clients.size());
+            double next_send = 0;
+            size_t turn = 0;
+
+            std::vector<epoll_event> events(256);
+            std::vector<char> buf(64 * 1024);
+            while (1) {
+                phase p = _state.current.load();
+                if (p == phase::done) break;
+
+                int64_t now = now_ns();
+                bool sending = p == phase::warmup || p == phase::measuring;
+                if (!sending) {
+                    next_send = 0;
+                } else {
+                    if (next_send == 0) next_send = now;
+                    while (next_send <= now) {
+                        send_chat(_clients[turn], now);
+                        turn = (turn + 1) % _clients.size();
+                        next_send += interval_ns;
+                    }
+                }
+
+                int timeout = sending ? std::clamp<int>((next_send - now) / 1000000, 0, 1) : 10;
+                int n = epoll_wait(_epfd, events.data(), events.size(), timeout);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    fail("epoll_wait failed");
+                }
+                for (int i = 0; i < n; i++) {
+                    auto& c = _clients[events[i].data.u64];
+                    if (events[i].events & EPOLLOUT) flush(c);
+                    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) receive(c, buf);
+                }
+            }
+
+            for (auto& c : _clients) close(c.fd);
+            close(_epfd);
+        }
+
+    private:
+        void connect_all() {
+            for (size_t i = 0; i < _clients.size(); i++) {
+                auto& c = _clients[i];
+                c.fd = connect_to(_opts.port);
+                if (c.fd < 0) fail("connect failed");
+                int one = 1;
+                setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) | O_NONBLOCK);
+
+                epoll_event ev = {};
+                ev.events = EPOLLIN;
+                ev.data.u64 = i;
+                if (epoll_ctl(_epfd, EPOLL_CTL_ADD, c.fd, &ev) < 0) fail("epoll_ctl failed");
+
+                queue(c, "NICK " + c.nick + "\r\nUSER " + c.nick + " host server :Bench Client\r\n"
+                         "JOIN " + c.channel + "\r\n");
+            }
+        }
+
+        void send_chat(client& c, int64_t now) {
+            if (!c.joined) return;
+            // The time goes first, and the text is padded to the size asked for.
+            std::string text = std::to_string(now) + " ";
+            if (text.size() < _opts.size) text.append(_opts.size - text.size(), 'x');
+            queue(c, "PRIVMSG " + c.channel + " :" + text + "\r\n");
+
+            if (now >= _state.measure_from.load(std::memory_order_relaxed)
+             && now < _state.measure_until.load(std::memory_order_relaxed)) {
+                _results.sent++;
+                _results.expected += c.members;
+            }
+        }
+
+        void queue(client& c, const std::string& s) {
+            c.out += s;
+            flush(c);
+        }
+
+        void flush(client& c) {
+            while (!c.out.empty()) {
+                ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                    fail("send failed");
+                }
+                c.out.erase(0, n);
+            }
+
+            // Only wait for the socket to be writable while there is something to write.
+            bool want_write = !c.out.empty();
+            if (want_write == c.want_write) return;
+            c.want_write = want_write;
+            epoll_event ev = {};
+            ev.events = EPOLLIN | (want_write ? (uint32_t)EPOLLOUT : 0);
+            ev.data.u64 = &c - _clients.data();
+            if (epoll_ctl(_epfd, EPOLL_CTL_MOD, c.fd, &ev) < 0) fail("epoll_ctl failed");
+        }
+
+        void receive(client& c, std::vector<char>& buf) {
+            ssize_t n = recv(c.fd, buf.data(), buf.size(), 0);
+            if (n == 0) {
+                errno = ECONNRESET;
+                fail("the server closed the connection of " + c.nick);
+            }
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                fail("recv failed");
+            }
+            if (_state.current.load(std::memory_order_relaxed) == phase::measuring)
+                _results.bytes_received += n;
+
+            int64_t now = now_ns();
+            std::string_view data(buf.data(), n);
+            while (!data.empty()) {
+                size_t end = data.find('\n');
+                if (end == std::string_view::npos) {
+                    c.in.append(data);
+                    return;
+                }
+                if (c.in.empty()) {
+                    handle_line(c, data.substr(0, end), now);
+                } else {
+                    c.in.append(data.substr(0, end));
+                    handle_line(c, c.in, now);
+                    c.in.clear();
+                }
+                data.remove_prefix(end + 1);
+            }
+        }
+
+        void handle_line(client& c, std::string_view line, int64_t now) {
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+
+            // `:<prefix> <command> <params>`, with the text of the message after ` :`.
+            size_t space = line.find(' ');
+            if (space == std::string_view::npos) return;
+            auto command = line.substr(space + 1, line.find(' ', space + 1) - space - 1);
+            if (command == "PING") {
+                queue(c, "PONG :server\r\n");
+                return;
+            }
+            if (command != "PRIVMSG") return;
+
+            size_t text_at = line.find(" :");
+            if (text_at == std::string_view::npos) return;
+            auto text = line.substr(text_at + 2);
+
+            if (!c.joined) {
+                // The notice of our own join.
+                if (text.substr(0, c.nick.size() + 8) == c.nick + " joined ") {
+                    c.joined = true;
+                    _state.joined++;
+                }
+                return;
+            }
+
+            int64_t sent_at = 0;
+            for (char ch : text) {
+                if (ch < '0' || ch > '9') break;
+                sent_at = sent_at * 10 + (ch - '0');
+            }
+            if (sent_at < _state.measure_from.load(std::memory_order_relaxed)
+             || sent_at >= _state.measure_until.load(std::memory_order_relaxed))
+                return;
+            _results.delivered++;
+            _results.latency.record(std::chrono::nanoseconds(now - sent_at));
+        }
+
+        const options& _opts;
+        run_state& _state;
+        size_t _index;
+        int _epfd = -1;
+        std::vector<client> _clients;
+        thread_results _results;
+    };
+
+    void sleep_for(double seconds) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    auto opts = parse_options(argc, argv);
+
+    size_t clients = 0;
+    for (auto& [members, count] : opts.channels) clients += members * count;
+    opts.threads = std::min(opts.threads, clients);
+
+    // Every client takes a descriptor here, and another one in the server.
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) fail("getrlimit failed");
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0) fail("setrlimit failed");
+    if (clients + 64 > limit.rlim_cur) usage_error("too many clients for RLIMIT_NOFILE", usage);
+
+    pid_t server = -1;
+    if (opts.server) server = start_server(opts.server, opts.port, opts.server_options);
+    await_server(opts.port);
+
+    // Deal the members of every channel out to the threads, so the fan-out of a message crosses
+    // threads like it would cross the reactors of the server.
+    run_state state;
+    std::vector<std::unique_ptr<client_thread>> threads;
+    for (size_t i = 0; i < opts.threads; i++)
+        threads.push_back(std::make_unique<client_thread>(opts, state, i));
+    size_t next = 0, n_channels = 0;
+    for (auto& [members, count] : opts.channels) {
+        for (size_t i = 0; i < count; i++, n_channels++) {
+            for (size_t m = 0; m < members; m++)
+                threads[next++ % threads.size()]->add("#bench" + std::to_string(n_channels), members);
+        }
+    }
+
+    std::printf("%zu clients in %zu channels, %zu threads, %g messages/s each, %zu bytes\n",
+                clients, n_channels, threads.size(), opts.rate, opts.size);
+
+    std::vector<std::thread> running;
+    auto start = bench_clock::now();
+    for (auto& t : threads) running.emplace_back([&t] { t->run(); });
+    while (state.joined.load() < clients) sleep_for(0.01);
+    std::chrono::duration<double> join_time = bench_clock::now() - start;
+    std::printf("joined in %.2f s\n", join_time.count());
+
+    state.current = phase::warmup;
+    sleep_for(opts.warmup);
+    int64_t from = now_ns();
+    state.measure_from = from;
+    state.current = phase::measuring;
+    sleep_for(opts.duration);
+    int64_t until = now_ns();
+    state.measure_until = until;
+    // Wait for the messages still on their way.
+    state.current = phase::draining;
+    sleep_for(1);
+    state.current = phase::done;
+    for (auto& t : running) t.join();
+
+    thread_results total;
+    irc::histogram::snapshot latency;
+    for (auto& t : threads) {
+        auto& r = t->results();
+        r.latency.add_to(latency);
+        total.sent += r.sent;
+        total.expected += r.expected;
+        total.delivered += r.delivered;
+        total.bytes_received += r.bytes_received;
+    }
+
+    double seconds = (until - from) / 1e9;
+    std::printf("sent %llu messages (%.0f/s), delivered %llu of %llu (%.0f/s, %.2f%% lost)\n",
+                (unsigned long long)total.sent, total.sent / seconds,
+                (unsigned long long)total.delivered, (unsigned long long)total.expected,
+                total.delivered / seconds,
+                total.expected > 0 ? 100.0 * (total.expected - total.delivered) / total.expected : 0);
+    std::printf("received %.1f MiB/s\n", total.bytes_received / seconds / (1 << 20));
+    std::printf("delivery latency: p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+                latency.quantile(0.5) / 1e3, latency.quantile(0.99) / 1e3,
+                latency.quantile(0.999) / 1e3, latency.max / 1e3);
+
+    if (server > 0) stop_server(server);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,210 @@
+// Microbenchmarks of the hot paths of the protocol code, comparing each one to the code it
+// replaced. Built without sanitizers and with optimizations by `make microbench`.
+
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <iterator>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "message.hpp"
+#include "protocol.hpp"
+#include "line_scanner.hpp"
+#include "timing.hpp"
+
+namespace {
+    using bench::escape;
+
+    // Runs `f` `iterations` times, split in a few rounds, and prints the time per iteration of
+    // the fastest round.
+    template<typename F>
+    double measure(const char *name, size_t iterations, F&& f) {
+        const size_t rounds = 10;
+        double ns = bench::time_rounds(rounds, iterations / rounds, f).front();
+
+        std::cout << "  " << std::left << std::setw(32) << name << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(10) << ns << " ns/op" << std::endl;
+        return ns;
+    }
+
+    void report_speedup(double before, double after) {
+        std::cout << "  speedup: " << std::fixed << std::setprecision(2) << before / after << "x"
+                  << std::endl << std::endl;
+    }
+
+    // The chain of comparisons `lookup_command` replaced, with the commands added since at the end.
+    std::optional<irc::command> lookup_command_chain(std::string_view name) {
+        if      (name == "USER"    ) return irc::command::user;
+        else if (name == "NICK"    ) return irc::command::nick;
+        else if (name == "PRIVMSG" ) return irc::command::privmsg;
+        else if (name == "JOIN"    ) return irc::command::join;
+        else if (name == "WHOIS"   ) return irc::command::whois;
+        else if (name == "PING"    ) return irc::command::ping;
+        else if (name == "PONG"    ) return irc::command::pong;
+        else if (name == "MODE"    ) return irc::command::mode;
+        else if (name == "QUIT"    ) return irc::command::quit;
+        else if (name == "KICK"    ) return irc::command::kick;
+        else if (name == "OPER"    ) return irc::command::oper;
+        else if (name == "STATS"   ) return irc::command::stats;
+        return std::nullopt;
+    }
+
+    // How `message::need_more_params` used to build its reply.
+    std::string need_more_params_stream(irc::command cmd) {
+        std::stringstream ss;
+        ss << cmd;
+        return irc::message("server", irc::ERR_NEEDMOREPARAMS, { ss.str(), "Not enough parameters" })
+            .to_string();
+    }
+
+    std::string no_such_nick_message() {
+        return irc::message("server", irc::ERR_NOSUCHNICK, { "No such nick/channel" }).to_string();
+    }
+
+    // How `message::to_string` used to encode a message.
+    std::string to_string_stream(const irc::message& msg) {
+        std::ostringstream ss;
+        if (msg.prefix) ss << ":" << *msg.prefix << " ";
+        std::visit([&](auto&& cmd) { ss << cmd << " "; }, msg.command);
+        if (msg.params.size() > 0) {
+            std::copy(msg.params.cbegin(), msg.params.cend() - 1, std::ostream_iterator<std::string>(ss, " "));
+            ss << ":" << msg.params.back();
+        }
+        ss << std::endl;
+        return ss.str();
+    }
+
+    void bench_lookup() {
+        // Mostly PRIVMSG, like real traffic, with some misses.
+        const std::vector<std::string_view> tokens = {
+            "PRIVMSG", "PRIVMSG", "PRIVMSG", "PRIVMSG", "PING", "PONG", "PRIVMSG", "JOIN",
+            "NICK", "USER", "PRIVMSG", "KICK", "WHOIS", "QUIT", "NOTICE", "MODE", "PRIVMSG", "001",
+        };
+        const size_t iterations = 2'000'000;
+
+        std::cout << "command lookup (" << tokens.size() << " tokens per op)" << std::endl;
+        double chain = measure("compare chain", iterations, [&] {
+            int found = 0;
+            for (auto t : tokens) found += lookup_command_chain(t).has_value();
+            escape(found);
+        });
+        double hash = measure("perfect hash", iterations, [&] {
+            int found = 0;
+            for (auto t : tokens) found += irc::lookup_command(t).has_value();
+            escape(found);
+        });
+        report_speedup(chain, hash);
+    }
+
+    void bench_replies() {
+        const size_t iterations = 500'000;
+
+        std::cout << "ERR_NEEDMOREPARAMS" << std::endl;
+        double stream = measure("stringstream + to_string", iterations, [&] {
+            escape(need_more_params_stream(irc::command::privmsg));
+        });
+        double table = measure("encoded table", iterations, [&] {
+            escape(irc::need_more_params_line(irc::command::privmsg));
+        });
+        report_speedup(stream, table);
+
+        std::cout << "ERR_NOSUCHNICK" << std::endl;
+        stream = measure("message + to_string", iterations, [&] {
+            escape(no_such_nick_message());
+        });
+        table = measure("encoded table", iterations, [&] {
+            escape(irc::reply_line(irc::ERR_NOSUCHNICK));
+        });
+        report_speedup(stream, table);
+    }
+
+    void bench_scan() {
+        // A bulk paste: many short lines back to back, like bot traffic.
+        std::string chunk;
+        for (int i = 0; chunk.size() < 64 * 1024; i++)
+            chunk += "PRIVMSG #chan :line number " + std::to_string(i) + " of a long paste\r\n";
+        const size_t iterations = 2'000;
+
+        auto report = [&](double ns) {
+            std::cout << "  " << std::setw(42) << std::fixed << std::setprecision(0)
+                      << chunk.size() / ns * 1e9 / (1 << 20) << " MiB/s" << std::endl;
+        };
+
+        std::cout << "line scanning (" << chunk.size() << " bytes per op, "
+                  << irc::line_scanner::implementation() << ")" << std::endl;
+        // What the framing did before: one search per line, ignoring `\r` and NUL bytes.
+        double bytewise = measure("memchr per line", iterations, [&] {
+            size_t lines = 0;
+            const char *p = chunk.data();
+            const char *end = p + chunk.size();
+            while (auto nl = static_cast<const char*>(memchr(p, '\n', end - p))) {
+                lines++;
+                p = nl + 1;
+            }
+            escape(lines);
+        });
+        report(bytewise);
+        double scanner = measure("line_scanner", iterations, [&] {
+            irc::line_scanner scanner(chunk.data(), chunk.size());
+            std::string_view line;
+            bool has_nul;
+            size_t lines = 0;
+            while (scanner.next(line, has_nul)) lines += !has_nul;
+            escape(lines);
+        });
+        report(scanner);
+        report_speedup(bytewise, scanner);
+    }
+
+    void bench_encode() {
+        const irc::message msg("alice", irc::command::privmsg,
+                               { "#chan", "hello everyone, this is a typical chat message" });
+        const size_t iterations = 500'000;
+
+        std::cout << "PRIVMSG encoding" << std::endl;
+        double stream = measure("ostringstream", iterations, [&] {
+            escape(to_string_stream(msg));
+        });
+        double string = measure("to_string", iterations, [&] {
+            escape(msg.to_string());
+        });
+        std::string buffer;
+        double reused = measure("encode_into (reused buffer)", iterations, [&] {
+            buffer.clear();
+            msg.encode_into(buffer);
+            escape(buffer);
+        });
+        std::cout << "  speedup of to_string: " << std::fixed << std::setprecision(2)
+                  << stream / string << "x" << std::endl;
+        std::cout << "  speedup of encode_into: " << stream / reused << "x" << std::endl << std::endl;
+    }
+}
+
+int main() {
+    // Make sure both sides of every comparison agree before timing them.
+    for (const auto& e : irc::command_table) {
+        if (irc::lookup_command(e.name) != lookup_command_chain(e.name)
+            || irc::need_more_params_line(e.cmd) != need_more_params_stream(e.cmd)) {
+            std::cerr << "mismatch for " << e.name << std::endl;
+            return 1;
+        }
+    }
+    irc::message privmsg("alice", irc::command::privmsg, { "#chan", "hi there" });
+    if (privmsg.to_string() != to_string_stream(privmsg)) {
+        std::cerr << "mismatch for PRIVMSG" << std::endl;
+        return 1;
+    }
+    if (irc::reply_line(irc::ERR_NOSUCHNICK) != no_such_nick_message()) {
+        std::cerr << "mismatch for ERR_NOSUCHNICK" << std::endl;
+        return 1;
+    }
+
+    bench_lookup();
+    bench_replies();
+    bench_encode();
+    bench_scan();
+}
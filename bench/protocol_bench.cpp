@@ -0,0 +1,346 @@
+// Benchmarks of the protocol code on corpora shaped like real traffic, to track its cost from one
+// build to the next: framing received data into lines (`line_scanner`), parsing them
+// (`message_view::parse`, and `message::parse`, which copies), and encoding messages
+// (`message::to_string`, and `message::encode_into` with a reused buffer). Built without
+// sanitizers and with optimizations by `make protobench`.
+//
+//     protocol_bench [--label <text>] [--filter <text>] [--output <path>]
+//
+// The results are written as JSON, to be kept and compared between builds; the same numbers are
+// printed to stderr as they come. The corpora are generated from a fixed seed, so every build
+// measures the same bytes.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "message.hpp"
+#include "line_scanner.hpp"
+#include "timing.hpp"
+#include "common.hpp"
+
+namespace {
+    using bench::escape;
+    using bench::usage_error;
+
+    // How many bytes of lines each corpus has: about what a busy connection receives at once,
+    // and small enough to stay in the caches, so the code is measured rather than the memory.
+    const constexpr size_t corpus_size = 64 * 1024;
+
+    // Each benchmark runs `rounds` rounds of about `round_time`, and reports the fastest one,
+    // which is the least disturbed by the rest of the system, along with the median.
+    const constexpr size_t rounds = 15;
+    const constexpr auto round_time = std::chrono::milliseconds(10);
+
+    struct options {
+        std::string label;
+        std::string filter;
+        std::string output;
+    };
+
+    const char *usage =
+        "usage: protocol_bench [options]\n"
+        "  --label <text>             name of the build, copied to the results\n"
+        "  --filter <text>            only run the benchmarks whose name contains the text\n"
+        "  --output <path>            where to write the results (default: stdout)\n";
+
+    options parse_options(int argc, char *argv[]) {
+        options opts;
+        for (int i = 1; i < argc; i++) {
+            std::string_view arg = argv[i];
+            if (i + 1 >= argc) usage_error("missing value for '" + std::string(arg) + "'", usage);
+            const char *value = argv[++i];
+
+            if      (arg == "--label")  opts.label = value;
+            else if (arg == "--filter") opts.filter = value;
+            else if (arg == "--output") opts.output = value;
+            else usage_error("unknown option '" + std::string(arg) + "'", usage);
+        }
+        return opts;
+    }
+
+    struct corpus {
+        std::string name;
+        std::vector<std::string> lines;
+        // The lines as received: each one followed by `\r\n`.
+        std::string stream;
+        // The lines, parsed.
+        std::vector<irc::message> messages;
+        // The bytes of the lines, without their delimiters.
+        size_t line_bytes = 0;
+    };
+
+    class corpus_builder {
+    public:
+        corpus_builder(std::string name, uint64_t seed) : _rng(seed) { _corpus.name = std::move(name); }
+
+        bool full() const { return _corpus.line_bytes >= corpus_size; }
+
+        void add(std::string line) {
+            _corpus.line_bytes += line.size();
+            _corpus.stream += line;
+            _corpus.stream += "\r\n";
+            _corpus.lines.push_back(std::move(line));
+        }
+
+        corpus finish() {
+            for (const auto& line : _corpus.lines) {
+                irc::message_view view;
+                auto status = irc::message_view::parse(line, view);
+                if (status != irc::message_view::parse_status::ok) {
+                    std::cerr << _corpus.name << ": '" << line << "' does not parse ("
+                              << irc::message_view::describe(status) << ")" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                _corpus.messages.emplace_back(view);
+            }
+            return std::move(_corpus);
+        }
+
+        size_t pick(size_t n) { return _rng() % n; }
+
+        std::string word(size_t max_size = 10) {
+            std::string s(1 + pick(max_size), ' ');
+            for (auto& c : s) c = 'a' + pick(26);
+            return s;
+        }
+
+        // Words separated by spaces, `size` bytes long.
+        std::string text(size_t size) {
+            std::string s;
+            while (s.size() < size) {
+                if (!s.empty()) s += ' ';
+                s += word();
+            }
+            s.resize(size);
+            if (s.back() == ' ') s.back() = '.';
+            return s;
+        }
+
+        std::string nick() { return "u" + std::to_string(pick(10000)); }
+        std::string channel() { return "#chan" + std::to_string(pick(100)); }
+        std::string source() {
+            auto n = nick();
+            return n + "!" + n + "@10.0." + std::to_string(pick(256)) + "." + std::to_string(pick(256));
+        }
+
+    private:
+        std::mt19937_64 _rng;
+        corpus _corpus;
+    };
+
+    // What clients send and receive the most: short messages to channels, relayed with the
+    // source as the prefix, and some PINGs, JOINs and WHOISes.
+    corpus short_chat() {
+        corpus_builder b("short_chat", 1);
+        while (!b.full()) {
+            size_t roll = b.pick(100);
+            if (roll < 65)      b.add("PRIVMSG " + b.channel() + " :" + b.text(5 + b.pick(75)));
+            else if (roll < 85) b.add(":" + b.source() + " PRIVMSG " + b.channel() + " :" + b.text(5 + b.pick(75)));
+            else if (roll < 90) b.add("PING :server");
+            else if (roll < 93) b.add("PONG :server");
+            else if (roll < 97) b.add("JOIN " + b.channel());
+            else                b.add("WHOIS " + b.nick());
+        }
+        return b.finish();
+    }
+
+    // Lines as long as the server accepts (`max_line_length`), like pastes.
+    corpus max_length() {
+        corpus_builder b("max_length", 2);
+        while (!b.full()) {
+            std::string head = b.pick(2) ? "PRIVMSG " + b.channel() + " :"
+                                         : ":" + b.source() + " PRIVMSG " + b.channel() + " :";
+            b.add(head + b.text(irc::max_line_length - head.size()));
+        }
+        return b.finish();
+    }
+
+    // The most params a message has (`param_list::capacity`): 14 middle params and a trailing one,
+    // with or without its colon.
+    corpus many_params() {
+        static const char *commands[] = { "MODE", "KICK", "USER", "PRIVMSG" };
+        corpus_builder b("many_params", 3);
+        while (!b.full()) {
+            std::string line = commands[b.pick(4)];
+            line += " " + b.channel();
+            for (size_t i = 1; i < irc::message_view::param_list::capacity - 1; i++) line += " " + b.word();
+            line += b.pick(2) ? " :" + b.text(5 + b.pick(40)) : " " + b.word();
+            b.add(line);
+        }
+        return b.finish();
+    }
+
+    // Replies of the server: three-digit commands with the server as the prefix.
+    corpus numerics() {
+        corpus_builder b("numerics", 4);
+        while (!b.full()) {
+            auto nick = b.nick();
+            switch (b.pick(6)) {
+                case 0: b.add(":server 311 " + nick + " " + b.nick() + " " + b.word() + " 10.0.0.1 * :"
+                              + b.text(5 + b.pick(20))); break;
+                case 1: b.add(":server 433 * " + nick + " :Nickname is already in use"); break;
+                case 2: b.add(":server 401 " + nick + " :No such nick/channel"); break;
+                case 3: b.add(":server 461 PRIVMSG :Not enough parameters"); break;
+                case 4: b.add(":server 212 " + nick + " PRIVMSG " + std::to_string(b.pick(100000))); break;
+                case 5: b.add(":server 00" + std::to_string(1 + b.pick(5)) + " " + nick + " :"
+                              + b.text(10 + b.pick(50))); break;
+            }
+        }
+        return b.finish();
+    }
+
+    struct result {
+        std::string corpus;
+        std::string operation;
+        size_t lines;
+        size_t bytes;
+        double ns_per_line;
+        double ns_per_line_median;
+    };
+
+    // Times `f`, which goes through the whole corpus once, and returns the time per line.
+    template<typename F>
+    result measure(const corpus& c, const char *operation, size_t bytes, F&& f) {
+        auto ns = bench::time_rounds(rounds, bench::calls_for(round_time, f), f);
+        return { c.name, operation, c.lines.size(), bytes, ns.front() / c.lines.size(),
+                 ns[ns.size() / 2] / c.lines.size() };
+    }
+
+    double mib_per_s(const result& r) {
+        return r.bytes / (double)r.lines / r.ns_per_line * 1e9 / (1 << 20);
+    }
+
+    void run(const corpus& c, const options& opts, std::vector<result>& results) {
+        auto wanted = [&](const char *operation) {
+            return (c.name + "/" + operation).find(opts.filter) != std::string::npos;
+        };
+        auto report = [&](result r) {
+            std::fprintf(stderr, "  %-26s %8.2f ns/line %8.0f MiB/s\n",
+                         (r.corpus + "/" + r.operation).c_str(), r.ns_per_line, mib_per_s(r));
+            results.push_back(std::move(r));
+        };
+
+        size_t encoded_bytes = 0;
+        for (const auto& msg : c.messages) encoded_bytes += msg.encoded_size();
+
+        if (wanted("frame")) {
+            report(measure(c, "frame", c.stream.size(), [&] {
+                irc::line_scanner scanner(c.stream.data(), c.stream.size());
+                std::string_view line;
+                bool has_nul;
+                size_t lines = 0;
+                while (scanner.next(line, has_nul)) lines += !line.empty() && !has_nul;
+                escape(lines);
+            }));
+        }
+        if (wanted("parse_view")) {
+            report(measure(c, "parse_view", c.line_bytes, [&] {
+                irc::message_view view;
+                size_t params = 0;
+                for (const auto& line : c.lines) {
+                    irc::message_view::parse(line, view);
+                    params += view.params.size();
+                }
+                escape(params);
+            }));
+        }
+        if (wanted("parse")) {
+            report(measure(c, "parse", c.line_bytes, [&] {
+                for (const auto& line : c.lines) escape(irc::message::parse(line));
+            }));
+        }
+        if (wanted("to_string")) {
+            report(measure(c, "to_string", encoded_bytes, [&] {
+                for (const auto& msg : c.messages) escape(msg.to_string());
+            }));
+        }
+        if (wanted("encode_into")) {
+            std::string buffer;
+            report(measure(c, "encode_into", encoded_bytes, [&] {
+                for (const auto& msg : c.messages) {
+                    buffer.clear();
+                    msg.encode_into(buffer);
+                    escape(buffer);
+                }
+            }));
+        }
+    }
+
+    std::string json_string(std::string_view s) {
+        std::string out = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if ((unsigned char)c < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            } else {
+                out += c;
+            }
+        }
+        return out + "\"";
+    }
+
+    std::string to_json(const options& opts, const std::vector<result>& results) {
+        std::ostringstream out;
+        out.precision(4);
+        out << std::fixed;
+        out << "{\n";
+        out << "  \"suite\": \"protocol\",\n";
+        out << "  \"label\": " << json_string(opts.label) << ",\n";
+        out << "  \"compiler\": " << json_string(__VERSION__) << ",\n";
+        out << "  \"line_scanner\": " << json_string(irc::line_scanner::implementation()) << ",\n";
+        out << "  \"results\": [";
+        for (size_t i = 0; i < results.size(); i++) {
+            const auto& r = results[i];
+            out << (i ? "," : "") << "\n    {"
+                << "\"name\": " << json_string(r.corpus + "/" + r.operation)
+                << ", \"corpus\": " << json_string(r.corpus)
+                << ", \"operation\": " << json_string(r.operation)
+                << ", \"lines\": " << r.lines
+                << ", \"bytes\": " << r.bytes
+                << ", \"ns_per_line\": " << r.ns_per_line
+                << ", \"ns_per_line_median\": " << r.ns_per_line_median
+                << ", \"mib_per_s\": " << mib_per_s(r) << "}";
+        }
+        out << "\n  ]\n}\n";
+        return out.str();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    auto opts = parse_options(argc, argv);
+
+    std::vector<corpus> corpora;
+    corpora.push_back(short_chat());
+    corpora.push_back(max_length());
+    corpora.push_back(many_params());
+    corpora.push_back(numerics());
+
+    std::vector<result> results;
+    std::cerr << "protocol benchmarks (line_scanner: " << irc::line_scanner::implementation() << ")"
+              << std::endl;
+    for (const auto& c : corpora) run(c, opts, results);
+
+    auto json = to_json(opts, results);
+    if (opts.output.empty()) {
+        std::cout << json;
+    } else {
+        std::ofstream file(opts.output);
+        file << json;
+        if (!file) {
+            std::cerr << "failed to write '" << opts.output << "'" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+}
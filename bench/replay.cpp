@@ -0,0 +1,385 @@
+// Replays a capture of the traffic of a server (see `server/capture.hpp`, recorded with
+// `--capture <path>`) against a server over loopback: every captured connection is opened, sends
+// its lines and closes at the time it did in the capture, divided by the speed. With a speed of
+// zero, everything is sent as fast as the server takes it. What the server sends back is read and
+// counted, but not checked. Run by `make replay`.
+//
+//     replay [options] <capture> [-- server options...]
+//
+// With `--server <binary>`, the server is started with the given options (and `--port`), and
+// stopped at the end. Otherwise, a server must already be listening on the port. Flood control
+// holds back a capture replayed faster than it was recorded, unless the server runs with
+// `--flood-rate 0`.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "common.hpp"
+
+namespace {
+    using namespace bench;
+
+    // The layout of captures, from `server/capture.hpp`.
+    const char capture_magic[8] = { 'I', 'R', 'C', 'C', 'A', 'P', '1', '\n' };
+    enum class record_type : uint8_t {
+        connect,
+        line,
+        disconnect,
+    };
+
+    // While this much is waiting to be sent, replaying as fast as possible waits for the server.
+    const size_t max_backlog = 16 << 20;
+
+    struct options {
+        uint16_t port = 6698;
+        const char *server = nullptr;
+        std::vector<const char*> server_options;
+        const char *capture = nullptr;
+        double speed = 1;
+    };
+
+    const char *usage =
+        "usage: replay [options] <capture> [-- server options...]\n"
+        "  --port <port>              port of the server (default: 6698)\n"
+        "  --server <binary>          start this server, with the server options\n"
+        "  --speed <n>                times the speed of the capture, 0 for as fast as\n"
+        "                             possible (default: 1)\n";
+
+    options parse_options(int argc, char *argv[]) {
+        options opts;
+        for (int i = 1; i < argc; i++) {
+            std::string_view arg = argv[i];
+            if (arg == "--") {
+                opts.server_options.assign(argv + i + 1, argv + argc);
+                break;
+            }
+            if (arg.substr(0, 2) != "--") {
+                if (opts.capture) usage_error("more than one capture", usage);
+                opts.capture = argv[i];
+                continue;
+            }
+            if (i + 1 >= argc) usage_error("missing value for '" + std::string(arg) + "'", usage);
+            const char *value = argv[++i];
+
+            if      (arg == "--port")   opts.port = parse_number(value, usage);
+            else if (arg == "--server") opts.server = value;
+            else if (arg == "--speed")  opts.speed = parse_number(value, usage, true);
+            else usage_error("unknown option '" + std::string(arg) + "'", usage);
+        }
+        if (!opts.capture) usage_error("missing capture", usage);
+        return opts;
+    }
+
+    // A record of the capture. The text of lines stays in the capture, which is kept in memory.
+    struct record {
+        record_type type;
+        int64_t time;
+        uint64_t connection;
+        std::string_view text;
+    };
+
+    class capture_reader {
+    public:
+        capture_reader(const char *path) {
+            std::ifstream in(path, std::ios::binary);
+            if (!in) fail("failed to open '" + std::string(path) + "'");
+            _data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+
+        // The records in the order they happened. Records of the same time keep the order of
+        // the file, which is the order of each connection.
+        std::vector<record> records() {
+            if (_data.size() < sizeof(capture_magic) + 8
+             || memcmp(_data.data(), capture_magic, sizeof(capture_magic)) != 0)
+                corrupt("not a capture");
+            _pos = sizeof(capture_magic) + 8;
+
+            std::vector<record> records;
+            while (_pos < _data.size()) {
+                record r;
+                auto type = (uint8_t)_data[_pos++];
+                if (type > (uint8_t)record_type::disconnect) corrupt("unknown record");
+                r.type = (record_type)type;
+                r.time = varint();
+                r.connection = varint();
+                if (r.type == record_type::connect) take(4);
+                if (r.type == record_type::line) r.text = take(varint());
+                records.push_back(r);
+            }
+            std::stable_sort(records.begin(), records.end(),
+                             [](const record& a, const record& b) { return a.time < b.time; });
+            return records;
+        }
+
+    private:
+        [[noreturn]] void corrupt(const char *what) {
+            std::cerr << "corrupt capture: " << what << " at byte " << _pos << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        uint64_t varint() {
+            uint64_t n = 0;
+            for (unsigned shift = 0; shift < 64; shift += 7) {
+                if (_pos >= _data.size()) corrupt("truncated record");
+                uint8_t b = _data[_pos++];
+                n |= (uint64_t)(b & 0x7f) << shift;
+                if (!(b & 0x80)) return n;
+            }
+            corrupt("varint too long");
+        }
+
+        std::string_view take(size_t n) {
+            if (n > _data.size() - _pos) corrupt("truncated record");
+            std::string_view s(_data.data() + _pos, n);
+            _pos += n;
+            return s;
+        }
+
+        std::string _data;
+        size_t _pos = 0;
+    };
+
+    // A connection of the capture, replayed.
+    struct client {
+        int fd = -1;
+        // What couldn't be sent yet.
+        std::string out;
+        // Whether the capture closed it, which happens once everything is sent.
+        bool closing = false;
+        bool want_write = false;
+    };
+
+    class replayer {
+    public:
+        replayer(const options& opts) : _opts(opts) {
+            _epfd = epoll_create1(EPOLL_CLOEXEC);
+            if (_epfd < 0) fail("epoll_create1 failed");
+        }
+
+        ~replayer() { close(_epfd); }
+
+        void run(const std::vector<record>& records) {
+            std::vector<epoll_event> events(256);
+            std::vector<char> buf(64 * 1024);
+            _start = now_ns();
+            size_t next = 0;
+            while (next < records.size() || _open > 0) {
+                int64_t now = now_ns();
+                bool asap = _opts.speed == 0;
+                // Replay everything due, or as fast as possible, a batch at a time so the
+                // responses are read in between.
+                for (size_t batch = 0; next < records.size() && batch < 1024; batch++) {
+                    int64_t due = asap ? now : _start + (int64_t)(records[next].time / _opts.speed);
+                    if (due > now || (asap && _backlog > max_backlog)) break;
+                    _max_lag = std::max(_max_lag, now - due);
+                    apply(records[next++]);
+                    // The connections still open when the capture ended close once they sent
+                    // everything.
+                    if (next == records.size()) close_all();
+                }
+
+                int timeout = 10;
+                if (next < records.size() && asap) {
+                    timeout = _backlog > max_backlog ? 10 : 0;
+                } else if (next < records.size()) {
+                    int64_t due = _start + (int64_t)(records[next].time / _opts.speed);
+                    timeout = std::clamp<int64_t>((due - now) / 1000000, 0, 10);
+                }
+                int n = epoll_wait(_epfd, events.data(), events.size(), timeout);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    fail("epoll_wait failed");
+                }
+                for (int i = 0; i < n; i++) {
+                    uint64_t id = events[i].data.u64;
+                    auto c = _clients.find(id);
+                    if (c == _clients.end()) continue;
+                    if (events[i].events & EPOLLOUT) flush(id, c->second);
+                    else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) receive(id, c->second, buf);
+                }
+            }
+            _end = now_ns();
+        }
+
+        void report(const std::vector<record>& records) const {
+            double seconds = (_end - _start) / 1e9;
+            double span = records.empty() ? 0 : records.back().time / 1e9;
+            std::printf("replayed %llu connections, %llu lines (%.1f MiB) of %.2f s of capture in "
+                        "%.2f s (%.1fx)\n", (unsigned long long)_connections,
+                        (unsigned long long)_lines, _bytes_sent / (double)(1 << 20), span, seconds,
+                        seconds > 0 ? span / seconds : 0);
+            std::printf("sent %.0f lines/s, received %.1f MiB, %llu connections refused, %llu "
+                        "closed by the server, largest lag behind the capture %.1f ms\n",
+                        _lines / seconds, _bytes_received / (double)(1 << 20),
+                        (unsigned long long)_refused, (unsigned long long)_closed_by_server,
+                        _max_lag / 1e6);
+        }
+
+    private:
+        void apply(const record& r) {
+            if (r.type == record_type::connect) {
+                open_client(r.connection);
+                return;
+            }
+
+            auto it = _clients.find(r.connection);
+            // Connections that were refused, or that the server closed.
+            if (it == _clients.end()) return;
+            auto& c = it->second;
+            if (r.type == record_type::line) {
+                _lines++;
+                c.out.append(r.text).append("\r\n");
+                _backlog += r.text.size() + 2;
+                flush(r.connection, c);
+            } else {
+                c.closing = true;
+                if (c.out.empty()) close_client(r.connection, c);
+            }
+        }
+
+        void close_all() {
+            std::vector<uint64_t> ids;
+            for (auto& [id, c] : _clients) ids.push_back(id);
+            for (auto id : ids) {
+                auto& c = _clients[id];
+                c.closing = true;
+                if (c.out.empty()) close_client(id, c);
+            }
+        }
+
+        void open_client(uint64_t id) {
+            int fd = connect_to(_opts.port);
+            if (fd < 0) {
+                _refused++;
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+            epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.u64 = id;
+            if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) fail("epoll_ctl failed");
+            _clients[id].fd = fd;
+            _connections++;
+            _open++;
+        }
+
+        void close_client(uint64_t id, client& c) {
+            _backlog -= c.out.size();
+            close(c.fd);
+            _clients.erase(id);
+            _open--;
+        }
+
+        void flush(uint64_t id, client& c) {
+            size_t sent = 0;
+            while (sent < c.out.size()) {
+                ssize_t n = send(c.fd, c.out.data() + sent, c.out.size() - sent, MSG_NOSIGNAL);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                    // The server closed the connection, the rest can't be sent.
+                    sent = c.out.size();
+                    break;
+                }
+                sent += n;
+            }
+            c.out.erase(0, sent);
+            _backlog -= sent;
+            _bytes_sent += sent;
+
+            if (c.out.empty() && c.closing) {
+                close_client(id, c);
+                return;
+            }
+            if (c.want_write != !c.out.empty()) {
+                c.want_write = !c.out.empty();
+                epoll_event ev = {};
+                ev.events = EPOLLIN | (c.want_write ? (uint32_t)EPOLLOUT : 0);
+                ev.data.u64 = id;
+                if (epoll_ctl(_epfd, EPOLL_CTL_MOD, c.fd, &ev) < 0) fail("epoll_ctl failed");
+            }
+        }
+
+        void receive(uint64_t id, client& c, std::vector<char>& buf) {
+            while (1) {
+                ssize_t n = recv(c.fd, buf.data(), buf.size(), MSG_DONTWAIT);
+                if (n > 0) {
+                    _bytes_received += n;
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+                if (n < 0 && errno == EINTR) continue;
+                _closed_by_server++;
+                close_client(id, c);
+                return;
+            }
+        }
+
+        const options& _opts;
+        int _epfd = -1;
+        // By the id of the connection in the capture.
+        std::unordered_map<uint64_t, client> _clients;
+        size_t _open = 0;
+        size_t _backlog = 0;
+
+        int64_t _start = 0;
+        int64_t _end = 0;
+        int64_t _max_lag = 0;
+        uint64_t _connections = 0;
+        uint64_t _refused = 0;
+        uint64_t _closed_by_server = 0;
+        uint64_t _lines = 0;
+        uint64_t _bytes_sent = 0;
+        uint64_t _bytes_received = 0;
+    };
+}
+
+int main(int argc, char *argv[]) {
+    auto opts = parse_options(argc, argv);
+
+    capture_reader reader(opts.capture);
+    auto records = reader.records();
+
+    // Every connection open at the same time takes a descriptor here, and another one in the
+    // server.
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) fail("getrlimit failed");
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0) fail("setrlimit failed");
+
+    pid_t server = -1;
+    if (opts.server) server = start_server(opts.server, opts.port, opts.server_options);
+    await_server(opts.port);
+
+    if (opts.speed == 0) std::printf("%zu records, replaying as fast as possible\n", records.size());
+    else std::printf("%zu records, replaying at %gx\n", records.size(), opts.speed);
+    replayer r(opts);
+    r.run(records);
+    r.report(records);
+
+    if (server > 0) stop_server(server);
+    return EXIT_SUCCESS;
+}
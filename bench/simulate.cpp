@@ -0,0 +1,273 @@
+// Runs the server in a simulation (see `server/simulation.hpp`): clients connected in memory, a
+// virtual clock, and a single thread, so nothing but the protocol core is measured. The clients
+// follow a random scenario drawn from a seed: mostly chat in channels, with joins, WHOIS, PINGs,
+// kicks, malformed and overlong lines, numeric replies, clients that stop reading, disconnects and
+// reconnects, and time passing, so timers (flood control, pings, timeouts) fire too. Run by
+// `make simulate`.
+//
+//     simulate [options] [-- server options...]
+//
+// A run is deterministic: the same seed and options always deliver the same bytes to every
+// client, which the digest at the end sums up. A scenario that misbehaves can be replayed exactly
+// from its seed, and `--dump` prints everything delivered, to compare two runs line by line.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "simulation.hpp"
+#include "config.hpp"
+#include "log.hpp"
+#include "message.hpp"
+#include "metrics.hpp"
+#include "common.hpp"
+
+namespace {
+    using wall_clock = std::chrono::steady_clock;
+    using bench::parse_integer;
+    using bench::usage_error;
+
+    struct options {
+        uint64_t seed = 1;
+        size_t clients = 1000;
+        size_t channels = 20;
+        size_t actions = 200000;
+        size_t size = 64;
+        bool dump = false;
+        std::vector<char*> server_options;
+    };
+
+    const char *usage =
+        "usage: simulate [options] [-- server options...]\n"
+        "  --seed <n>                 seed of the scenario (default: 1)\n"
+        "  --clients <n>              clients connected at any time (default: 1000)\n"
+        "  --channels <n>             channels they are spread over (default: 20)\n"
+        "  --actions <n>              actions of the clients (default: 200000)\n"
+        "  --size <bytes>             largest text of the messages (default: 64)\n"
+        "  --dump                     print everything delivered, prefixed by the client\n";
+
+    options parse_options(int argc, char *argv[]) {
+        options opts;
+        for (int i = 1; i < argc; i++) {
+            std::string_view arg = argv[i];
+            if (arg == "--") {
+                opts.server_options.assign(argv + i + 1, argv + argc);
+                break;
+            }
+            if (arg == "--dump") {
+                opts.dump = true;
+                continue;
+            }
+            if (i + 1 >= argc) usage_error("missing value for '" + std::string(arg) + "'", usage);
+            const char *value = argv[++i];
+
+            if      (arg == "--seed")     opts.seed = parse_integer(value, usage);
+            else if (arg == "--clients")  opts.clients = parse_integer(value, usage);
+            else if (arg == "--channels") opts.channels = parse_integer(value, usage);
+            else if (arg == "--actions")  opts.actions = parse_integer(value, usage);
+            else if (arg == "--size")     opts.size = parse_integer(value, usage);
+            else usage_error("unknown option '" + std::string(arg) + "'", usage);
+        }
+        if (opts.clients == 0 || opts.channels == 0 || opts.size == 0)
+            usage_error("clients, channels and size must be positive", usage);
+        return opts;
+    }
+
+    irc::config server_config(const options& opts) {
+        std::vector<char*> args = { const_cast<char*>("server") };
+        args.insert(args.end(), opts.server_options.begin(), opts.server_options.end());
+        try {
+            auto cfg = irc::config::from_args(args.size(), args.data());
+            // The scenario sends malformed lines on purpose, which would be logged by the million.
+            bool level_given = false;
+            for (std::string_view arg : opts.server_options) level_given |= arg == "--log-level";
+            if (!level_given) cfg.log_level = irc::log_level::error;
+            return cfg;
+        } catch (irc::config::usage_error& err) {
+            std::cerr << err.what() << std::endl << irc::config::usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // What the clients received: a 64-bit FNV-1a hash of every byte, along with the client it
+    // went to, in the order it arrived.
+    struct delivery_digest {
+        uint64_t hash = 0xcbf29ce484222325;
+        uint64_t bytes = 0;
+        uint64_t lines = 0;
+
+        void add(uint64_t client, std::string_view data) {
+            for (int i = 0; i < 8; i++) mix((uint8_t)(client >> (i * 8)));
+            for (char c : data) {
+                mix((uint8_t)c);
+                if (c == '\n') lines++;
+            }
+            bytes += data.size();
+        }
+
+        void mix(uint8_t b) {
+            hash ^= b;
+            hash *= 0x100000001b3;
+        }
+    };
+
+    class scenario {
+    public:
+        scenario(const options& opts, irc::simulation& sim)
+            : _opts(opts)
+            , _sim(sim)
+            , _rng(opts.seed)
+        {
+            _sim.set_receiver([this](size_t c, std::string_view data) { this->receive(c, data); });
+        }
+
+        void run() {
+            for (size_t i = 0; i < _opts.clients; i++) _slots.push_back(connect());
+            _sim.run();
+
+            size_t done = 0;
+            while (done < _opts.actions) {
+                // A batch of actions that happen at the same time, then some time passes.
+                size_t batch = std::min<size_t>(1 + pick(64), _opts.actions - done);
+                for (size_t i = 0; i < batch; i++) act();
+                done += batch;
+                _sim.run();
+                _sim.advance(std::chrono::milliseconds(pick(20)));
+            }
+
+            // Let every client catch up, and the timers of the quiet clients run out.
+            for (auto c : _slots) _sim.set_reading(c, true);
+            _sim.advance(std::chrono::minutes(5));
+        }
+
+        const delivery_digest& digest() const { return _digest; }
+        size_t connects() const { return _partial.size(); }
+
+    private:
+        size_t pick(size_t n) { return n == 0 ? 0 : _rng() % n; }
+        bool chance(unsigned percent) { return pick(100) < percent; }
+
+        std::string nick(size_t c) const { return "u" + std::to_string(c); }
+        std::string channel(size_t k) const { return "#chan" + std::to_string(k); }
+
+        size_t connect() {
+            size_t c = _sim.connect(0x0a000000 + (uint32_t)_partial.size());
+            _partial.emplace_back();
+            _sim.send(c, "NICK " + nick(c) + "\r\nUSER " + nick(c) + " host server :Simulated\r\n"
+                         "JOIN " + channel(pick(_opts.channels)) + "\r\n");
+            return c;
+        }
+
+        std::string text() {
+            std::string s(1 + pick(_opts.size), ' ');
+            for (auto& ch : s) ch = 'a' + pick(26);
+            return s;
+        }
+
+        void act() {
+            size_t slot = pick(_slots.size());
+            size_t c = _slots[slot];
+            size_t roll = pick(100);
+
+            // The server disconnected the client (a timeout or a full send queue), so it comes back.
+            if (!_sim.is_connected(c)) {
+                _slots[slot] = connect();
+                return;
+            }
+
+            if (roll < 85) {
+                _sim.send(c, "PRIVMSG --- :" + text() + "\r\n");
+            } else if (roll < 89) {
+                _sim.send(c, "JOIN " + channel(pick(_opts.channels)) + "\r\n");
+            } else if (roll < 91) {
+                _sim.send(c, "WHOIS " + nick(_slots[pick(_slots.size())]) + "\r\n");
+            } else if (roll < 93) {
+                _sim.send(c, "PING :" + text() + "\r\n");
+            } else if (roll < 94) {
+                _sim.send(c, "KICK --- " + nick(_slots[pick(_slots.size())]) + "\r\n");
+            } else if (roll < 96) {
+                // Garbage, a numeric reply, which only servers send, and a line too long to be
+                // handled.
+                if (chance(50)) _sim.send(c, ":\r\n" + text() + "\r\n001 " + text() + "\r\n");
+                else _sim.send(c, std::string(irc::max_line_length + pick(100), 'x') + "\r\n");
+            } else if (roll < 98) {
+                // Slow readers stay slow for a while, and their send queues fill up.
+                _sim.set_reading(c, chance(70));
+            } else {
+                // Leave, politely or not, and someone else takes the place.
+                if (chance(50)) _sim.send(c, "QUIT :bye\r\n");
+                _sim.disconnect(c);
+                _slots[slot] = connect();
+            }
+        }
+
+        void receive(size_t c, std::string_view data) {
+            _digest.add(c, data);
+            if (_opts.dump) std::printf("%zu %.*s", c, (int)data.size(), data.data());
+
+            // Answer the PINGs of the server, so only the clients that stop reading time out.
+            auto& partial = _partial[c];
+            partial += data;
+            size_t start = 0, end;
+            while ((end = partial.find('\n', start)) != std::string::npos) {
+                std::string_view line(partial.data() + start, end - start);
+                if (line.substr(0, 13) == ":server PING ") _sim.send(c, "PONG :server\r\n");
+                start = end + 1;
+            }
+            partial.erase(0, start);
+        }
+
+        const options& _opts;
+        irc::simulation& _sim;
+        std::mt19937_64 _rng;
+
+        // The client in each of the places, and the partial line each client received last.
+        std::vector<size_t> _slots;
+        std::vector<std::string> _partial;
+
+        delivery_digest _digest;
+    };
+}
+
+int main(int argc, char *argv[]) {
+    auto opts = parse_options(argc, argv);
+    auto cfg = server_config(opts);
+
+    auto& log = irc::logger::instance();
+    log.set_level(cfg.log_level);
+    log.start();
+
+    uint64_t lines_handled = 0;
+    double virtual_seconds = 0;
+    auto start = wall_clock::now();
+    {
+        irc::simulation sim(cfg);
+        scenario s(opts, sim);
+        auto from = sim.now();
+        s.run();
+        virtual_seconds = std::chrono::duration<double>(sim.now() - from).count();
+
+        std::chrono::duration<double> wall = wall_clock::now() - start;
+        auto& digest = s.digest();
+        auto metrics = irc::metrics_snapshot::total();
+        for (auto n : metrics.commands) lines_handled += n;
+
+        std::fprintf(stderr, "seed %llu: %zu actions of %zu clients (%zu connections), %.0f s of "
+                     "virtual time in %.2f s\n", (unsigned long long)opts.seed, opts.actions,
+                     opts.clients, s.connects(), virtual_seconds, wall.count());
+        std::fprintf(stderr, "handled %llu lines (%.0f/s), delivered %llu lines (%.0f/s), "
+                     "%.1f MiB\n", (unsigned long long)lines_handled, lines_handled / wall.count(),
+                     (unsigned long long)digest.lines, digest.lines / wall.count(),
+                     digest.bytes / (double)(1 << 20));
+        std::fprintf(stderr, "digest %016llx\n", (unsigned long long)digest.hash);
+    }
+
+    log.stop();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,50 @@
+#ifndef _BENCH_TIMING_H
+#define _BENCH_TIMING_H
+
+// The timing loop of the microbenchmarks, which time a function called many times in a row.
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+namespace bench {
+    using timing_clock = std::chrono::steady_clock;
+
+    // Keeps the compiler from optimizing away a value that is never used.
+    template<typename T>
+    inline void escape(const T& value) {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    // How many calls of `f` take at least `duration`, in powers of two.
+    template<typename F>
+    size_t calls_for(timing_clock::duration duration, F&& f) {
+        size_t calls = 1;
+        while (true) {
+            auto start = timing_clock::now();
+            for (size_t i = 0; i < calls; i++) f();
+            if (timing_clock::now() - start >= duration) return calls;
+            calls *= 2;
+        }
+    }
+
+    // Calls `f` `calls` times in each of `rounds` rounds, after a call to warm up, and returns
+    // the time per call of every round in nanoseconds, from the fastest to the slowest. The
+    // fastest is the least disturbed by the rest of the system.
+    template<typename F>
+    std::vector<double> time_rounds(size_t rounds, size_t calls, F&& f) {
+        f();
+        std::vector<double> ns;
+        for (size_t r = 0; r < rounds; r++) {
+            auto start = timing_clock::now();
+            for (size_t i = 0; i < calls; i++) f();
+            std::chrono::duration<double, std::nano> elapsed = timing_clock::now() - start;
+            ns.push_back(elapsed.count() / calls);
+        }
+        std::sort(ns.begin(), ns.end());
+        return ns;
+    }
+}
+
+#endif
@@ -1,5 +1,5 @@
 #include <string>
-#include <sstream>
+#include <vector>
 #include <string_view>
 #include <algorithm>
 #include <mutex>
@@ -17,6 +17,7 @@
 #include "tcplistener.hpp"
 #include "utils.hpp"
 #include "message.hpp"
+#include "line_scanner.hpp"
 
 using namespace std::literals::chrono_literals;
 
@@ -64,6 +65,22 @@ void shutdown(int shutdown_eventfd) {
         THROW_ERRNO("write to eventfd failed");
 }
 
+// The text after a command of the user, or nothing if there's none.
+std::string_view argument(std::string_view input, size_t start) {
+    return input.substr(std::min(start, input.size()));
+}
+
+// Splits the arguments of a command of the user at the spaces, after the params in `first`.
+std::vector<std::string> split_params(std::string_view args, std::vector<std::string> first = {}) {
+    std::vector<std::string> params = std::move(first);
+    while (!args.empty()) {
+        size_t space = std::min(args.find(' '), args.size());
+        if (space > 0) params.emplace_back(args.substr(0, space));
+        args = args.substr(std::min(space + 1, args.size()));
+    }
+    return params;
+}
+
 // Send message loop. This thread will listen for user input and send them to the server when enter
 // is pressed. The eventfd will wakeup the thread if it is blocking but should wakeup (probably
 // because it should shutdown or stop running).
@@ -84,6 +101,7 @@ void send_message(WINDOW* w, tcpstream& cli, int shutdown_eventfd) {
         THROW_ERRNO("epoll_ctl failed");
 
     std::string recv_buf;
+    std::string send_buf;
     while (RUN) {
         // Will wait until either there is something to read from stdin or the shutdown event is
         // emitted and the thread should stop blocking in order to exit.
@@ -102,16 +120,17 @@ void send_message(WINDOW* w, tcpstream& cli, int shutdown_eventfd) {
         }
 
         std::string input = std::exchange(recv_buf, std::string());
+        irc::message msg;
         if (input == "/ping") {
-            input = "PING";
+            msg = irc::message(irc::command::ping);
         } else if (input == "/quit") {
-            input = "QUIT";
+            msg = irc::message(irc::command::quit);
             shutdown(shutdown_eventfd);
         } else if (input.find("/join") == 0) {
-            input = "JOIN " + input.substr(6);
+            msg = irc::message(irc::command::join, split_params(argument(input, 6)));
         } else if (input.find("/nickname") == 0) {
-            std::string nick = input.substr(10);
-            input = "NICK " + nick;
+            std::string nick(argument(input, 10));
+            msg = irc::message(irc::command::nick, { nick });
             std::scoped_lock<std::mutex> lock(print_mutex);
             wmove(stdscr, 0, 0);
             wclrtoeol(w);
@@ -119,54 +138,86 @@ void send_message(WINDOW* w, tcpstream& cli, int shutdown_eventfd) {
             wrefresh(stdscr);
         } else if (input.find("/user") == 0) {
             // TODO
-            std::stringstream ss;
-            ss << "USER ";
-            input = input.substr(6);
-            size_t next_space = input.find(' ');
-            ss << input.substr(0, ++next_space);
-            input = input.substr(next_space);
+            std::string_view args = argument(input, 6);
+            size_t next_space = std::min(args.find(' '), args.size());
 
             //   these fields are unused in
             //   the current implementation
-            //     vvvvvvvvvvvvvvvvvvvvvvv
-            ss << "<hostname> <servername> :" << input;
-            input = ss.str();
-            wprintw(w, "%s\n", input.c_str());
+            //       vvvvvvvvvvvvvvvvvvvvvvvvvvv
+            msg = irc::message(irc::command::user, { std::string(args.substr(0, next_space)),
+                                                     "<hostname>", "<servername>",
+                                                     std::string(argument(args, next_space + 1)) });
+            std::string line = msg.to_string();
+            wprintw(w, "%s", line.c_str());
             wrefresh(w);
         } else if (input.find("/kick") == 0) {
-            input = "KICK --- " + input.substr(6);
+            msg = irc::message(irc::command::kick, split_params(argument(input, 6), { "---" }));
         } else if (input.find("/mute") == 0) {
-            input = "MODE --- -v " + input.substr(6);
+            msg = irc::message(irc::command::mode, split_params(argument(input, 6), { "---", "-v" }));
         } else if (input.find("/unmute") == 0) {
-            input = "MODE --- +v " + input.substr(8);
+            msg = irc::message(irc::command::mode, split_params(argument(input, 8), { "---", "+v" }));
         } else if (input.find("/whois") == 0) {
-            input = "WHOIS " + input.substr(7);
+            msg = irc::message(irc::command::whois, split_params(argument(input, 7)));
         } else {
-            input = "PRIVMSG --- :" + input;
+            msg = irc::message(irc::command::privmsg, { "---", std::move(input) });
         }
 
-        input.push_back('\n');
-        std::string_view slice = input;
-
-        while (slice.size() > 0) {
-            // Get the substring within the maximum allowed size
-            std::string s(slice.substr(0, MAX_SIZE));
-
-            std::string_view to_send = s;
-            while (to_send.size() > 0) {
-                int nsent = cli.send(reinterpret_cast<const uint8_t*>(s.data()), s.size());
-                if (nsent < 0) THROW_ERRNO("send failed");
-                if (nsent == 0) {
-                    shutdown(shutdown_eventfd);
-                    break;
-                }
-                to_send = to_send.substr(nsent);
+        // The buffer is reused, so it stops allocating after the first few messages.
+        send_buf.clear();
+        msg.encode_into(send_buf, irc::message::framing::crlf);
+
+        std::string_view to_send = send_buf;
+        while (to_send.size() > 0) {
+            int nsent = cli.send(reinterpret_cast<const uint8_t*>(to_send.data()), to_send.size());
+            if (nsent < 0) THROW_ERRNO("send failed");
+            if (nsent == 0) {
+                shutdown(shutdown_eventfd);
+                break;
             }
-            if (!RUN) break;
+            to_send = to_send.substr(nsent);
+        }
+    }
+}
 
-            slice = slice.substr(s.size());
+// Displays a message received from the server, or answers it. `pong` is a buffer reused for the
+// answers to PINGs.
+void handle_message(WINDOW* w, tcpstream& cli, const irc::message& msg, std::string& pong) {
+    if (std::holds_alternative<irc::numeric_reply>(msg.command)) {
+        irc::numeric_reply cmd = std::get<irc::numeric_reply>(msg.command);
+        if (cmd == irc::RPL_WHOISUSER) {
+            wprintw(w, "User has username '%s' and real name '%s' with ip %s\n",
+                    msg.params.at(0).c_str(), msg.params.at(3).c_str(), msg.params.at(1).c_str());
+        } else {
+            // Must be an error
+            wprintw(w, "Error %d:", (int)cmd);
+            for (auto& param : msg.params) wprintw(w, " %s", param.c_str());
+            wprintw(w, "\n");
+        }
+    } else {
+        irc::command cmd = std::get<irc::command>(msg.command);
+
+        switch (cmd) {
+            case irc::command::privmsg:
+                wprintw(w, "[%s]: %s\n", msg.prefix.value().c_str(), msg.params.back().c_str());
+                break;
+            case irc::command::pong:
+                wprintw(w, "pong\n");
+                break;
+            case irc::command::ping:
+            {
+                // Keepalive from the server, which disconnects clients that don't answer.
+                pong.clear();
+                irc::message(irc::command::pong, msg.params).encode_into(pong, irc::message::framing::crlf);
+                if (cli.send(reinterpret_cast<const uint8_t*>(pong.data()), pong.size()) < 0)
+                    THROW_ERRNO("send failed");
+                return;
+            }
+
+            // Other messages are to be ignored by the client (shouldn't even be received).
+            default: break;
         }
     }
+    wrefresh(w);
 }
 
 // Receive thread. This receives data from the server and displays it in the chat view. The eventfd
@@ -174,6 +225,7 @@ void send_message(WINDOW* w, tcpstream& cli, int shutdown_eventfd) {
 void recv_message(WINDOW* w, tcpstream& cli, int shutdown_eventfd) {
     std::array<uint8_t, MAX_SIZE> recv_buf;
     std::string msg_str;
+    std::string pong;
 
     int epollfd = epoll_create1(0);
     if (epollfd < 0) THROW_ERRNO("epoll_create1 failed");
@@ -206,49 +258,26 @@ void recv_message(WINDOW* w, tcpstream& cli, int shutdown_eventfd) {
         }
 
         msg_str.append(recv_buf.cbegin(), recv_buf.cbegin() + nread);
-        size_t end_pos = msg_str.find('\n');
-        // Not a full message yet
-        if (end_pos == std::string::npos) continue;
-
-        irc::message msg;
-        try {
-            msg = irc::message::parse(std::string_view(msg_str).substr(0, end_pos + 1));
-            msg_str = msg_str.substr(end_pos + 1);
-        } catch (irc::message::parse_error e) {
-            msg_str = msg_str.substr(end_pos + 1);
-            std::scoped_lock<std::mutex> lock(print_mutex);
-            wprintw(w, "%s\n", e.what());
-            wrefresh(w);
-            continue;
-        }
 
-        if (std::holds_alternative<irc::numeric_reply>(msg.command)) {
-            irc::numeric_reply cmd = std::get<irc::numeric_reply>(msg.command);
-            if (cmd == irc::RPL_WHOISUSER) {
-                wprintw(w, "User has username '%s' and real name '%s' with ip %s\n",
-                        msg.params.at(0).c_str(), msg.params.at(3).c_str(), msg.params.at(1).c_str());
-            } else {
-                // Must be an error
-                wprintw(w, "Error %d:", (int)cmd);
-                for (auto& param : msg.params) wprintw(w, " %s", param.c_str());
-                wprintw(w, "\n");
-            }
-        } else {
-            irc::command cmd = std::get<irc::command>(msg.command);
-
-            switch (cmd) {
-                case irc::command::privmsg:
-                    wprintw(w, "[%s]: %s\n", msg.prefix.value().c_str(), msg.params.back().c_str());
-                    break;
-                case irc::command::pong:
-                    wprintw(w, "pong\n");
-                    break;
-
-                // Other messages are to be ignored by the client (shouldn't even be received).
-                default: break;
+        // Handle every complete line received so far, and keep the partial one for later.
+        irc::line_scanner scanner(msg_str.data(), msg_str.size());
+        std::string_view line;
+        bool has_nul;
+        while (scanner.next(line, has_nul)) {
+            if (line.empty() || has_nul) continue;
+
+            irc::message msg;
+            try {
+                msg = irc::message::parse(line);
+            } catch (irc::message::parse_error e) {
+                std::scoped_lock<std::mutex> lock(print_mutex);
+                wprintw(w, "%s\n", e.what());
+                wrefresh(w);
+                continue;
             }
+            handle_message(w, cli, msg, pong);
         }
-        wrefresh(w);
+        msg_str.erase(0, msg_str.size() - scanner.rest().size());
     }
 }
 
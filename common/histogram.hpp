@@ -0,0 +1,102 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+// The histograms of the metrics of the server, also used by the benchmarks, so both bucket
+// latencies the same way.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace irc {
+
+    // A number written by a single thread and read by any. Since there is a single writer, adding
+    // is a plain load and store instead of an atomic read-modify-write.
+    class metric_value {
+    public:
+        void add(uint64_t n = 1) { set(get() + n); }
+        void set(uint64_t n) { _value.store(n, std::memory_order_relaxed); }
+        uint64_t get() const { return _value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> _value = 0;
+    };
+
+    // A histogram with log-linear buckets, like an HDR histogram: the values under `sub_buckets`
+    // have a bucket each, and every power of two above is split into `sub_buckets` buckets. So
+    // a recorded value is known within 1/16 of it, from nanoseconds to minutes, in a fixed 4.6 KiB.
+    // Written by a single thread, like `metric_value`.
+    class histogram {
+    public:
+        static const constexpr unsigned sub_bucket_bits = 4;
+        static const constexpr uint64_t sub_buckets = 1 << sub_bucket_bits;
+        // Larger values are counted as the largest (about 18 minutes, in nanoseconds).
+        static const constexpr uint64_t max_value = ((uint64_t)1 << 40) - 1;
+        static const constexpr size_t n_buckets = (40 - sub_bucket_bits + 1) * sub_buckets;
+
+        // The histograms of many threads, merged.
+        struct snapshot {
+            std::array<uint64_t, n_buckets> counts {};
+            uint64_t count = 0;
+            uint64_t sum = 0;
+            uint64_t max = 0;
+
+            // The highest value of the bucket the `q`th quantile (from 0 to 1) falls in, so never
+            // less than the actual quantile, nor more than the largest value recorded.
+            uint64_t quantile(double q) const {
+                if (count == 0) return 0;
+                // The rank of the quantile, counting from one.
+                uint64_t rank = std::max<uint64_t>(1, (uint64_t)(q * count + 0.5));
+                uint64_t seen = 0;
+                for (size_t i = 0; i < n_buckets; i++) {
+                    seen += counts[i];
+                    if (seen >= rank) return std::min(bucket_max(i), max);
+                }
+                return max;
+            }
+        };
+
+        void record(uint64_t value) {
+            value = std::min(value, max_value);
+            _counts[bucket_of(value)].add();
+            _count.add();
+            _sum.add(value);
+            if (value > _max.get()) _max.set(value);
+        }
+
+        void record(std::chrono::nanoseconds d) { record((uint64_t)std::max<int64_t>(d.count(), 0)); }
+
+        void add_to(snapshot& s) const {
+            for (size_t i = 0; i < n_buckets; i++) s.counts[i] += _counts[i].get();
+            s.count += _count.get();
+            s.sum += _sum.get();
+            s.max = std::max(s.max, _max.get());
+        }
+
+        static constexpr size_t bucket_of(uint64_t value) {
+            if (value < sub_buckets) return value;
+            unsigned shift = 63 - __builtin_clzll(value) - sub_bucket_bits;
+            return (shift + 1) * sub_buckets + ((value >> shift) & (sub_buckets - 1));
+        }
+
+        static constexpr uint64_t bucket_max(size_t bucket) {
+            if (bucket < sub_buckets) return bucket;
+            unsigned shift = bucket / sub_buckets - 1;
+            return ((sub_buckets + bucket % sub_buckets) << shift) + ((uint64_t)1 << shift) - 1;
+        }
+
+    private:
+        std::array<metric_value, n_buckets> _counts;
+        metric_value _count;
+        metric_value _sum;
+        metric_value _max;
+    };
+
+    static_assert(histogram::bucket_of(histogram::max_value) == histogram::n_buckets - 1);
+    static_assert(histogram::bucket_max(histogram::bucket_of(1000)) >= 1000);
+}
+
+#endif
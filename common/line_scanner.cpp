@@ -0,0 +1,160 @@
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LINE_SCANNER_X86
+#endif
+
+#include "line_scanner.hpp"
+
+namespace irc {
+
+    namespace {
+        static const constexpr size_t block_size = 64;
+        static const constexpr size_t unconditional_writes = 4;
+
+        // Writes the offset of every bit set in `bits` to `out`, and returns how many there are.
+        // The first offsets are written without checking how many bits there are, which would be
+        // a hard to predict branch for every block, so a few entries past the returned count may
+        // be overwritten. Lines are rarely shorter than 16 bytes, so a block seldom has more than
+        // 4 delimiters.
+        inline size_t flatten(uint64_t bits, uint32_t base, uint32_t *out) {
+            size_t n = __builtin_popcountll(bits);
+            for (size_t i = 0; i < unconditional_writes; i++) {
+                // The bit forced on only matters once `bits` is empty, when the entry is unused.
+                out[i] = base + __builtin_ctzll(bits | (1ull << 63));
+                bits &= bits - 1;
+            }
+            for (size_t i = unconditional_writes; i < n; i++) {
+                out[i] = base + __builtin_ctzll(bits);
+                bits &= bits - 1;
+            }
+            return n;
+        }
+
+        size_t index_scalar(const char *data, size_t n_blocks, uint32_t base, uint32_t *out,
+                            bool& seen_nul) {
+            size_t count = 0;
+            for (size_t b = 0; b < n_blocks; b++, data += block_size, base += block_size) {
+                uint64_t delims = 0;
+                for (size_t i = 0; i < block_size; i++) {
+                    char c = data[i];
+                    if (c == '\r' || c == '\n') delims |= 1ull << i;
+                    if (c == '\0')              seen_nul = true;
+                }
+                count += flatten(delims, base, out + count);
+            }
+            return count;
+        }
+
+#ifdef LINE_SCANNER_X86
+        __attribute__((target("sse2")))
+        size_t index_sse2(const char *data, size_t n_blocks, uint32_t base, uint32_t *out,
+                          bool& seen_nul) {
+            const __m128i cr = _mm_set1_epi8('\r');
+            const __m128i lf = _mm_set1_epi8('\n');
+            const __m128i zero = _mm_setzero_si128();
+
+            size_t count = 0;
+            __m128i nuls = zero;
+            for (size_t b = 0; b < n_blocks; b++, data += block_size, base += block_size) {
+                uint64_t delims = 0;
+                for (size_t i = 0; i < block_size; i += 16) {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+                    __m128i delim = _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf));
+                    delims |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(delim))) << i;
+                    nuls = _mm_or_si128(nuls, _mm_cmpeq_epi8(v, zero));
+                }
+                count += flatten(delims, base, out + count);
+            }
+            if (_mm_movemask_epi8(nuls)) seen_nul = true;
+            return count;
+        }
+
+        __attribute__((target("avx2,popcnt,bmi")))
+        size_t index_avx2(const char *data, size_t n_blocks, uint32_t base, uint32_t *out,
+                          bool& seen_nul) {
+            const __m256i cr = _mm256_set1_epi8('\r');
+            const __m256i lf = _mm256_set1_epi8('\n');
+            const __m256i zero = _mm256_setzero_si256();
+
+            size_t count = 0;
+            __m256i nuls = zero;
+            for (size_t b = 0; b < n_blocks; b++, data += block_size, base += block_size) {
+                __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+                __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+                __m256i delim_lo = _mm256_or_si256(_mm256_cmpeq_epi8(lo, cr), _mm256_cmpeq_epi8(lo, lf));
+                __m256i delim_hi = _mm256_or_si256(_mm256_cmpeq_epi8(hi, cr), _mm256_cmpeq_epi8(hi, lf));
+                uint64_t delims = static_cast<uint32_t>(_mm256_movemask_epi8(delim_lo))
+                                | static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(delim_hi))) << 32;
+                nuls = _mm256_or_si256(nuls, _mm256_or_si256(_mm256_cmpeq_epi8(lo, zero),
+                                                             _mm256_cmpeq_epi8(hi, zero)));
+                count += flatten(delims, base, out + count);
+            }
+            if (_mm256_movemask_epi8(nuls)) seen_nul = true;
+            return count;
+        }
+#endif
+
+        struct scanner_impl {
+            detail::index_fn index;
+            const char *name;
+        };
+
+        scanner_impl pick_implementation() {
+#ifdef LINE_SCANNER_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")
+                && __builtin_cpu_supports("bmi"))
+                return { index_avx2, "avx2" };
+            if (__builtin_cpu_supports("sse2")) return { index_sse2, "sse2" };
+#endif
+            return { index_scalar, "scalar" };
+        }
+
+        const scanner_impl& current() {
+            static const scanner_impl impl = pick_implementation();
+            return impl;
+        }
+    }
+
+    line_scanner::line_scanner(const char *data, size_t size)
+        : _index_blocks(current().index)
+        , _data(data)
+        , _size(size)
+    { }
+
+    bool line_scanner::refill() {
+        _count = 0;
+        _next = 0;
+        if (_indexed >= _size) return false;
+
+        size_t end = std::min(_indexed + blocks_per_refill * block_size, _size);
+        size_t n_blocks = (end - _indexed) / block_size;
+        _count = _index_blocks(_data + _indexed, n_blocks, _indexed, _index.data(), _seen_nul);
+
+        // The last bytes of the data, if they don't make a whole block.
+        for (size_t i = _indexed + n_blocks * block_size; i < end; i++) {
+            char c = _data[i];
+            if (c == '\r' || c == '\n') _index[_count++] = i;
+            if (c == '\0')              _seen_nul = true;
+        }
+
+        _indexed = end;
+        return true;
+    }
+
+    std::string_view line_scanner::rest() const {
+        return std::string_view(_data + _pos, _size - std::min(_pos, _size));
+    }
+
+    size_t line_scanner::find_delimiter(const char *data, size_t size) {
+        line_scanner scanner(data, size);
+        std::string_view line;
+        bool has_nul;
+        return scanner.next(line, has_nul) ? line.size() : size;
+    }
+
+    const char* line_scanner::implementation() { return current().name; }
+}
@@ -0,0 +1,95 @@
+#ifndef _LINE_SCANNER_H
+#define _LINE_SCANNER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace irc {
+
+    namespace detail {
+        // Writes the offsets of the delimiters of `n_blocks` 64-byte blocks to `out`, counting
+        // from `base`, and returns how many there are. Sets `seen_nul` if there are NUL bytes.
+        using index_fn = size_t (*)(const char *data, size_t n_blocks, uint32_t base, uint32_t *out,
+                                    bool& seen_nul);
+    }
+
+    // Splits received data into lines. A line ends with `\r\n`, like standard clients send, or
+    // with a bare `\r` or `\n`. A `\r\n` split between two chunks of data yields an empty line,
+    // so callers are expected to skip empty lines. Lines containing NUL bytes, which the RFC
+    // forbids anywhere in a message, are flagged.
+    //
+    // The data is compared 64 bytes at a time against the delimiters and NUL, with AVX2 or SSE2
+    // when the CPU supports them (picked once at runtime) and a scalar loop otherwise. The
+    // offsets of the delimiters found in a few blocks are written to an index, which `next` walks
+    // without looking at the data again.
+    //
+    // The data must be smaller than 4 GiB.
+    class line_scanner {
+    public:
+        line_scanner(const char *data, size_t size);
+
+        // Finds the next complete line, without its delimiter. Returns `false` once there's no
+        // complete line left, in which case `rest` is the partial line at the end of the data.
+        bool next(std::string_view& line, bool& has_nul);
+
+        // The data after the last delimiter found by `next`.
+        std::string_view rest() const;
+
+        // The offset of the first delimiter of `data`, or `size` if there's none.
+        static size_t find_delimiter(const char *data, size_t size);
+
+        // The name of the implementation picked for this CPU (`avx2`, `sse2` or `scalar`).
+        static const char* implementation();
+
+    private:
+        static const constexpr size_t block_size = 64;
+        static const constexpr size_t blocks_per_refill = 8;
+
+        // Indexes the delimiters of the next blocks of data. Returns `false` if all of the data
+        // was already indexed.
+        bool refill();
+
+        // The implementation picked for this CPU.
+        detail::index_fn _index_blocks;
+
+        const char *_data;
+        size_t _size;
+
+        // Where the current line starts, and how much of the data was indexed.
+        size_t _pos = 0;
+        size_t _indexed = 0;
+
+        // The offsets of the delimiters found by the last refill, and the next one to hand out.
+        // Indexing a block may write a few entries past the ones it found.
+        std::array<uint32_t, blocks_per_refill * block_size + 4> _index;
+        size_t _count = 0;
+        size_t _next = 0;
+
+        // Whether a NUL byte was seen. They are rare enough that lines are only searched for them
+        // once there's one somewhere in the data.
+        bool _seen_nul = false;
+    };
+
+    inline bool line_scanner::next(std::string_view& line, bool& has_nul) {
+        size_t end;
+        do {
+            while (_next == _count) {
+                if (!refill()) return false;
+            }
+            end = _index[_next++];
+            // Skip the `\n` of a `\r\n`.
+        } while (end < _pos);
+
+        line = std::string_view(_data + _pos, end - _pos);
+        has_nul = _seen_nul && memchr(line.data(), '\0', line.size()) != nullptr;
+
+        _pos = end + 1;
+        if (_data[end] == '\r' && _pos < _size && _data[_pos] == '\n') _pos++;
+        return true;
+    }
+}
+
+#endif
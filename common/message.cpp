@@ -1,88 +1,107 @@
 #include <charconv>
-#include <sstream>
-#include <iterator>
-#include <cctype>
-#include <charconv>
+#include <cstring>
+#include <algorithm>
 
 #include <sys/eventfd.h>
 #include <unistd.h>
 
 #include "message.hpp"
+#include "protocol.hpp"
 #include "utils.hpp"
 
 
 namespace irc {
 
     std::ostream& operator<<(std::ostream& os, enum command cmd) {
-        switch (cmd) {
-            // case irc::command::pass:    os << "PASS";    break;
-            case irc::command::nick:    os << "NICK";    break;
-            case irc::command::user:    os << "USER";    break;
-            case irc::command::privmsg: os << "PRIVMSG"; break;
-            // case irc::command::notice:  os << "NOTICE";  break;
-            case irc::command::join:    os << "JOIN";    break;
-            case irc::command::whois:   os << "WHOIS";   break;
-            case irc::command::mode:    os << "MODE";    break;
-            case irc::command::ping:    os << "PING";    break;
-            case irc::command::pong:    os << "PONG";    break;
-            case irc::command::quit:    os << "QUIT";    break;
-            case irc::command::kick:    os << "KICK";    break;
-        }
-        return os;
+        return os << command_name(cmd);
     }
 
-    /* implementations for `message` */
+    /* implementations for `message_view` */
 
-    message message::parse(std::string_view s) {
-        std::optional<std::string> prefix;
-        if (s.at(0) == ':') {
-            auto space_idx = s.find(" ");
-            if (space_idx == std::string_view::npos) throw parse_error("expected space");
-            prefix = s.substr(1, space_idx - 1);
+    std::string_view message_view::param_list::at(size_t i) const {
+        if (i >= _size) throw std::out_of_range("message param index out of range");
+        return _params[i];
+    }
+
+    void message_view::param_list::push_back(std::string_view param) {
+        if (_size < capacity) _params[_size++] = param;
+    }
+
+    // Unlike `std::isdigit`, takes any byte a client sends (a negative `char` is undefined
+    // behavior there) and doesn't depend on the locale.
+    static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+    message_view::parse_status message_view::parse(std::string_view s, message_view& out) {
+        out.prefix = std::nullopt;
+        out.params = param_list();
+
+        // Strip the line terminator.
+        if (!s.empty() && s.back() == '\n') s.remove_suffix(1);
+        if (!s.empty() && s.back() == '\r') s.remove_suffix(1);
+        if (s.empty()) return parse_status::empty;
+
+        if (s[0] == ':') {
+            auto space_idx = s.find(' ');
+            if (space_idx == std::string_view::npos || space_idx == 1)
+                return parse_status::invalid_prefix;
+            out.prefix = s.substr(1, space_idx - 1);
             s = s.substr(space_idx + 1);
         }
 
-        std::variant<irc::command, irc::numeric_reply> command;
-        auto space_idx = s.find(" ");
-        if (space_idx == std::string_view::npos) space_idx = s.size() - 1;
+        auto space_idx = std::min(s.find(' '), s.size());
         auto cmd_name = s.substr(0, space_idx);
-        s = s.substr(space_idx + 1);
-
-        if      (cmd_name == "USER"    ) command = irc::command::user;
-        // else if (cmd_name == "PASS"    ) command = irc::command::pass;
-        else if (cmd_name == "NICK"    ) command = irc::command::nick;
-        else if (cmd_name == "PRIVMSG" ) command = irc::command::privmsg;
-        // else if (cmd_name == "NOTICE"  ) command = irc::command::notice;
-        else if (cmd_name == "JOIN"    ) command = irc::command::join;
-        else if (cmd_name == "WHOIS"   ) command = irc::command::whois;
-        else if (cmd_name == "PING"    ) command = irc::command::ping;
-        else if (cmd_name == "PONG"    ) command = irc::command::pong;
-        else if (cmd_name == "MODE"    ) command = irc::command::mode;
-        else if (cmd_name == "QUIT"    ) command = irc::command::quit;
-        else if (cmd_name == "KICK"    ) command = irc::command::kick;
-        else if (cmd_name.size() == 3 && std::all_of(cmd_name.cbegin(), cmd_name.cend(), static_cast<int(*)(int)>(&std::isdigit))) {
+        s = s.substr(std::min(space_idx + 1, s.size()));
+
+        if (auto cmd = lookup_command(cmd_name)) {
+            out.command = *cmd;
+        } else if (cmd_name.size() == 3 && std::all_of(cmd_name.cbegin(), cmd_name.cend(), is_digit)) {
             int n = 0;
-            auto res = std::from_chars(cmd_name.data(), cmd_name.data() + cmd_name.size(), n);
-            if (res.ptr == cmd_name.data()) throw parse_error("invalid numeric reply");
-            command = (irc::numeric_reply)n;
+            std::from_chars(cmd_name.data(), cmd_name.data() + cmd_name.size(), n);
+            out.command = (irc::numeric_reply)n;
+        } else {
+            return parse_status::unknown_command;
         }
-        else throw parse_error("unsupported command");
 
-        std::vector<std::string> params;
-        while (!s.empty() && s.at(0) != '\n') {
-            if (s.at(0) == ':') {
-                params.emplace_back(s.substr(1, s.size() - 2));
+        while (!s.empty()) {
+            // The last param can have spaces. After 14 params, the rest of the line is the last
+            // one even without the colon (RFC 2812, section 2.3.1).
+            if (s[0] == ':' || out.params.size() == param_list::capacity - 1) {
+                out.params.push_back(s[0] == ':' ? s.substr(1) : s);
                 break;
             }
 
-            auto space_idx = s.find(" ");
-            if (space_idx == std::string_view::npos) space_idx = s.size() - 1;
-            params.emplace_back(s.substr(0, space_idx));
-            s = s.substr(space_idx + 1);
+            space_idx = std::min(s.find(' '), s.size());
+            if (space_idx > 0) out.params.push_back(s.substr(0, space_idx));
+            s = s.substr(std::min(space_idx + 1, s.size()));
         }
 
-        if (prefix) return message(*prefix, command, params);
-        return message(command, params);
+        return parse_status::ok;
+    }
+
+    const char* message_view::describe(parse_status status) {
+        switch (status) {
+            case parse_status::ok:              return "ok";
+            case parse_status::empty:           return "empty message";
+            case parse_status::invalid_prefix:  return "invalid prefix";
+            case parse_status::unknown_command: return "unsupported command";
+        }
+        UNREACHABLE();
+    }
+
+    /* implementations for `message` */
+
+    message message::parse(std::string_view s) {
+        message_view view;
+        auto status = message_view::parse(s, view);
+        if (status != message_view::parse_status::ok) throw parse_error(message_view::describe(status));
+        return message(view);
+    }
+
+    message::message(const message_view& view)
+        : command(view.command)
+        , params(view.params.begin(), view.params.end())
+    {
+        if (view.prefix) prefix = std::string(*view.prefix);
     }
 
     message::message(std::string prefix, std::variant<enum command, numeric_reply> command,
@@ -97,15 +116,60 @@ namespace irc {
         , params(params)
     { }
 
-    std::string message::to_string() const {
-        std::ostringstream ss;
-        if (prefix) ss << ":" << *prefix << " ";
-        std::visit([&](auto&& cmd) { ss << cmd << " "; }, command);
-        if (params.size() > 0) {
-            std::copy(params.cbegin(), params.cend() - 1, std::ostream_iterator<std::string>(ss, " "));
-            ss << ":" << params.back();
+    // Numeric replies are always sent with three digits.
+    static const constexpr size_t numeric_reply_digits = 3;
+
+    size_t message::encoded_size(framing f) const {
+        size_t size = 0;
+        if (prefix) size += 1 + prefix->size() + 1;
+        if (auto cmd = std::get_if<enum command>(&command)) size += command_name(*cmd).size();
+        else size += numeric_reply_digits;
+        for (const auto& param : params) size += 1 + param.size();
+        // The colon of the last param.
+        if (!params.empty()) size++;
+        return size + (f == framing::crlf ? 2 : 1);
+    }
+
+    void message::encode_into(std::string& buffer, framing f) const {
+        size_t start = buffer.size();
+        buffer.resize(start + encoded_size(f));
+        char *p = buffer.data() + start;
+
+        auto write = [&](std::string_view s) {
+            std::memcpy(p, s.data(), s.size());
+            p += s.size();
+        };
+
+        if (prefix) {
+            *p++ = ':';
+            write(*prefix);
+            *p++ = ' ';
+        }
+
+        if (auto cmd = std::get_if<enum command>(&command)) {
+            write(command_name(*cmd));
+        } else {
+            char digits[numeric_reply_digits];
+            auto reply = static_cast<int>(std::get<numeric_reply>(command));
+            size_t n = std::to_chars(std::begin(digits), std::end(digits), reply).ptr - digits;
+            // Pad with leading zeros.
+            p = std::fill_n(p, numeric_reply_digits - n, '0');
+            write(std::string_view(digits, n));
+        }
+
+        for (size_t i = 0; i < params.size(); i++) {
+            *p++ = ' ';
+            if (i == params.size() - 1) *p++ = ':';
+            write(params[i]);
         }
-        ss << std::endl;
-        return ss.str();
+
+        if (f == framing::crlf) *p++ = '\r';
+        *p++ = '\n';
+    }
+
+    std::string message::to_string(framing f) const {
+        std::string s;
+        encode_into(s, f);
+        return s;
     }
 }
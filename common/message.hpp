@@ -8,20 +8,37 @@
 #include <vector>
 #include <variant>
 #include <iostream>
+#include <array>
+#include <string_view>
 
 #include "utils.hpp"
 
 namespace irc {
-    enum numeric_reply {
+    // The maximum length of a message, counting the line terminator (RFC 1459, section 2.3).
+    static const constexpr size_t max_message_size = 512;
+
+    // The maximum length of a line, not counting its `\r\n`.
+    static const constexpr size_t max_line_length = max_message_size - 2;
+
+    // Any three-digit command parses to a numeric reply, not only the ones named here, so the
+    // underlying type is fixed: without it, a value out of the range of the names is undefined.
+    enum numeric_reply : int {
+        RPL_STATSCOMMANDS = 212,
+        RPL_ENDOFSTATS = 219,
+        RPL_STATSDEBUG = 249,
         RPL_WHOISUSER = 311,
+        RPL_YOUREOPER = 381,
         ERR_NOSUCHNICK = 401,
         ERR_NOSUCHCHANNEL = 403,
         ERR_CANNOTSENDTOCHAN = 404,
+        ERR_INPUTTOOLONG = 417,
         ERR_ERRONEUSNICKNAME = 432,
         ERR_NICKNAMEINUSE = 433,
         ERR_NOTONCHANNEL = 442,
         ERR_NEEDMOREPARAMS = 461,
         ERR_ALREADYREGISTERED = 462,
+        ERR_PASSWDMISMATCH = 464,
+        ERR_NOPRIVILEGES = 481,
         ERR_CHANOPRIVSNEEDED = 482,
     };
 
@@ -32,7 +49,7 @@ namespace irc {
         nick,        // 4.1.2
         user,        // 4.1.3
         // server,   // 4.1.4
-        // oper,     // 4.1.5
+        oper,        // 4.1.5
         quit,        // 4.1.6
         // squit,    // 4.1.7
         join,        // 4.2.1
@@ -44,7 +61,7 @@ namespace irc {
         // invite,   // 4.2.7
         kick,        // 4.2.8
         // version,  // 4.3.1
-        // status,   // 4.3.2
+        stats,       // 4.3.2
         // links,    // 4.3.3
         // time,     // 4.3.4
         // connect,  // 4.3.5
@@ -68,6 +85,55 @@ namespace irc {
 
     std::ostream& operator<<(std::ostream& os, enum command cmd);
 
+    // A message parsed in place: the prefix and the params point into the line it was parsed
+    // from, which must outlive the view. Parsing never allocates nor throws, so this is what the
+    // server uses for every line it receives. Use `message` when the message has to be kept or
+    // built.
+    struct message_view {
+        enum class parse_status {
+            ok,
+            empty,
+            invalid_prefix,
+            unknown_command,
+        };
+
+        // The params of a message, in a fixed-capacity array. The RFC allows at most 15 params per
+        // message, so no more are ever stored.
+        class param_list {
+        public:
+            static const constexpr size_t capacity = 15;
+
+            size_t size() const { return _size; }
+            bool empty() const { return _size == 0; }
+
+            // Throws `std::out_of_range` if `i` is not a valid index, like `std::vector::at`.
+            std::string_view at(size_t i) const;
+            std::string_view operator[](size_t i) const { return _params[i]; }
+            std::string_view back() const { return _params[_size - 1]; }
+
+            const std::string_view* begin() const { return _params.data(); }
+            const std::string_view* end() const { return _params.data() + _size; }
+
+            // Does nothing if the list is full.
+            void push_back(std::string_view param);
+
+        private:
+            std::array<std::string_view, capacity> _params;
+            size_t _size = 0;
+        };
+
+        // Parses a line, with or without its terminator (`\n` or `\r\n`). `out` is only valid
+        // if `ok` is returned.
+        static parse_status parse(std::string_view s, message_view& out);
+
+        // A short description of a parse status, for logging.
+        static const char* describe(parse_status status);
+
+        std::optional<std::string_view> prefix;
+        std::variant<enum command, numeric_reply> command;
+        param_list params;
+    };
+
     struct message {
         class parse_error : public std::exception {
         public:
@@ -91,46 +157,25 @@ namespace irc {
                 std::vector<std::string> params = std::vector<std::string>());
         message() = default;
 
-        std::string to_string() const;
-
-
-        static inline message no_such_nick() {
-            return message("server", ERR_NOSUCHNICK, { "No such nick/channel" });
-        }
+        // Copies every field of `view`.
+        explicit message(const message_view& view);
 
-        static inline message no_such_channel() {
-            return message("server", ERR_NOSUCHCHANNEL, { "No such channel" });
-        }
-
-        static inline message cannot_send_to_chan() {
-            return message("server", ERR_CANNOTSENDTOCHAN, { "Cannot send to channel" });
-        }
-
-        static inline message erroneus_nickname() {
-            return message("server", ERR_ERRONEUSNICKNAME, { "Erroneus nickname" });
-        }
-
-        static inline message nickname_in_use() {
-            return message("server", ERR_NICKNAMEINUSE, { "Nickname is already in use" });
-        }
-
-        static inline message not_on_channel() {
-            return message("server", ERR_NOTONCHANNEL, { "You're not on that channel" });
-        }
+        // The line terminator written by the encoders. RFC 1459 asks for `\r\n`, but a bare `\n`
+        // is accepted by the server and its client.
+        enum class framing {
+            lf,
+            crlf,
+        };
 
-        static inline message need_more_params(enum command cmd) {
-            std::stringstream ss;
-            ss << cmd;
-            return message("server", ERR_NEEDMOREPARAMS, { ss.str(), "Not enough parameters" });
-        }
+        // The exact number of bytes `encode_into` writes.
+        size_t encoded_size(framing f = framing::lf) const;
 
-        static inline message chann_op_priv_needed() {
-            return message("server", ERR_CHANOPRIVSNEEDED, { "You're not channel operator" });
-        }
+        // Appends the encoded message, terminator included, to `buffer`. The buffer grows at most
+        // once, to the exact size of the message, so a buffer reused between messages stops
+        // allocating once it's large enough.
+        void encode_into(std::string& buffer, framing f = framing::lf) const;
 
-        static inline message already_registered() {
-            return message("server", ERR_ALREADYREGISTERED, { "You may not reregister" });
-        }
+        std::string to_string(framing f = framing::lf) const;
     };
 }
 
@@ -0,0 +1,171 @@
+#ifndef _PROTOCOL_H
+#define _PROTOCOL_H
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <optional>
+#include <string_view>
+
+#include "message.hpp"
+
+// Tables of the protocol, built at compile time: recognizing a command is a single hash and
+// comparison, and the error replies the server sends are already encoded.
+namespace irc {
+
+    struct command_entry {
+        enum command cmd;
+        std::string_view name;
+        // The encoded ERR_NEEDMOREPARAMS reply for the command.
+        std::string_view need_more_params;
+    };
+
+#define IRC_COMMAND(cmd, name) { command::cmd, name, ":server 461 " name " :Not enough parameters\n" }
+
+    // Every supported command, in the order of `enum command`.
+    static const constexpr command_entry command_table[] = {
+        IRC_COMMAND(nick,    "NICK"),
+        IRC_COMMAND(user,    "USER"),
+        IRC_COMMAND(oper,    "OPER"),
+        IRC_COMMAND(quit,    "QUIT"),
+        IRC_COMMAND(join,    "JOIN"),
+        IRC_COMMAND(mode,    "MODE"),
+        IRC_COMMAND(kick,    "KICK"),
+        IRC_COMMAND(stats,   "STATS"),
+        IRC_COMMAND(privmsg, "PRIVMSG"),
+        IRC_COMMAND(whois,   "WHOIS"),
+        IRC_COMMAND(ping,    "PING"),
+        IRC_COMMAND(pong,    "PONG"),
+    };
+
+#undef IRC_COMMAND
+
+    struct reply_entry {
+        numeric_reply reply;
+        // `:server <code> `, to be followed by the params of the reply.
+        std::string_view prefix;
+        // The whole encoded reply, for the replies that are always sent with the same text. Empty
+        // for the ones that take params.
+        std::string_view line;
+    };
+
+#define IRC_REPLY(code, text) { numeric_reply(code), ":server " #code " ", ":server " #code " :" text "\n" }
+#define IRC_REPLY_WITH_PARAMS(code) { numeric_reply(code), ":server " #code " ", "" }
+
+    // Every numeric reply.
+    static const constexpr reply_entry reply_table[] = {
+        IRC_REPLY_WITH_PARAMS(212),
+        IRC_REPLY_WITH_PARAMS(219),
+        IRC_REPLY_WITH_PARAMS(249),
+        IRC_REPLY_WITH_PARAMS(311),
+        IRC_REPLY(381, "You are now an IRC operator"),
+        IRC_REPLY(401, "No such nick/channel"),
+        IRC_REPLY(403, "No such channel"),
+        IRC_REPLY(404, "Cannot send to channel"),
+        IRC_REPLY(417, "Input line was too long"),
+        IRC_REPLY(432, "Erroneus nickname"),
+        IRC_REPLY(433, "Nickname is already in use"),
+        IRC_REPLY(442, "You're not on that channel"),
+        IRC_REPLY_WITH_PARAMS(461),
+        IRC_REPLY(462, "You may not reregister"),
+        IRC_REPLY(464, "Password incorrect"),
+        IRC_REPLY(481, "Permission Denied- You're not an IRC operator"),
+        IRC_REPLY(482, "You're not channel operator"),
+    };
+
+#undef IRC_REPLY
+#undef IRC_REPLY_WITH_PARAMS
+
+    namespace detail {
+        constexpr bool command_table_is_ordered() {
+            for (size_t i = 0; i < std::size(command_table); i++)
+                if (static_cast<size_t>(command_table[i].cmd) != i) return false;
+            return true;
+        }
+        static_assert(command_table_is_ordered(), "command_table must follow the order of enum command");
+
+        // Only looks at the length and at the first two and the last characters of the name,
+        // which is enough to tell every command apart. The multiplier is searched for at compile
+        // time. `s` must have at least two characters.
+        constexpr uint32_t command_hash(std::string_view s, uint32_t seed) {
+            uint32_t key = static_cast<uint32_t>(s.size()) << 24
+                         | static_cast<uint32_t>(static_cast<uint8_t>(s[0])) << 16
+                         | static_cast<uint32_t>(static_cast<uint8_t>(s[1])) << 8
+                         | static_cast<uint8_t>(s.back());
+            return (key * seed) >> 27;
+        }
+
+        // The hash has 5 bits.
+        static const constexpr size_t command_slots = 32;
+        static const constexpr uint8_t no_command = 0xff;
+
+        // Finds the first multiplier that maps every command name to a different slot.
+        constexpr uint32_t find_command_seed() {
+            for (uint32_t seed = 0x9e3779b1u;; seed += 2) {
+                bool used[command_slots] = {};
+                bool collision = false;
+                for (const auto& e : command_table) {
+                    size_t slot = command_hash(e.name, seed) & (command_slots - 1);
+                    if (used[slot]) {
+                        collision = true;
+                        break;
+                    }
+                    used[slot] = true;
+                }
+                if (!collision) return seed;
+            }
+        }
+
+        static const constexpr uint32_t command_seed = find_command_seed();
+
+        constexpr std::array<uint8_t, command_slots> build_command_slots() {
+            std::array<uint8_t, command_slots> slots {};
+            for (auto& s : slots) s = no_command;
+            for (size_t i = 0; i < std::size(command_table); i++)
+                slots[command_hash(command_table[i].name, command_seed) & (command_slots - 1)] = i;
+            return slots;
+        }
+
+        // The index in `command_table` of the command hashed to each slot.
+        static const constexpr auto command_slot_table = build_command_slots();
+
+        static const constexpr size_t min_command_length = 4;
+        static const constexpr size_t max_command_length = 7;
+    }
+
+    // Maps a command token to its command. Commands are case sensitive, like everywhere else in
+    // the server.
+    constexpr std::optional<enum command> lookup_command(std::string_view name) {
+        if (name.size() < detail::min_command_length || name.size() > detail::max_command_length) return std::nullopt;
+        uint8_t i = detail::command_slot_table[detail::command_hash(name, detail::command_seed)
+                                               & (detail::command_slots - 1)];
+        if (i == detail::no_command || command_table[i].name != name) return std::nullopt;
+        return command_table[i].cmd;
+    }
+
+    constexpr std::string_view command_name(enum command cmd) {
+        return command_table[static_cast<size_t>(cmd)].name;
+    }
+
+    // The index of a reply in `reply_table`.
+    constexpr size_t reply_index(numeric_reply reply) {
+        for (size_t i = 0; i < std::size(reply_table); i++)
+            if (reply_table[i].reply == reply) return i;
+        UNREACHABLE();
+    }
+
+    // The encoded reply of a reply that is always sent with the same text.
+    constexpr std::string_view reply_line(numeric_reply reply) {
+        return reply_table[reply_index(reply)].line;
+    }
+
+    constexpr std::string_view need_more_params_line(enum command cmd) {
+        return command_table[static_cast<size_t>(cmd)].need_more_params;
+    }
+
+    static_assert(lookup_command("PRIVMSG") == command::privmsg);
+    static_assert(!lookup_command("PRIVMSGX") && !lookup_command("nick"));
+    static_assert(reply_line(ERR_NOSUCHNICK) == ":server 401 :No such nick/channel\n");
+}
+
+#endif
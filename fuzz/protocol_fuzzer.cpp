@@ -0,0 +1,140 @@
+// A fuzzer of the protocol code: what the server does with the bytes clients send. The input is
+// framed into lines by `line_scanner`, checked against a plain byte-by-byte split, and every line
+// is parsed by `message_view::parse` and `message::parse`, encoded back, and parsed again. Any
+// disagreement aborts, as do the crashes and undefined behavior the sanitizers catch.
+//
+// It's a libFuzzer target (`make fuzz`, which needs clang); `fuzz/standalone.cpp` runs it over
+// files or stdin instead, for AFL and for compilers without libFuzzer (`make fuzz-check`).
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "message.hpp"
+#include "line_scanner.hpp"
+
+#define FUZZ_CHECK(cond)                                                                     \
+    do {                                                                                     \
+        if (!(cond)) {                                                                       \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);   \
+            std::abort();                                                                    \
+        }                                                                                    \
+    } while (0)
+
+namespace {
+    struct line {
+        std::string_view text;
+        bool has_nul;
+    };
+
+    // How `line_scanner` should split `data`, one byte at a time.
+    std::vector<line> split_lines(std::string_view data, std::string_view& rest) {
+        std::vector<line> lines;
+        size_t pos = 0;
+        for (size_t i = 0; i < data.size(); i++) {
+            if (data[i] != '\r' && data[i] != '\n') continue;
+            auto text = data.substr(pos, i - pos);
+            lines.push_back({ text, text.find('\0') != std::string_view::npos });
+            if (data[i] == '\r' && i + 1 < data.size() && data[i + 1] == '\n') i++;
+            pos = i + 1;
+        }
+        rest = data.substr(pos);
+        return lines;
+    }
+
+    void check_framing(std::string_view data) {
+        std::string_view expected_rest;
+        auto expected = split_lines(data, expected_rest);
+
+        irc::line_scanner scanner(data.data(), data.size());
+        std::string_view text;
+        bool has_nul;
+        size_t n = 0;
+        while (scanner.next(text, has_nul)) {
+            FUZZ_CHECK(n < expected.size());
+            FUZZ_CHECK(text.data() == expected[n].text.data() && text.size() == expected[n].text.size());
+            FUZZ_CHECK(has_nul == expected[n].has_nul);
+            n++;
+        }
+        FUZZ_CHECK(n == expected.size());
+        FUZZ_CHECK(scanner.rest().data() == expected_rest.data()
+                   && scanner.rest().size() == expected_rest.size());
+
+        size_t first = expected.empty() ? data.size() : expected[0].text.size();
+        FUZZ_CHECK(irc::line_scanner::find_delimiter(data.data(), data.size()) == first);
+    }
+
+    bool within(std::string_view part, std::string_view whole) {
+        return part.data() >= whole.data() && part.data() + part.size() <= whole.data() + whole.size();
+    }
+
+    // Parses `s` both ways, and returns whether it's a message.
+    bool check_parse(std::string_view s, irc::message_view& view) {
+        auto status = irc::message_view::parse(s, view);
+        bool thrown = false;
+        try {
+            irc::message::parse(s);
+        } catch (irc::message::parse_error&) {
+            thrown = true;
+        }
+        FUZZ_CHECK(thrown == (status != irc::message_view::parse_status::ok));
+        if (status != irc::message_view::parse_status::ok) return false;
+
+        // Everything points into the line.
+        if (view.prefix) FUZZ_CHECK(!view.prefix->empty() && within(*view.prefix, s));
+        FUZZ_CHECK(view.params.size() <= irc::message_view::param_list::capacity);
+        for (size_t i = 0; i < view.params.size(); i++) {
+            FUZZ_CHECK(within(view.params[i], s));
+            FUZZ_CHECK(view.params.at(i).data() == view.params[i].data());
+        }
+        try {
+            view.params.at(view.params.size());
+            FUZZ_CHECK(!"at() past the end did not throw");
+        } catch (std::out_of_range&) { }
+        return true;
+    }
+
+    // A line without delimiters encodes to a message that parses back to the same fields.
+    void check_round_trip(const irc::message_view& view) {
+        irc::message msg(view);
+        for (auto f : { irc::message::framing::lf, irc::message::framing::crlf }) {
+            auto encoded = msg.to_string(f);
+            FUZZ_CHECK(encoded.size() == msg.encoded_size(f));
+            FUZZ_CHECK(encoded.back() == '\n');
+
+            std::string appended = "x";
+            msg.encode_into(appended, f);
+            FUZZ_CHECK(appended.substr(1) == encoded);
+
+            irc::message_view again;
+            FUZZ_CHECK(irc::message_view::parse(encoded, again) == irc::message_view::parse_status::ok);
+            FUZZ_CHECK(again.prefix.has_value() == view.prefix.has_value());
+            if (view.prefix) FUZZ_CHECK(*again.prefix == *view.prefix);
+            FUZZ_CHECK(again.command == view.command);
+            FUZZ_CHECK(again.params.size() == view.params.size());
+            for (size_t i = 0; i < view.params.size(); i++) FUZZ_CHECK(again.params[i] == view.params[i]);
+        }
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    std::string_view input((const char*)data, size);
+    irc::message_view view;
+
+    // The input as a single line, delimiters and all.
+    check_parse(input, view);
+
+    check_framing(input);
+    irc::line_scanner scanner(input.data(), input.size());
+    std::string_view text;
+    bool has_nul;
+    while (scanner.next(text, has_nul)) {
+        // The server drops lines with NUL bytes before parsing them.
+        if (has_nul) continue;
+        if (check_parse(text, view)) check_round_trip(view);
+    }
+    return 0;
+}
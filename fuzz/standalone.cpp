@@ -0,0 +1,59 @@
+// Runs a libFuzzer target without libFuzzer: over every file given (and the files of every
+// directory given), or over stdin when there are none, which is how AFL runs it. Used to
+// reproduce a crash, to check a corpus after a change, and to fuzz with compilers that don't
+// have libFuzzer:
+//
+//     afl-fuzz -i fuzz/corpus -o findings -- build/fuzz/protocol_check
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+namespace {
+    void run(const std::string& input) {
+        // A copy of its own, so the sanitizers catch reads past the end of the input.
+        std::vector<uint8_t> data(input.begin(), input.end());
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+
+    bool run_file(const std::filesystem::path& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            std::cerr << "failed to open '" << path.string() << "'" << std::endl;
+            return false;
+        }
+        run(std::string(std::istreambuf_iterator<char>(file), {}));
+        return true;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 1) {
+        run(std::string(std::istreambuf_iterator<char>(std::cin), {}));
+        return EXIT_SUCCESS;
+    }
+
+    size_t inputs = 0;
+    for (int i = 1; i < argc; i++) {
+        std::filesystem::path path = argv[i];
+        if (std::filesystem::is_directory(path)) {
+            for (const auto& entry : std::filesystem::recursive_directory_iterator(path)) {
+                if (!entry.is_regular_file()) continue;
+                if (!run_file(entry.path())) return EXIT_FAILURE;
+                inputs++;
+            }
+        } else {
+            if (!run_file(path)) return EXIT_FAILURE;
+            inputs++;
+        }
+    }
+    std::cerr << inputs << " inputs passed" << std::endl;
+}
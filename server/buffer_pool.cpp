@@ -0,0 +1,64 @@
+#include <utility>
+
+#include "buffer_pool.hpp"
+
+namespace irc {
+    // Each slab of a class is about this big, or a single buffer for the biggest classes.
+    static const constexpr size_t slab_bytes = 64 * 1024;
+
+    buffer_pool& buffer_pool::instance() {
+        static thread_local buffer_pool pool;
+        return pool;
+    }
+
+    buffer_pool::buffer_pool() {
+        static_assert(class_size(n_classes - 1) == max_size);
+        _classes.reserve(n_classes);
+        for (size_t i = 0; i < n_classes; i++)
+            _classes.emplace_back(class_size(i), slab_bytes / class_size(i));
+    }
+
+    size_t buffer_pool::class_of(size_t size) {
+        size_t size_class = 0;
+        while (class_size(size_class) < size) size_class++;
+        return size_class;
+    }
+
+    buffer_pool::lease buffer_pool::acquire(size_t size) {
+        if (size > max_size) return lease(new uint8_t[size], size, oversized);
+        size_t size_class = class_of(size);
+        auto data = static_cast<uint8_t*>(_classes[size_class].allocate());
+        return lease(data, class_size(size_class), size_class);
+    }
+
+    std::array<slab_allocator::stats, buffer_pool::n_classes> buffer_pool::stats() const {
+        std::array<slab_allocator::stats, n_classes> stats;
+        for (size_t i = 0; i < n_classes; i++) stats[i] = _classes[i].get_stats();
+        return stats;
+    }
+
+    buffer_pool::lease::lease(lease&& other)
+        : _data(std::exchange(other._data, nullptr))
+        , _size(other._size)
+        , _class(other._class)
+    { }
+
+    buffer_pool::lease& buffer_pool::lease::operator=(lease&& other) {
+        if (this != &other) {
+            reset();
+            _data = std::exchange(other._data, nullptr);
+            _size = other._size;
+            _class = other._class;
+        }
+        return *this;
+    }
+
+    buffer_pool::lease::~lease() { reset(); }
+
+    void buffer_pool::lease::reset() {
+        if (!_data) return;
+        if (_class == oversized) delete[] _data;
+        else                     instance()._classes[_class].deallocate(_data);
+        _data = nullptr;
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef _BUFFER_POOL_H
+#define _BUFFER_POOL_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "slab.hpp"
+
+namespace irc {
+
+    // A pool of buffers in power of two size classes, from `min_size` to `max_size` bytes, each
+    // class carved out of its own slabs (see `slab_allocator`). Connections lease their buffers
+    // from the pool only while they need them, and give them back when they are idle, so the
+    // memory of the buffers follows the connections that are active instead of every connection.
+    // Buffers bigger than `max_size` are rare, and are allocated from the heap instead.
+    //
+    // Every thread has its own pool, so each reactor leases from a pool of its own without locking.
+    class buffer_pool {
+    public:
+        static const constexpr size_t min_size = 64;
+        static const constexpr size_t max_size = 64 * 1024;
+        static const constexpr size_t n_classes = 11;
+
+        // A buffer leased from the pool, given back when the lease is destroyed or reset. Leases
+        // must be given back on the thread of their pool, which is how it's found again, so a
+        // lease is only as big as a pointer and a size.
+        class lease {
+        public:
+            lease() = default;
+            lease(lease&& other);
+            lease& operator=(lease&& other);
+            lease(const lease&) = delete;
+            lease& operator=(const lease&) = delete;
+            ~lease();
+
+            uint8_t* data() const { return _data; }
+            size_t size() const { return _data ? _size : 0; }
+            explicit operator bool() const { return _data != nullptr; }
+
+            // Gives the buffer back to the pool.
+            void reset();
+
+        private:
+            lease(uint8_t *data, size_t size, uint8_t size_class)
+                : _data(data), _size(size), _class(size_class) { }
+
+            uint8_t *_data = nullptr;
+            uint32_t _size = 0;
+            // `oversized` for the buffers from the heap.
+            uint8_t _class = 0;
+
+            friend class buffer_pool;
+        };
+
+        // The pool of the calling thread.
+        static buffer_pool& instance();
+
+        buffer_pool();
+        buffer_pool(const buffer_pool&) = delete;
+        buffer_pool(buffer_pool&&) = delete;
+
+        // Leases a buffer of at least `size` bytes.
+        lease acquire(size_t size);
+
+        // The occupancy of each size class.
+        std::array<slab_allocator::stats, n_classes> stats() const;
+
+        static constexpr size_t class_size(size_t size_class) { return min_size << size_class; }
+
+    private:
+        static const constexpr uint8_t oversized = 0xff;
+
+        static size_t class_of(size_t size);
+
+        std::vector<slab_allocator> _classes;
+    };
+}
+
+#endif
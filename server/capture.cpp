@@ -0,0 +1,122 @@
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "capture.hpp"
+#include "utils.hpp"
+#include "log.hpp"
+
+namespace irc {
+    // A thread hands its buffer over as soon as it gets this big, even in the middle of an
+    // iteration.
+    static const constexpr size_t flush_threshold = 64 * 1024;
+
+    // How long the writer sleeps between passes. Like the logger, it polls, so recording never
+    // has to wake it up.
+    static const constexpr auto writer_interval = std::chrono::milliseconds(10);
+
+    capture::capture(const std::string& path) {
+        _fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (_fd < 0) THROW_ERRNO("failed to open capture file '" << path << "'");
+        _start = poll_registry::clock::now();
+
+        std::string header(magic, sizeof(magic));
+        uint64_t wall = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        for (int i = 0; i < 8; i++) header += (char)(wall >> (i * 8));
+        write_out(header);
+
+        _writer = std::thread([this] { this->run(); });
+    }
+
+    capture::~capture() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _running = false;
+        }
+        _wake.notify_one();
+        _writer.join();
+        close(_fd);
+    }
+
+    std::string& capture::thread_buffer() {
+        static thread_local std::string buffer;
+        return buffer;
+    }
+
+    void capture::put_varint(std::string& out, uint64_t n) {
+        while (n >= 0x80) {
+            out += (char)(n | 0x80);
+            n >>= 7;
+        }
+        out += (char)n;
+    }
+
+    void capture::begin(std::string& out, record_type type, uint64_t id) {
+        auto since_start = poll_registry::instance().now() - _start;
+        out += (char)type;
+        put_varint(out, std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(
+            since_start).count()));
+        put_varint(out, id);
+    }
+
+    void capture::connected(uint64_t id, uint32_t ipv4) {
+        auto& out = thread_buffer();
+        begin(out, record_type::connect, id);
+        for (int i = 0; i < 4; i++) out += (char)(ipv4 >> (i * 8));
+    }
+
+    void capture::line(uint64_t id, std::string_view line) {
+        auto& out = thread_buffer();
+        begin(out, record_type::line, id);
+        put_varint(out, line.size());
+        out += line;
+        if (out.size() >= flush_threshold) flush();
+    }
+
+    void capture::disconnected(uint64_t id) {
+        begin(thread_buffer(), record_type::disconnect, id);
+    }
+
+    void capture::flush() {
+        auto& out = thread_buffer();
+        if (out.empty()) return;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pending.push_back(std::move(out));
+        out.clear();
+    }
+
+    void capture::run() {
+        std::vector<std::string> batch;
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            batch.swap(_pending);
+            bool running = _running;
+            lock.unlock();
+
+            for (auto& data : batch) write_out(data);
+            batch.clear();
+
+            lock.lock();
+            if (!running && _pending.empty()) return;
+            _wake.wait_for(lock, writer_interval, [this] { return !_running; });
+        }
+    }
+
+    void capture::write_out(const std::string& data) {
+        size_t written = 0;
+        while (written < data.size() && !_failed) {
+            ssize_t n = ::write(_fd, data.data() + written, data.size() - written);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                // The capture stops, but the server goes on.
+                LOG(error, "failed to write the capture ({}), recording stopped", strerror(errno));
+                _failed = true;
+                return;
+            }
+            written += n;
+        }
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "poll_registry.hpp"
+
+namespace irc {
+
+    // Records the traffic clients send to a file, to be replayed against a server later (see
+    // `bench/replay.cpp`): when each connection opens and closes, and every line it sends, as the
+    // message handler gets it. Recording appends to a buffer of the calling thread, without locks
+    // or system calls; once per iteration, the reactors hand their buffer to a writer thread (see
+    // `flush`), which appends it to the file.
+    //
+    // The file starts with `magic`, followed by the time the capture started (nanoseconds since the
+    // Unix epoch, 8 bytes, little-endian), and then by records:
+    //
+    // ```
+    // record     = type:u8 time:varint connection:varint body
+    // connect    = ipv4:u32-le           (the address of the peer)
+    // line       = length:varint bytes   (without the delimiter)
+    // disconnect =                       (nothing)
+    // ```
+    //
+    // Varints are LEB128 (7 bits per byte, least significant first). `time` is the time of the
+    // event loop iteration the event happened in, in nanoseconds since the capture started. Records
+    // of different threads are appended in batches, so the file is only ordered by time within a
+    // connection; readers sort it.
+    class capture {
+    public:
+        static const constexpr char magic[8] = { 'I', 'R', 'C', 'C', 'A', 'P', '1', '\n' };
+
+        enum class record_type : uint8_t {
+            connect,
+            line,
+            disconnect,
+        };
+
+        // Creates the file, replacing whatever was at `path`, and starts the writer thread.
+        capture(const std::string& path);
+        capture(const capture&) = delete;
+        capture(capture&&) = delete;
+        // Writes everything handed to the writer before returning.
+        ~capture();
+
+        // `ipv4` is in host byte order.
+        void connected(uint64_t id, uint32_t ipv4);
+        void line(uint64_t id, std::string_view line);
+        void disconnected(uint64_t id);
+
+        // Hands what the calling thread recorded to the writer thread. Records wait in the buffer
+        // of their thread until then.
+        void flush();
+
+    private:
+        std::string& thread_buffer();
+        void begin(std::string& out, record_type type, uint64_t id);
+        static void put_varint(std::string& out, uint64_t n);
+
+        // The body of the writer thread.
+        void run();
+        void write_out(const std::string& data);
+
+        int _fd = -1;
+        poll_registry::clock::time_point _start;
+
+        // Buffers handed over by `flush`, waiting for the writer.
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        std::vector<std::string> _pending;
+        bool _running = true;
+        bool _failed = false;
+        std::thread _writer;
+    };
+}
+
+#endif
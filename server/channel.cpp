@@ -1,22 +1,41 @@
+#include <algorithm>
+
 #include "channel.hpp"
+#include "metrics.hpp"
 
 namespace irc {
     channel::member& channel::add_member(irc::connection *conn) {
+        auto [it, inserted] = _index.try_emplace(conn->id(), (uint32_t)_members.size());
+        if (!inserted) return _members[it->second];
         member member = {
+            .id = conn->id(),
             .conn = conn,
             .is_muted = false,
             .is_operator = false,
+            .joined = _joins++,
         };
-        auto[it, _] = members.insert(std::make_pair(conn->id(), member));
-        return it->second;
+        return _members.emplace_back(member);
     }
 
     channel::member* channel::get_member(connection_id_t id) {
-        return &members.at(id);
+        auto it = _index.find(id);
+        return it == _index.end() ? nullptr : &_members[it->second];
     }
 
     bool channel::remove_member(connection_id_t id) {
-        return members.erase(id) == 1;
+        auto it = _index.find(id);
+        if (it == _index.end()) return false;
+        uint32_t i = it->second;
+        _index.erase(it);
+        if (_members[i].is_operator) _operators--;
+
+        // The last member takes the place of the removed one.
+        if (i != _members.size() - 1) {
+            _members[i] = _members.back();
+            _index.at(_members[i].id) = i;
+        }
+        _members.pop_back();
+        return true;
     }
 
     bool channel::mute(connection_id_t id) {
@@ -36,38 +55,39 @@ namespace irc {
     bool channel::make_operator(connection_id_t id) {
         member* member = get_member(id);
         if (!member) return false;
+        if (!member->is_operator) _operators++;
         member->is_operator = true;
         return true;
     }
 
-    void channel::send_message(irc::message msg) {
-        for (auto it = members.begin(); it != members.end(); it++) {
-            if (it->second.conn->is_connected()) {
-                // Send message and advance the iterator.
-                it->second.conn->send_message(msg.to_string());
-            }
+    bool channel::send_message(const irc::message& msg, bool droppable) {
+        auto encoded = std::make_shared<const std::string>(msg.to_string());
+        thread_metrics::local().message_allocations.add();
+
+        bool congested = false;
+        for (auto& member : _members) {
+            auto conn = member.conn;
+            if (!conn->is_connected()) continue;
+            conn->send_message(encoded, droppable);
+            congested = congested || conn->is_congested();
         }
+        return congested;
     }
 
-    // If there are no other operators in the channel, promotes a new user to operator. If a user
-    // is promoted, it's id is returned.
     std::optional<connection_id_t> channel::maybe_promote_operator() {
-        auto it = std::find_if(members.begin(), members.end(),
-                               [](auto& member){ return member.second.is_operator; });
-        if (it == members.end() && !members.empty()) {
-            auto& member = *members.begin();
-            member.second.is_operator = true;
-            return member.first;
-        }
-        return std::nullopt;
+        if (_operators > 0 || _members.empty()) return std::nullopt;
+        auto oldest = std::min_element(_members.begin(), _members.end(),
+                                       [](auto& a, auto& b) { return a.joined < b.joined; });
+        oldest->is_operator = true;
+        _operators++;
+        return oldest->id;
     }
 
-    bool channel::empty() const { return members.empty(); }
+    bool channel::empty() const { return _members.empty(); }
 
     std::string_view channel::name() const { return _name; }
 
     channel::channel(std::string_view name, irc::connection *conn) : _name(name) {
-        auto& ref = add_member(conn);
-        ref.is_operator = true;
+        make_operator(add_member(conn).id);
     }
 }
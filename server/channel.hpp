@@ -1,21 +1,36 @@
 #ifndef _CHANNEL_H
 #define _CHANNEL_H
 
-#include <unordered_map>
+#include <string>
 #include <string_view>
+#include <vector>
 
 #include "connection.hpp"
+#include "flat_map.hpp"
+#include "slot_map.hpp"
 
 namespace irc {
+    class channel;
+
+    // A channel in the `db`. Unlike a pointer, it doesn't dangle once the channel is deleted.
+    using channel_handle = slot_handle<channel>;
+
     class channel {
     public:
         struct member {
+            connection_id_t id;
+            // Members are removed from their channels before their connections are destroyed, with
+            // the database locked (see `server::remove_connection`), so the pointer is valid as
+            // long as the member is.
             irc::connection *conn;
             bool is_muted;
             bool is_operator;
+            // When the member joined, counted in joins to the channel. The oldest member is the
+            // one promoted to operator.
+            uint64_t joined;
         };
 
-        // Returns a member of the channel.
+        // Returns a member of the channel, or `nullptr` if the connection isn't a member.
         member* get_member(connection_id_t id);
 
         // Mutes a connection. Return `false` if unsuccessful.
@@ -27,8 +42,13 @@ namespace irc {
         // Make a connection operator. Returns `false` if unsuccessful.
         bool make_operator(connection_id_t id);
 
-        // Send a message to every member of the channel.
-        void send_message(irc::message msg);
+        // Send a message to every member of the channel. The message is encoded once, and the same
+        // buffer is queued to every member. Returns whether the send queue of any member is over
+        // its soft limit.
+        //
+        // Only the chat of members is `droppable` (see `connection::send_message`); notices of the
+        // server, like joins, quits and promotions, go to the control lane.
+        bool send_message(const irc::message& msg, bool droppable = false);
 
         // If there are no other operators in the channel, promotes a new user to operator. If a
         // user is promoted, it's id is returned.
@@ -36,6 +56,7 @@ namespace irc {
 
         bool empty() const;
 
+        // Only valid until the channels of the `db` change, since channels move around.
         std::string_view name() const;
 
     private:
@@ -47,10 +68,15 @@ namespace irc {
         // Removes a member from the channel. Return `false` if unsuccessful.
         bool remove_member(connection_id_t id);
 
-        // The name of the channel. Note that this `string_view` **must** point into the key of the map
-        // of the `_channels` member in `class db`. This allows the string to be allocated just once.
-        std::string_view _name;
-        std::unordered_map<connection_id_t, member> members;
+        std::string _name;
+
+        // Sending to the channel walks every member, so they are kept back to back, in no
+        // particular order: removing a member moves the last one into its place.
+        std::vector<member> _members;
+        // The index of every member in `_members`, by connection.
+        flat_map<connection_id_t, uint32_t> _index;
+        size_t _operators = 0;
+        uint64_t _joins = 0;
 
         friend class db;
     };
@@ -0,0 +1,173 @@
+#include <string_view>
+#include <charconv>
+#include <climits>
+#include <cstdint>
+
+#include <sys/un.h>
+
+#include "config.hpp"
+#include "utils.hpp"
+
+namespace irc {
+
+    static uint16_t parse_port(std::string_view s) {
+        uint16_t port = 0;
+        auto res = std::from_chars(s.data(), s.data() + s.size(), port);
+        if (res.ec != std::errc() || res.ptr != s.data() + s.size() || port == 0)
+            throw config::usage_error("invalid port '" + std::string(s) + "'");
+        return port;
+    }
+
+    static poll_registry::backend parse_backend(std::string_view s) {
+        if (s == "poll")  return poll_registry::backend::poll;
+        if (s == "epoll") return poll_registry::backend::epoll;
+        if (s == "uring") return poll_registry::backend::uring;
+        throw config::usage_error("unknown reactor '" + std::string(s) + "'");
+    }
+
+    static size_t parse_threads(std::string_view s) {
+        size_t n = 0;
+        auto res = std::from_chars(s.data(), s.data() + s.size(), n);
+        if (res.ec != std::errc() || res.ptr != s.data() + s.size() || n == 0 || n > 1024)
+            throw config::usage_error("invalid thread count '" + std::string(s) + "'");
+        return n;
+    }
+
+    static size_t parse_count(std::string_view s, size_t min, size_t max) {
+        size_t n = 0;
+        auto res = std::from_chars(s.data(), s.data() + s.size(), n);
+        if (res.ec != std::errc() || res.ptr != s.data() + s.size() || n < min || n > max)
+            throw config::usage_error("invalid count '" + std::string(s) + "'");
+        return n;
+    }
+
+    static std::chrono::seconds parse_seconds(std::string_view s, bool allow_zero) {
+        unsigned n = 0;
+        auto res = std::from_chars(s.data(), s.data() + s.size(), n);
+        if (res.ec != std::errc() || res.ptr != s.data() + s.size() || (n == 0 && !allow_zero))
+            throw config::usage_error("invalid number of seconds '" + std::string(s) + "'");
+        return std::chrono::seconds(n);
+    }
+
+    static size_t parse_bytes(std::string_view s) {
+        size_t n = 0;
+        auto res = std::from_chars(s.data(), s.data() + s.size(), n);
+        if (res.ec != std::errc() || res.ptr != s.data() + s.size() || n == 0)
+            throw config::usage_error("invalid number of bytes '" + std::string(s) + "'");
+        return n;
+    }
+
+    static config::overflow_policy parse_policy(std::string_view s) {
+        if (s == "drop")       return config::overflow_policy::drop;
+        if (s == "pause")      return config::overflow_policy::pause;
+        if (s == "disconnect") return config::overflow_policy::disconnect;
+        throw config::usage_error("unknown send queue policy '" + std::string(s) + "'");
+    }
+
+    static log_level parse_log_level(std::string_view s) {
+        if (s == "error") return log_level::error;
+        if (s == "warn")  return log_level::warn;
+        if (s == "info")  return log_level::info;
+        if (s == "debug") return log_level::debug;
+        throw config::usage_error("unknown log level '" + std::string(s) + "'");
+    }
+
+    static std::string parse_socket_path(std::string_view s) {
+        if (s.empty() || s.size() >= sizeof(sockaddr_un::sun_path))
+            throw config::usage_error("invalid socket path '" + std::string(s) + "'");
+        return std::string(s);
+    }
+
+    config config::from_args(int argc, char *argv[]) {
+        config cfg;
+        for (int i = 1; i < argc; i++) {
+            std::string_view arg = argv[i];
+
+            // Options without a value.
+            if (arg == "--pin-cpus") {
+                cfg.pin_cpus = true;
+                continue;
+            }
+
+            if (i + 1 >= argc) throw usage_error("missing value for '" + std::string(arg) + "'");
+            std::string_view value = argv[++i];
+
+            if      (arg == "--port")          cfg.port = parse_port(value);
+            else if (arg == "--reactor")       cfg.reactor = parse_backend(value);
+            else if (arg == "--threads")       cfg.threads = parse_threads(value);
+            else if (arg == "--backlog")       cfg.backlog = parse_count(value, 1, INT_MAX);
+            else if (arg == "--accept-budget") cfg.accept_budget = parse_count(value, 1, SIZE_MAX);
+            else if (arg == "--flood-rate")    cfg.flood_rate = parse_count(value, 0, 1000000);
+            else if (arg == "--flood-burst")   cfg.flood_burst = parse_count(value, 1, 1000000);
+            else if (arg == "--line-budget")   cfg.line_budget = parse_count(value, 1, SIZE_MAX);
+            else if (arg == "--ping-interval") cfg.ping_interval = parse_seconds(value, false);
+            else if (arg == "--ping-timeout")  cfg.ping_timeout = parse_seconds(value, false);
+            else if (arg == "--idle-timeout")  cfg.idle_timeout = parse_seconds(value, true);
+            else if (arg == "--sendq-soft")    cfg.sendq_soft = parse_bytes(value);
+            else if (arg == "--sendq-hard")    cfg.sendq_hard = parse_bytes(value);
+            else if (arg == "--sendq-policy")  cfg.sendq_policy = parse_policy(value);
+            else if (arg == "--log-level")     cfg.log_level = parse_log_level(value);
+            else if (arg == "--oper-password") cfg.oper_password = value;
+            else if (arg == "--registration-timeout")
+                cfg.registration_timeout = parse_seconds(value, false);
+            else if (arg == "--metrics-socket")
+                cfg.metrics_socket = parse_socket_path(value);
+            else if (arg == "--capture")       cfg.capture = value;
+            else throw usage_error("unknown option '" + std::string(arg) + "'");
+        }
+
+        if (cfg.sendq_soft > cfg.sendq_hard)
+            throw usage_error("the soft send queue limit can't be over the hard limit");
+        return cfg;
+    }
+
+    const char* config::usage() {
+        return "usage: server [options]\n"
+               "  --port <port>              port to listen on (default: " TOSTRING(PORT) ")\n"
+               "  --reactor <poll|epoll|uring>\n"
+               "                             event loop backend (default: epoll)\n"
+               "  --threads <n>              number of reactor threads (default: 1)\n"
+               "  --pin-cpus                 pin each reactor thread to its own CPU\n"
+               "  --backlog <n>              length of the queue of connections waiting to be\n"
+               "                             accepted (default: " TOSTRING(SOMAXCONN) ")\n"
+               "  --accept-budget <n>        most connections accepted per event loop iteration\n"
+               "                             (default: 64)\n"
+               "  --ping-interval <s>        idle time before a client is pinged (default: 120)\n"
+               "  --ping-timeout <s>         time a pinged client has to answer (default: 60)\n"
+               "  --flood-rate <lines/s>     lines per second a client can send once its burst is\n"
+               "                             spent, 0 to disable flood control (default: 10)\n"
+               "  --flood-burst <lines>      lines a client can send at once (default: 20)\n"
+               "  --line-budget <n>          most lines of a client handled per event loop\n"
+               "                             iteration (default: 32)\n"
+               "  --registration-timeout <s>\n"
+               "                             time a client has to register (default: 60)\n"
+               "  --idle-timeout <s>         disconnect clients that send no commands for this\n"
+               "                             long (default: 0, disabled)\n"
+               "  --sendq-soft <bytes>       send queue size that triggers the send queue policy\n"
+               "                             (default: 1048576)\n"
+               "  --sendq-hard <bytes>       send queue size that disconnects a client\n"
+               "                             (default: 8388608)\n"
+               "  --sendq-policy <drop|pause|disconnect>\n"
+               "                             what to do with clients over the soft limit\n"
+               "                             (default: drop)\n"
+               "  --log-level <error|warn|info|debug>\n"
+               "                             most verbose level logged, chat messages are only\n"
+               "                             logged at debug (default: info)\n"
+               "  --oper-password <password> password of the OPER command, which gives access to\n"
+               "                             STATS (default: none, nobody can be an operator)\n"
+               "  --metrics-socket <path>    Unix socket serving the metrics in the Prometheus\n"
+               "                             text format (default: none)\n"
+               "  --capture <path>           record the traffic of the clients to this file, to\n"
+               "                             replay it later (default: none)\n";
+    }
+
+    const char* config::backend_name(poll_registry::backend b) {
+        switch (b) {
+            case poll_registry::backend::poll:  return "poll";
+            case poll_registry::backend::epoll: return "epoll";
+            case poll_registry::backend::uring: return "uring";
+            case poll_registry::backend::sim:   return "sim";
+        }
+        UNREACHABLE();
+    }
+}
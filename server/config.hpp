@@ -0,0 +1,121 @@
+#ifndef _SERVER_CONFIG_H
+#define _SERVER_CONFIG_H
+
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <chrono>
+#include <string>
+
+#include <sys/socket.h>
+
+#include "poll_registry.hpp"
+#include "log.hpp"
+
+#define PORT 8080
+
+namespace irc {
+
+    // Runtime options of the server. Every option has a sensible default and can be changed from
+    // the command line.
+    struct config {
+        class usage_error : public std::runtime_error {
+        public:
+            usage_error(const std::string& msg) : std::runtime_error(msg) { }
+        };
+
+        uint16_t port = PORT;
+
+        // The length of the queue of connections waiting to be accepted, per listener
+        // (`--backlog <n>`). The kernel caps it at `net.core.somaxconn`.
+        int backlog = SOMAXCONN;
+
+        // The most connections a reactor accepts per event loop iteration (`--accept-budget <n>`).
+        // The rest wait for the next iteration, so a connection storm doesn't starve the clients
+        // already connected.
+        size_t accept_budget = 64;
+
+        // The mechanism used by the event loop to wait for events (`--reactor poll|epoll|uring`).
+        // `uring` falls back to `epoll` if the kernel doesn't support it.
+        poll_registry::backend reactor = poll_registry::backend::epoll;
+
+        // The number of reactor threads (`--threads <n>`). Each one runs its own event loop with
+        // its own listener socket.
+        size_t threads = 1;
+
+        // Whether each reactor thread should be pinned to its own CPU (`--pin-cpus`).
+        bool pin_cpus = false;
+
+        // Liveness of the clients. A client that sends nothing for `ping_interval` is sent a PING,
+        // and is disconnected if it still sends nothing within `ping_timeout` after that
+        // (`--ping-interval <s>`, `--ping-timeout <s>`).
+        std::chrono::seconds ping_interval { 120 };
+        std::chrono::seconds ping_timeout { 60 };
+
+        // Flood control, as described by RFC 1459 (section 8.10). Every line of a client moves a
+        // clock of the client `1 / flood_rate` seconds ahead, starting from the current time, and
+        // lines are only handled while the clock is less than `flood_burst` lines ahead. The lines
+        // over the limit wait, and the client isn't read from until they can be handled
+        // (`--flood-rate <lines/s>`, `--flood-burst <lines>`). A rate of zero disables it.
+        unsigned flood_rate = 10;
+        unsigned flood_burst = 20;
+
+        // The most lines of a single client handled per event loop iteration (`--line-budget <n>`).
+        // The rest wait for the next iteration, so the ready clients take turns.
+        size_t line_budget = 32;
+
+        // How long a client has to register (NICK and USER) before being disconnected
+        // (`--registration-timeout <s>`).
+        std::chrono::seconds registration_timeout { 60 };
+
+        // How long a registered client can go without sending a command, not counting PING and
+        // PONG, before being disconnected (`--idle-timeout <s>`). Zero disables it.
+        std::chrono::seconds idle_timeout { 0 };
+
+        // What to do when the send queue of a client goes over `sendq_soft`:
+        //
+        // - `drop`: drop the oldest channel messages of the queue until it is back under the limit.
+        // - `pause`: stop reading from the clients that send to a channel with such a member for a
+        //   while, so the senders slow down to the pace of the slowest member.
+        // - `disconnect`: disconnect the client.
+        enum class overflow_policy {
+            drop,
+            pause,
+            disconnect,
+        };
+
+        // Limits of the bytes queued to be sent to a single client (`--sendq-soft <bytes>`,
+        // `--sendq-hard <bytes>`). Going over the soft limit applies `sendq_policy`
+        // (`--sendq-policy drop|pause|disconnect`), going over the hard limit always disconnects.
+        size_t sendq_soft = 1 << 20;
+        size_t sendq_hard = 8 << 20;
+        overflow_policy sendq_policy = overflow_policy::drop;
+
+        // The most verbose level of the records logged (`--log-level error|warn|info|debug`). The
+        // contents of chat messages are only logged at `debug`.
+        irc::log_level log_level = irc::log_level::info;
+
+        // The password of the OPER command (`--oper-password <password>`). Server operators can
+        // use the STATS command. Without a password, nobody can become an operator.
+        std::string oper_password;
+
+        // Where to serve the metrics in the Prometheus text format, a Unix socket
+        // (`--metrics-socket <path>`). Empty disables it.
+        std::string metrics_socket;
+
+        // Where to record the lines clients send, and when they connect and disconnect
+        // (`--capture <path>`), to replay them later (see `capture`). The file is replaced. Empty
+        // disables it. The password of OPER commands isn't recorded.
+        std::string capture;
+
+        // Parses the command line arguments. Throws `usage_error` on unknown or malformed options.
+        static config from_args(int argc, char *argv[]);
+
+        // A short description of every option, to be printed on usage errors.
+        static const char* usage();
+
+        static const char* backend_name(poll_registry::backend b);
+    };
+}
+
+#endif
@@ -1,6 +1,7 @@
-#include <iostream>
-#include <iomanip>
 #include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <array>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -8,99 +9,476 @@
 
 #include "tcpstream.hpp"
 #include "connection.hpp"
+#include "protocol.hpp"
+#include "line_scanner.hpp"
 #include "utils.hpp"
 #include "poll_registry.hpp"
-
-#define MSG_SIZE_LIMIT 4096
+#include "log.hpp"
+#include "metrics.hpp"
 
 using namespace irc;
 
-connection::connection(tcpstream stream, size_t id, message_handler_type on_msg)
-    : _stream(std::move(stream))
-    , _id(id)
+// The send counters of a thread. They are only written by their own thread, but any thread can
+// read them to compute the totals.
+struct send_counters {
+    std::atomic<uint64_t> calls = 0;
+    std::atomic<uint64_t> bytes = 0;
+    std::atomic<uint64_t> buffers = 0;
+    std::atomic<uint64_t> queued_bytes = 0;
+    std::atomic<uint64_t> dropped_messages = 0;
+    std::atomic<uint64_t> dropped_bytes = 0;
+    std::atomic<uint64_t> overflow_disconnects = 0;
+    std::atomic<uint64_t> read_pauses = 0;
+    std::atomic<uint64_t> throttled_lines = 0;
+    std::atomic<uint64_t> budget_yields = 0;
+
+    void add_to(connection::send_stats& stats) const {
+        stats.calls                += calls.load(std::memory_order_relaxed);
+        stats.bytes                += bytes.load(std::memory_order_relaxed);
+        stats.buffers              += buffers.load(std::memory_order_relaxed);
+        stats.queued_bytes         += queued_bytes.load(std::memory_order_relaxed);
+        stats.dropped_messages     += dropped_messages.load(std::memory_order_relaxed);
+        stats.dropped_bytes        += dropped_bytes.load(std::memory_order_relaxed);
+        stats.overflow_disconnects += overflow_disconnects.load(std::memory_order_relaxed);
+        stats.read_pauses          += read_pauses.load(std::memory_order_relaxed);
+        stats.throttled_lines      += throttled_lines.load(std::memory_order_relaxed);
+        stats.budget_yields        += budget_yields.load(std::memory_order_relaxed);
+    }
+};
+
+// The counters of every thread. They outlive their threads, so the totals still count the
+// connections of threads that already exited.
+static std::mutex all_counters_mutex;
+static std::vector<std::unique_ptr<send_counters>> all_counters;
+
+static send_counters& counters() {
+    static thread_local send_counters *thread_counters = [] {
+        std::lock_guard<std::mutex> lock(all_counters_mutex);
+        return all_counters.emplace_back(std::make_unique<send_counters>()).get();
+    }();
+    return *thread_counters;
+}
+
+connection::send_stats connection::stats() {
+    send_stats stats;
+    counters().add_to(stats);
+    return stats;
+}
+
+connection::send_stats connection::total_stats() {
+    send_stats stats;
+    std::lock_guard<std::mutex> lock(all_counters_mutex);
+    for (auto& c : all_counters) c->add_to(stats);
+    return stats;
+}
+
+connection::connection(transport stream, size_t id, const message_handler_type& on_msg,
+                       const config& cfg, mailbox<letter_batch> *mailbox, connection_handle handle)
+    : _id(id)
+    , _owner(std::this_thread::get_id())
+    , _mailbox(mailbox)
+    , _handle(handle)
+    , _stream(std::move(stream))
     , _on_msg(on_msg)
+    , _cfg(cfg)
 {
-    _recv_tok = poll_registry::instance()
-        .register_event(raw_fd(), POLLIN,
-                        [&](short) { this->poll_recv(); });
+    _connected_at = _last_recv = _last_active = poll_registry::instance().now();
+    check_liveness();
+    start_recv();
 }
 
 connection::~connection() {
     // If we are already unregistered, that's fine, it will just do nothing.
     if (is_connected()) disconnect();
+    counters().queued_bytes -= _queued_bytes;
+}
+
+void connection::start_recv() {
+    auto& registry = poll_registry::instance();
+    if (registry.supports_completions()) {
+        _recv_tok = registry.recv_multishot(raw_fd(), [this](int res, const uint8_t *data) {
+            this->complete_recv(res, data);
+        });
+    } else {
+        _recv_tok = registry.register_event(raw_fd(), POLLIN,
+                                            [&](short) { this->poll_recv(); });
+    }
+}
+
+void connection::pause_reading(poll_registry::clock::duration duration) {
+    if (_paused || !is_connected()) return;
+    counters().read_pauses++;
+    stop_reading(poll_registry::instance().schedule_timer(duration, [this] {
+        this->resume_reading();
+    }));
+}
+
+void connection::stop_reading(poll_registry::token_type resume) {
+    _paused = true;
+    _resume_tok = resume;
+    if (!_recv_tok) return;
+
+    auto& registry = poll_registry::instance();
+    if (registry.supports_completions()) {
+        // What was already received still arrives, and is held back. The last completion clears
+        // `_recv_tok`.
+        registry.cancel(*_recv_tok);
+    } else {
+        registry.unregister_event(*_recv_tok);
+        _recv_tok = std::nullopt;
+    }
+}
+
+void connection::resume_reading() {
+    _resume_tok = std::nullopt;
+    _paused = false;
+    if (!is_connected()) return;
+
+    // The lines held back go first, and handling them may stop reading again.
+    if (_recv_idx > 0) {
+        frame(_recv_buf.data(), _recv_idx);
+        if (_recv_idx == 0) _recv_buf.reset();
+        if (_paused || !is_connected()) return;
+    }
+
+    // If a cancelled receive hasn't finished yet, it restarts once it does.
+    if (_recv_tok) return;
+    start_recv();
+    // Edge-triggered backends only notify of data that arrives from now on.
+    if (!poll_registry::instance().supports_completions()) poll_recv();
+}
+
+// Where readiness-based backends receive into. It belongs to the thread, so it's shared by every
+// connection of a reactor, and idle connections don't need a buffer of their own.
+static std::array<uint8_t, scratch_size>& scratch_buffer() {
+    static thread_local std::array<uint8_t, scratch_size> buffer;
+    return buffer;
 }
 
 void connection::poll_recv() {
-    ssize_t n_recv = _stream.nonblocking_recv(_recv_buf.data() + _recv_idx,
-                                              _recv_buf.size() - _recv_idx);
-    if (n_recv == 0) {
+    auto& scratch = scratch_buffer();
+
+    // Keep receiving until the operation would block. This is required for edge-triggered
+    // backends, which won't notify us again for data that is already waiting in the socket.
+    while (is_connected() && !_paused) {
+        ssize_t n_recv = _stream.nonblocking_recv(scratch.data(), scratch.size());
+        if (n_recv == 0) {
+            disconnect();
+            return;
+        }
+
+        if (n_recv < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) return;
+            if (errno == ECONNRESET) {
+                disconnect();
+                return;
+            }
+            THROW_ERRNO("failed to recv");
+        }
+
+        receive(scratch.data(), n_recv);
+    }
+}
+
+void connection::complete_recv(int res, const uint8_t *data) {
+    // The receive was cancelled by `pause_reading`.
+    if (res == -ECANCELED) {
+        _recv_tok = std::nullopt;
+        if (!_paused && is_connected()) start_recv();
+        return;
+    }
+
+    if (res == 0 || res == -ECONNRESET) {
         disconnect();
         return;
     }
 
-    if (n_recv < 0) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) return;
+    if (res < 0) {
+        errno = -res;
         THROW_ERRNO("failed to recv");
     }
 
-    _recv_idx += n_recv;
+    receive(data, res);
+}
+
+bool connection::admit_line() {
+    // Reading was paused by the handler of the previous line.
+    if (_paused) return false;
+
+    auto& registry = poll_registry::instance();
+    uint32_t iteration = registry.iteration();
+    if (iteration != _budget_iteration) {
+        _budget_iteration = iteration;
+        _budget_left = std::min<size_t>(_cfg.line_budget, UINT32_MAX);
+    }
+    // Let the other clients take their turn, and carry on in the next iteration.
+    if (_budget_left == 0) {
+        counters().budget_yields++;
+        stop_reading(registry.defer([this] { this->resume_reading(); }));
+        return false;
+    }
+
+    if (_cfg.flood_rate > 0) {
+        auto now = registry.now();
+        auto penalty = std::chrono::duration_cast<poll_registry::clock::duration>(
+            std::chrono::seconds(1)) / _cfg.flood_rate;
+        auto window = penalty * (_cfg.flood_burst - 1);
+        _flood_clock = std::max(_flood_clock, now);
+        if (_flood_clock - now > window) {
+            counters().throttled_lines++;
+            stop_reading(registry.schedule_timer(_flood_clock - window - now, [this] {
+                this->resume_reading();
+            }));
+            return false;
+        }
+        _flood_clock += penalty;
+    }
+
+    _budget_left--;
+    return true;
+}
+
+void connection::receive(const uint8_t *data, size_t n) {
+    _last_recv = poll_registry::instance().now();
+    _ping_sent = std::nullopt;
+
+    // While reading is stopped, what still arrives waits behind the lines held back.
+    if (_paused) {
+        hold(data, n);
+        return;
+    }
+
+    // The lines are handed out straight from the buffer received into. Only a partial line has to
+    // be copied, since the buffer is reused as soon as this returns.
+    if (_recv_idx > 0) {
+        // Complete the partial line with the start of this chunk. If the line doesn't fit, copying
+        // one byte over the limit is enough for `frame` to reject it.
+        size_t head = line_scanner::find_delimiter((const char*)data, n);
+        head = std::min(head + 1, max_line_length + 1 - _recv_idx);
+        head = std::min(head, n);
+        memcpy(_recv_buf.data() + _recv_idx, data, head);
+        frame(_recv_buf.data(), _recv_idx + head);
+        data += head;
+        n -= head;
+
+        // The line was held back, and so is what comes after it.
+        if (_paused) {
+            hold(data, n);
+            return;
+        }
+    }
+    if (n > 0) frame(data, n);
+
+    // The buffer is only needed to keep a partial line.
+    if (_recv_idx == 0) _recv_buf.reset();
+}
+
+void connection::frame(const uint8_t *data, size_t n) {
+    // Once per chunk: the lines of a chunk arrived together.
+    _framed_at = poll_registry::clock::now();
+    line_scanner scanner((const char*)data, n);
+    std::string_view line;
+    bool has_nul;
+    while (is_connected() && scanner.next(line, has_nul)) {
+        // The end of a line that was already rejected.
+        if (_discarding) {
+            _discarding = false;
+            continue;
+        }
+
+        // The `\n` of a `\r\n`, or a blank line.
+        if (line.empty()) continue;
+
+        // Keep this line and everything after it for when reading resumes.
+        if (!admit_line()) {
+            auto from = (const uint8_t*)line.data();
+            keep(from, data + n - from);
+            return;
+        }
+
+        if (line.size() > max_line_length) {
+            reject_line();
+        } else if (has_nul) {
+            LOG(warn, "client {} sent a line with a NUL byte", _id);
+        } else {
+            _on_msg(this, line);
+        }
+    }
+
+    _recv_idx = 0;
+    if (!is_connected() || _discarding) return;
+
+    // Keep the partial line for the next receive. It can't become a valid line if it's already
+    // over the limit without a delimiter.
+    auto rest = scanner.rest();
+    if (rest.empty()) return;
+    if (rest.size() > max_line_length) {
+        reject_line();
+        _discarding = true;
+        return;
+    }
+    keep((const uint8_t*)rest.data(), rest.size());
+}
+
+void connection::keep(const uint8_t *data, size_t n) {
+    _recv_idx = 0;
+    hold(data, n);
+}
+
+void connection::hold(const uint8_t *data, size_t n) {
+    if (n == 0) return;
+    size_t size = _recv_idx + n;
+    if (size <= _recv_buf.size()) {
+        memmove(_recv_buf.data() + _recv_idx, data, n);
+    } else {
+        // Always big enough for a partial line, which is what the buffer holds most of the time.
+        auto buf = buffer_pool::instance().acquire(
+            std::max({ size, max_line_length + 1, 2 * _recv_buf.size() }));
+        if (_recv_idx > 0) memcpy(buf.data(), _recv_buf.data(), _recv_idx);
+        memcpy(buf.data() + _recv_idx, data, n);
+        _recv_buf = std::move(buf);
+    }
+    _recv_idx = size;
+}
+
+void connection::reject_line() {
+    LOG(warn, "client {} sent a line longer than {} bytes", _id, max_line_length);
+    send_reply(ERR_INPUTTOOLONG);
+}
 
-    // Keep the same size available for the buffer.
-    _recv_buf.resize(_recv_idx + buf_size, 0);
+// The buffers of a send, which are only needed while there's something to send.
+struct connection::send_buffers {
+    struct msghdr msg;
+    struct iovec iov[max_send_iov];
+};
 
-    auto msg_end = std::find(_recv_buf.begin() + _recv_idx - n_recv,
-                             _recv_buf.begin() + _recv_idx, '\n');
+connection::send_buffers& connection::send_bufs() const {
+    static_assert(sizeof(send_buffers) <= 1024);
+    return *reinterpret_cast<send_buffers*>(_send_bufs.data());
+}
 
-    // If we haven't found the end of the message yet, continue.
-    if (msg_end == _recv_buf.begin() + _recv_idx) return;
+void connection::gather_send() {
+    if (!_send_bufs) _send_bufs = buffer_pool::instance().acquire(sizeof(send_buffers));
 
-    // End of the message was found! Write the message.
-    std::string s;
-    std::copy(_recv_buf.begin(), msg_end + 1, std::back_inserter(s));
-    _on_msg(this, std::move(s));
+    auto iov = send_bufs().iov;
+    _send_iov_count = 0;
+    size_t offset = _send_offset;
+    auto add = [&](const queued_message& queued) {
+        auto& msg = queued.data;
+        iov[_send_iov_count++] = { (void*)(msg->data() + offset), msg->size() - offset };
+        offset = 0;
+    };
 
-    // Update the buffer to put the start of the subsequent message in the start of the buffer.
-    //
-    //                 current message              _recv_idx
-    //                 vvvvvvvvvvvvvv                   v
-    //     _recv_buf: |message here\npartial message her-----------|
-    //                              |^^^^^^^^^^^^^^^^^^^
-    //                              |   next message
-    //                              ^
-    //                            msg_end
-    //
-    //                                 now can be overwritten
-    //                                    vvvvvvvvvvvvvv
-    //     _recv_buf: |partial message hermessage here\n-----------|
-    //         after   ^^^^^^^^^^^^^^^^^^^|
-    //                    next message    |
-    //                                    ^
-    //                                _recv_idx
-    //
-    auto new_first = std::rotate(_recv_buf.begin(), msg_end + 1, _recv_buf.begin() + _recv_idx);
-    _recv_idx = std::distance(_recv_buf.begin(), new_first);
-    _recv_buf.resize(_recv_idx + buf_size, 0);
+    // A partially sent message of the control lane is its front anyway.
+    size_t lead = _send_offset > 0 && _partial_bulk ? 1 : 0;
+    if (lead) add(_bulk_queue.front());
+    for (size_t i = 0; i < _control_queue.size() && _send_iov_count < max_send_iov; i++)
+        add(_control_queue[i]);
+    _send_control_count = _send_iov_count - lead;
+    for (size_t i = lead; i < _bulk_queue.size() && _send_iov_count < max_send_iov; i++)
+        add(_bulk_queue[i]);
+}
 
-    return;
+bool connection::send_queue_empty() const { return _control_queue.empty() && _bulk_queue.empty(); }
+
+void connection::consume_sent(size_t n_sent) {
+    auto& c = counters();
+    c.calls++;
+    c.bytes += n_sent;
+    c.buffers += _send_iov_count;
+    c.queued_bytes -= n_sent;
+    _queued_bytes -= n_sent;
+
+    // Pop every message that was sent entirely, in the order they were gathered, each being the
+    // front of its lane by then. The last one might have been sent partially, in which case the
+    // next send continues from where this one stopped.
+    size_t lead = _send_offset > 0 && _partial_bulk ? 1 : 0;
+    auto iov = send_bufs().iov;
+    auto& latency = thread_metrics::local().send_latency;
+    auto now = poll_registry::clock::now();
+    for (size_t i = 0; i < _send_iov_count && n_sent > 0; i++) {
+        bool bulk = i < lead || i >= lead + _send_control_count;
+        if (n_sent < iov[i].iov_len) {
+            _send_offset = (i == 0 ? _send_offset : 0) + n_sent;
+            _partial_bulk = bulk;
+            return;
+        }
+        n_sent -= iov[i].iov_len;
+        auto& lane = bulk ? _bulk_queue : _control_queue;
+        latency.record(now - lane.front().queued_at);
+        lane.pop_front();
+        _send_offset = 0;
+    }
+}
+
+void connection::check_send_queue() {
+    size_t queued = _queued_bytes;
+    if (queued <= _cfg.sendq_soft) return;
+
+    if (queued <= _cfg.sendq_hard) {
+        switch (_cfg.sendq_policy) {
+            case config::overflow_policy::drop:
+                drop_queued(_cfg.sendq_soft);
+                return;
+            // The senders are paused by the server (see `is_congested`).
+            case config::overflow_policy::pause:
+                return;
+            case config::overflow_policy::disconnect:
+                break;
+        }
+    }
+
+    LOG(warn, "client {} is too slow, {} bytes queued ({} bytes in total)", _id, queued,
+        connection::total_stats().queued_bytes);
+    counters().overflow_disconnects++;
+    disconnect();
+}
+
+void connection::drop_queued(size_t limit) {
+    // The front message might have been partially sent, and with a completion-based backend,
+    // every message gathered into the send in flight is still being read by the kernel.
+    size_t in_use = _send_offset > 0 && _partial_bulk ? 1 : 0;
+    if (_send_tok && poll_registry::instance().supports_completions())
+        in_use = _send_iov_count - _send_control_count;
+    in_use = std::min(in_use, _bulk_queue.size());
+
+    auto& c = counters();
+    size_t out = in_use;
+    for (size_t i = in_use; i < _bulk_queue.size(); i++) {
+        auto& msg = _bulk_queue[i];
+        if (_queued_bytes > limit) {
+            size_t size = msg.data->size();
+            _queued_bytes -= size;
+            c.queued_bytes -= size;
+            c.dropped_messages++;
+            c.dropped_bytes += size;
+            continue;
+        }
+        if (out != i) _bulk_queue[out] = std::move(msg);
+        out++;
+    }
+    while (_bulk_queue.size() > out) _bulk_queue.pop_back();
 }
 
 void connection::poll_send() {
     while (1) {
-        // If we have nothing to send, check if there is any new message in the channel.
-        if (_send_buf.empty()) {
-            if (_send_queue.empty()) {
-                // Nothing else to send, unregister the event.
-                poll_registry::instance().unregister_event(*_send_tok);
-                _send_tok = std::nullopt;
-                return;
-            }
-            // `_send_buf` will hold a reference to the front of the queue.
-            _send_buf = _send_queue.front();
+        if (send_queue_empty()) {
+            // Nothing else to send, unregister the event.
+            poll_registry::instance().unregister_event(*_send_tok);
+            _send_tok = std::nullopt;
+            _send_bufs.reset();
+            return;
         }
-        ssize_t n_sent = _stream.nonblocking_send((const uint8_t*)_send_buf.data(), _send_buf.size());
+
+        gather_send();
+        ssize_t n_sent = _stream.nonblocking_sendmsg(send_bufs().iov, _send_iov_count);
 
         if (n_sent < 0) {
             if (errno == EWOULDBLOCK || errno == EAGAIN) return;
+            if (errno == EPIPE || errno == ECONNRESET) {
+                disconnect();
+                return;
+            }
             THROW_ERRNO("failed to send");
         }
 
@@ -109,54 +487,196 @@ void connection::poll_send() {
             return;
         }
 
-        _send_buf = _send_buf.substr(n_sent);
+        size_t n_queued = 0;
+        for (size_t i = 0; i < _send_iov_count; i++) n_queued += send_bufs().iov[i].iov_len;
+        consume_sent(n_sent);
+
+        // The socket buffer is full, continue the work next time we poll.
+        if ((size_t)n_sent < n_queued) return;
+    }
+}
 
-        // There is more stuff to be sent, but we can't do it now since it might block. Continue
-        // the work next time we poll.
-        if (!_send_buf.empty()) return;
+void connection::start_send() {
+    gather_send();
+    auto& bufs = send_bufs();
+    bufs.msg = {};
+    bufs.msg.msg_iov = bufs.iov;
+    bufs.msg.msg_iovlen = _send_iov_count;
+    _send_tok = poll_registry::instance()
+        .sendmsg(raw_fd(), &bufs.msg, [this](int res, const uint8_t*) { this->complete_send(res); });
+}
 
-        // We have just finished sending a message that was beeing referenced by `_send_buf`. Now
-        // we can pop it.
-        _send_queue.pop_front();
+void connection::complete_send(int res) {
+    _send_tok = std::nullopt;
+    if (!is_connected()) return;
 
-        // If the message was already sent, move on to the next message, since nothing was
-        // blocking.
+    if (res <= 0) {
+        if (res == 0 || res == -EPIPE || res == -ECONNRESET) {
+            disconnect();
+            return;
+        }
+        errno = -res;
+        THROW_ERRNO("failed to send");
     }
+
+    consume_sent(res);
+    if (!send_queue_empty()) start_send();
+    else _send_bufs.reset();
 }
 
-void connection::send_message(std::string s) {
-    // Split the message into smaller chunks
-    std::string_view slice = s;
-    do {
-        _send_queue.emplace_back(slice.substr(0, MSG_SIZE_LIMIT));
-        slice = slice.substr(std::min((size_t)MSG_SIZE_LIMIT, slice.size()));
-    } while (slice.size() > 0);
-    if (!_send_tok) {
+void connection::send_message(shared_message msg, bool droppable) {
+    if (!is_connected()) return;
+
+    auto now = poll_registry::instance().now();
+    if (_mailbox && std::this_thread::get_id() != _owner) {
+        outbox::instance().add(_mailbox, { _handle, std::move(msg), droppable, now });
+        return;
+    }
+    enqueue(std::move(msg), droppable, now);
+}
+
+outbox& outbox::instance() {
+    static thread_local outbox box;
+    return box;
+}
+
+void outbox::add(mailbox<letter_batch> *to, letter l) {
+    auto it = std::find_if(_batches.begin(), _batches.end(), [&](auto& b) { return b.first == to; });
+    if (it == _batches.end()) it = _batches.insert(it, { to, {} });
+    it->second.push_back(std::move(l));
+    if (it->second.size() >= max_batch) {
+        to->post(std::move(it->second));
+        it->second.clear();
+    }
+}
+
+void outbox::flush() {
+    for (auto& [to, batch] : _batches) {
+        if (batch.empty()) continue;
+        to->post(std::move(batch));
+        batch.clear();
+    }
+}
+
+void connection::deliver(letter l) {
+    if (!is_connected()) return;
+    enqueue(std::move(l.data), l.droppable, l.posted_at);
+}
+
+void connection::enqueue(shared_message msg, bool droppable, poll_registry::clock::time_point queued_at) {
+    size_t size = msg->size();
+    (droppable ? _bulk_queue : _control_queue).push_back({ std::move(msg), queued_at });
+    _queued_bytes += size;
+    counters().queued_bytes += size;
+    thread_metrics::local().send_queue_depth.record(_control_queue.size() + _bulk_queue.size());
+    check_send_queue();
+
+    if (_send_tok || !is_connected()) return;
+    if (poll_registry::instance().supports_completions()) {
+        start_send();
+    } else {
         _send_tok = poll_registry::instance()
             .register_event(raw_fd(), POLLOUT, [&](short){ this->poll_send(); });
     }
 }
 
-void connection::send_message(irc::message msg) { send_message(msg.to_string()); }
+void connection::send_message(std::string s) {
+    thread_metrics::local().message_allocations.add();
+    send_message(std::make_shared<const std::string>(std::move(s)));
+}
+
+void connection::send_message(const irc::message& msg) { send_message(msg.to_string()); }
+
+void connection::send_reply(numeric_reply reply) {
+    static const auto replies = [] {
+        std::array<shared_message, std::size(reply_table)> replies;
+        for (size_t i = 0; i < replies.size(); i++)
+            replies[i] = std::make_shared<const std::string>(reply_table[i].line);
+        return replies;
+    }();
+    send_message(replies[reply_index(reply)]);
+}
+
+void connection::send_need_more_params(enum command cmd) {
+    static const auto replies = [] {
+        std::array<shared_message, std::size(command_table)> replies;
+        for (size_t i = 0; i < replies.size(); i++)
+            replies[i] = std::make_shared<const std::string>(command_table[i].need_more_params);
+        return replies;
+    }();
+    send_message(replies[static_cast<size_t>(cmd)]);
+}
 
 int connection::raw_fd() const { return _stream.fd(); }
 bool connection::is_connected() const { return _connected; }
+bool connection::has_pending_io() const { return _send_tok.has_value(); }
+size_t connection::queued_bytes() const { return _queued_bytes.load(std::memory_order_relaxed); }
+bool connection::is_congested() const { return queued_bytes() > _cfg.sendq_soft; }
 size_t connection::id() const { return _id; }
 
 void connection::disconnect() {
     if (!is_connected()) return;
-    std::cout << "client " << _id << " disconnected" << std::endl;
-    if (_recv_tok) poll_registry::instance().unregister_event(*_recv_tok);
-    if (_send_tok) poll_registry::instance().unregister_event(*_send_tok);
+    LOG(info, "client {} disconnected", _id);
+    auto& registry = poll_registry::instance();
+    if (_recv_tok) registry.unregister_event(*_recv_tok);
+    _recv_tok = std::nullopt;
+    if (_liveness_tok) registry.cancel_timer(*_liveness_tok);
+    _liveness_tok = std::nullopt;
+    if (_resume_tok) registry.cancel_timer(*_resume_tok);
+    _resume_tok = std::nullopt;
+    if (registry.supports_completions()) {
+        // A send might still be in flight, reading from the send queue. Shutting the socket down
+        // makes it complete right away, but until then this object must be kept alive (see
+        // `has_pending_io`).
+        _stream.shutdown();
+    } else if (_send_tok) {
+        registry.unregister_event(*_send_tok);
+        _send_tok = std::nullopt;
+    }
     _connected = false;
     _stream.close();
 }
 
-uint32_t connection::get_ipv4() const {
-    struct sockaddr_in address;
-    size_t addrlen = sizeof(address);
-    int ret = getpeername(_stream.fd(), (struct sockaddr*)&address, (socklen_t*)&addrlen);
-    if (ret < 0) THROW_ERRNO("getpeername failed");
-    // TODO: Check if this is in host or network byte order.
-    return htonl(address.sin_addr.s_addr);
+void connection::mark_registered() {
+    _registered = true;
+    mark_active();
+}
+
+poll_registry::clock::time_point connection::line_framed_at() const { return _framed_at; }
+
+void connection::mark_active() { _last_active = poll_registry::instance().now(); }
+
+void connection::check_liveness() {
+    auto& registry = poll_registry::instance();
+    auto now = registry.now();
+    _liveness_tok = std::nullopt;
+
+    if (!_registered && now - _connected_at >= _cfg.registration_timeout) {
+        timed_out("registration timeout");
+        return;
+    }
+    if (_ping_sent && now - *_ping_sent >= _cfg.ping_timeout) {
+        timed_out("ping timeout");
+        return;
+    }
+    bool idle_enabled = _registered && _cfg.idle_timeout.count() > 0;
+    if (idle_enabled && now - _last_active >= _cfg.idle_timeout) {
+        timed_out("idle");
+        return;
+    }
+
+    if (!_ping_sent && now - _last_recv >= _cfg.ping_interval) {
+        send_message(irc::message("server", irc::command::ping, { "server" }));
+        _ping_sent = now;
+    }
+
+    auto next = _ping_sent ? *_ping_sent + _cfg.ping_timeout : _last_recv + _cfg.ping_interval;
+    if (!_registered) next = std::min(next, _connected_at + _cfg.registration_timeout);
+    if (idle_enabled) next = std::min(next, _last_active + _cfg.idle_timeout);
+    _liveness_tok = registry.schedule_timer(next - now, [this] { this->check_liveness(); });
+}
+
+void connection::timed_out(const char *reason) {
+    LOG(info, "client {} timed out ({})", _id, reason);
+    disconnect();
 }
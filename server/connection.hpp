@@ -3,28 +3,114 @@
 
 #include <functional>
 #include <optional>
-#include <deque>
 #include <memory>
 #include <vector>
+#include <atomic>
+#include <thread>
+#include <string_view>
 
-#include "tcpstream.hpp"
+#include "transport.hpp"
 #include "message.hpp"
 #include "poll_registry.hpp"
+#include "mailbox.hpp"
+#include "config.hpp"
+#include "slot_map.hpp"
+#include "buffer_pool.hpp"
+#include "pooled_queue.hpp"
 
 namespace irc {
 
-    static const constexpr int buf_size = 4096;
+    // The size of the buffer readiness-based backends receive into, shared by the connections of
+    // a reactor.
+    static const constexpr size_t scratch_size = 64 * 1024;
+
+    // The maximum number of queued messages gathered into a single send. The buffers of a send (the
+    // iovecs and the `msghdr` pointing to them) fit in 1 KiB.
+    static const constexpr size_t max_send_iov = 60;
 
     typedef size_t connection_id_t;
 
+    // An encoded message. It is immutable, so a message sent to many connections (like the
+    // messages of a channel) is encoded once and shared by the send queues of all of them.
+    using shared_message = std::shared_ptr<const std::string>;
+
+    class connection;
+
+    // A connection in the table of the reactor that owns it.
+    using connection_handle = slot_handle<connection>;
+
+    // A message addressed to a connection owned by another reactor thread. It travels through the
+    // mailbox of that reactor, which delivers it to the connection (if it still exists).
+    struct letter {
+        connection_handle to;
+        shared_message data;
+        bool droppable;
+        // When it was posted, by the clock of the event loop of the sender.
+        poll_registry::clock::time_point posted_at;
+    };
+
+    // The letters a thread posts to a reactor in one go. Posting costs a node of the mailbox, so
+    // fanning a message out to a channel costs one per reactor rather than one per member.
+    using letter_batch = std::vector<letter>;
+
+    // The letters the calling thread wrote to connections of other reactors and hasn't posted yet,
+    // batched by mailbox. A reactor posts them once per iteration of its event loop, after
+    // handling the events that wrote them; a batch that gets large is posted right away.
+    class outbox {
+    public:
+        // The outbox of the calling thread.
+        static outbox& instance();
+
+        void add(mailbox<letter_batch> *to, letter l);
+
+        // Posts every batch.
+        void flush();
+
+    private:
+        // Letters are posted once a batch has this many.
+        static const constexpr size_t max_batch = 256;
+
+        // A batch per mailbox written to, and there are only as many mailboxes as reactors.
+        std::vector<std::pair<mailbox<letter_batch>*, letter_batch>> _batches;
+    };
+
     // The connection class represents a client connected to the server. It is responsible for
-    // receiving messages from the associated tcpstream and sending messages through it when they
-    // become available in the message queue.
+    // receiving messages from the associated transport (a TCP socket, or an in-memory connection
+    // in simulations) and sending messages through it when they become available in the message
+    // queue.
     class connection {
     public:
-        using message_handler_type = std::function<void(connection*, std::string)>;
+        // Counters of the sends done by connections. `queued_bytes` is the current size of their
+        // send queues, and the rest are totals since the server started. `throttled_lines` counts
+        // the lines held back by the flood control, and `budget_yields` the times a client had to
+        // wait for the next iteration because it used up its `config::line_budget`.
+        struct send_stats {
+            uint64_t calls = 0;
+            uint64_t bytes = 0;
+            uint64_t buffers = 0;
+            uint64_t queued_bytes = 0;
+            uint64_t dropped_messages = 0;
+            uint64_t dropped_bytes = 0;
+            uint64_t overflow_disconnects = 0;
+            uint64_t read_pauses = 0;
+            uint64_t throttled_lines = 0;
+            uint64_t budget_yields = 0;
+        };
 
-        connection(tcpstream stream, size_t id, message_handler_type on_msg);
+        // Called with every line received, without its delimiter. The line points into the buffer
+        // received into and is only valid during the call.
+        using message_handler_type = std::function<void(connection*, std::string_view)>;
+
+        // `mailbox` is the mailbox of the reactor that owns the connection. The connection belongs
+        // to the thread that constructs it, and messages sent to it from any other thread are
+        // added to the `outbox` of their thread instead, addressed to `handle`, its handle in the
+        // table of the reactor, and posted to `mailbox` from there.
+        //
+        // The timeouts of `cfg` are enforced by the connection itself, with a timer in the registry
+        // of the owner thread. `on_msg` is shared by the connections of a reactor, and both it and
+        // `cfg` must outlive the connection.
+        connection(transport stream, size_t id, const message_handler_type& on_msg, const config& cfg,
+                   mailbox<letter_batch> *mailbox = nullptr, connection_handle handle = {});
 
         // Can't move the connection. This allows guarantees that once constructed, the `this`
         // pointer is stable an thus can be reference by globals for the lifetime of the object.
@@ -32,60 +118,230 @@ namespace irc {
         connection(const connection&) = delete;
         ~connection();
 
-        // Checks if the client is still connected.
+        // Checks if the client is still connected. Can be called from any thread.
         bool is_connected() const;
 
+        // Checks if there still is an operation using the buffers of this connection in flight
+        // (only happens with completion-based backends). A disconnected connection can only be
+        // destroyed once this returns `false`.
+        bool has_pending_io() const;
+
         // Get the id of this connection.
         size_t id() const;
 
-        // Enqueues a message to send to the client.
+        // Enqueues a message to send to the client. Can be called from any thread: if the caller
+        // isn't the owner of the connection, the message is forwarded to the owner's mailbox, with
+        // the next flush of the `outbox` of the caller.
+        //
+        // The send queue has two lanes. `droppable` messages (the chat of channels, which is the
+        // bulk of the traffic) go to the bulk lane, and may be dropped without ever being sent if
+        // the send queue goes over the soft limit (see `config::sendq_policy`). Everything else
+        // (replies, PONGs, notices) goes to the control lane, which is sent first, so it doesn't
+        // wait behind a backlog of chat. Lanes are only interleaved at message boundaries.
+        void send_message(shared_message msg, bool droppable = false);
         void send_message(std::string s);
-        void send_message(irc::message msg);
+        void send_message(const irc::message& msg);
+
+        // Enqueues a message another thread posted to the mailbox of the owner. Only called by the
+        // owner thread.
+        void deliver(letter l);
+
+        // Enqueues one of the replies encoded at compile time (see `protocol.hpp`). Each reply is
+        // copied to a buffer only once, which is then shared by every connection it's sent to.
+        void send_reply(numeric_reply reply);
+        void send_need_more_params(enum command cmd);
 
         // Disconnects the client from the server. This will close the connection.
         void disconnect();
 
-        uint32_t get_ipv4() const;
+        // Called by the owner thread once the client completes its registration, which stops the
+        // registration timeout.
+        void mark_registered();
+
+        // Called by the owner thread whenever the client sends a command that counts as activity
+        // for the idle timeout.
+        void mark_active();
+
+        // When the line being handled was framed out of the received data, on the real clock even
+        // with the `sim` backend. Only meaningful while the message handler runs.
+        poll_registry::clock::time_point line_framed_at() const;
+
+        // The number of bytes waiting in the send queue. Can be called from any thread, but
+        // doesn't count messages still in the mailbox of the owner.
+        size_t queued_bytes() const;
+
+        // Whether the send queue is over the soft limit. Can be called from any thread.
+        bool is_congested() const;
+
+        // Stops receiving from the client for `duration`. Used to slow down clients that send to
+        // congested connections. The lines already received and not handled yet wait too.
+        void pause_reading(poll_registry::clock::duration duration);
+
+        // The send counters of the connections owned by the calling thread, and of every
+        // connection of the server.
+        static send_stats stats();
+        static send_stats total_stats();
 
     private:
+        // Starts receiving from the client.
+        void start_recv();
+
+        // Stops receiving from the client until `resume`, a timer or deferred callback that calls
+        // `resume_reading`, runs.
+        void stop_reading(poll_registry::token_type resume);
+
+        // Handles the lines held back while reading was stopped, and receives again if all of
+        // them could be handled.
+        void resume_reading();
+
+        // Whether the next line can be handled now, according to the flood control and the line
+        // budget. If it can't, stops reading until it can.
+        bool admit_line();
+
+        // A message in the send queue, and when it was queued (or posted by another thread), by
+        // the clock of the event loop.
+        struct queued_message {
+            shared_message data;
+            poll_registry::clock::time_point queued_at;
+        };
+
+        void enqueue(shared_message msg, bool droppable, poll_registry::clock::time_point queued_at);
+
+        // Applies the limits of the send queue after it grew.
+        void check_send_queue();
+
+        // Drops messages of the bulk lane, starting from the oldest, until at most `limit` bytes
+        // are queued. Messages that are being sent are never dropped.
+        void drop_queued(size_t limit);
+
         // Should only be called when data can be received through `_stream`. `poll_recv` will
         // receive data until the operation would block.
         void poll_recv();
 
+        // Called when a multishot receive completes with `res` bytes in `data`, when using a
+        // completion-based backend.
+        void complete_recv(int res, const uint8_t *data);
+
+        // Handles `n` bytes received into a buffer that is reused once this returns, first
+        // completing the partial line kept from the last receive, if any. While reading is
+        // stopped, the bytes are held back behind the lines already waiting instead.
+        void receive(const uint8_t *data, size_t n);
+
+        // Hands every complete line of `data` to the message handler, straight from `data` and
+        // without its delimiter (see `line_scanner`), until `admit_line` stops it. What is left is
+        // kept at the start of `_recv_buf`: the partial line after the last line, to be completed
+        // by the next receive, or everything from the line that wasn't admitted on. Lines longer
+        // than `max_line_length` are rejected and skipped, and so are lines with NUL bytes.
+        void frame(const uint8_t *data, size_t n);
+        void reject_line();
+
+        // Replaces the contents of `_recv_buf` with `n` bytes of `data`, which may point into it,
+        // or appends them to its contents.
+        void keep(const uint8_t *data, size_t n);
+        void hold(const uint8_t *data, size_t n);
+
         // Should only be called when data can be sent through `_stream`. `poll_send` will send
         // data until the operation would block.
         void poll_send();
 
-        // Accesses the file descriptor of the tcpstream. If the connection is disconnected, -1
+        // Submits a send of the queued messages, when using a completion-based backend. Only one
+        // send is in flight at a time.
+        void start_send();
+        void complete_send(int res);
+
+        // Fills the iovecs of `_send_bufs` with the queued messages, up to `max_send_iov` of them:
+        // the rest of the message partially sent, if any, then the control lane, then the bulk
+        // lane, each from its front.
+        void gather_send();
+        bool send_queue_empty() const;
+        struct send_buffers;
+        send_buffers& send_bufs() const;
+
+        // Removes the first `n_sent` bytes of the messages gathered, which may end in the middle of
+        // a message.
+        void consume_sent(size_t n_sent);
+
+        // Checks every timeout of the connection, pinging the client or disconnecting it if needed,
+        // and schedules the next check for the earliest deadline.
+        void check_liveness();
+        void timed_out(const char *reason);
+
+        // Accesses the file descriptor of the transport. If the connection is disconnected, -1
         // will be returned.
         int raw_fd() const;
 
         // Data needed for receiving from the client.
         std::optional<poll_registry::token_type> _recv_tok;
 
-        // Buffer for receiving data. This buffer will always have `buf_size` free of any data. This
-        // way the `recv` operation can always receive the same ammount of data at once.
-        std::vector<uint8_t> _recv_buf = std::vector<uint8_t>(buf_size, 0);
+        // Whether receiving is paused, and the timer that resumes it.
+        bool _paused = false;
+        std::optional<poll_registry::token_type> _resume_tok;
+
+        // The partial line at the end of the last receive, which is no longer than
+        // `max_line_length`, or while reading is paused, everything received that wasn't handled
+        // yet. The buffer is leased from the `buffer_pool` only while there is something in it, so
+        // idle connections don't hold any receive buffer.
+        buffer_pool::lease _recv_buf;
 
-        // The index of the next byte to receive into `_recv_buf`.
+        // The number of bytes at the start of `_recv_buf`.
         size_t _recv_idx = 0;
 
-        // Data needed for sending to the client.
+        // The clock of the flood control (see `config::flood_rate`), and the lines left in the
+        // budget of the iteration of the event loop the connection last handled a line in.
+        poll_registry::clock::time_point _flood_clock;
+        uint32_t _budget_iteration = 0;
+        uint32_t _budget_left = 0;
+
+        // Whether the rest of the current line should be skipped, because it was too long.
+        bool _discarding = false;
+
+        // Data needed for sending to the client. With a completion-based backend, this is the send
+        // in flight.
         std::optional<poll_registry::token_type> _send_tok;
 
-        // The slice of data that is being sent. This points into `_send_queue`.
-        std::string_view _send_buf;
+        // The lanes of the send queue (see `send_message`). The first `_send_offset` bytes of the
+        // front message of one of them, the bulk lane if `_partial_bulk`, were already sent, and
+        // the rest of it is sent before anything else.
+        pooled_queue<queued_message> _control_queue;
+        pooled_queue<queued_message> _bulk_queue;
+        size_t _send_offset = 0;
+        bool _partial_bulk = false;
+
+        // The bytes in the send queue that weren't sent yet. Only written by the owner thread.
+        std::atomic<size_t> _queued_bytes = 0;
 
-        // The queue of messages to send to through this connection.
-        std::deque<std::string> _send_queue;
+        // The buffers of the send being done (see `send_buffers`), leased from the `buffer_pool`
+        // while the send queue isn't empty. With a completion-based backend, they have to stay
+        // alive until the send completes, so they are kept here.
+        buffer_pool::lease _send_bufs;
+        // The messages gathered into the send, and how many of them are from the control lane.
+        uint32_t _send_iov_count = 0;
+        uint32_t _send_control_count = 0;
 
-        bool _connected = true;
+        std::atomic<bool> _connected = true;
         size_t _id;
 
-        tcpstream _stream;
+        // The owner of the connection and where messages from other threads should go.
+        std::thread::id _owner;
+        mailbox<letter_batch> *_mailbox;
+        connection_handle _handle;
+
+        transport _stream;
 
         // A callback that is called whenever a new message is received.
-        message_handler_type _on_msg;
+        const message_handler_type& _on_msg;
+        poll_registry::clock::time_point _framed_at;
+
+        // Liveness of the client. Receiving anything answers a pending PING. There is a single
+        // timer per connection, which only moves when it fires, so receiving is never slowed down
+        // by rescheduling it.
+        const config& _cfg;
+        std::optional<poll_registry::token_type> _liveness_tok;
+        poll_registry::clock::time_point _connected_at;
+        poll_registry::clock::time_point _last_recv;
+        poll_registry::clock::time_point _last_active;
+        std::optional<poll_registry::clock::time_point> _ping_sent;
+        bool _registered = false;
     };
 }
 
@@ -2,10 +2,13 @@
 #define _DB_H
 
 #include <optional>
-#include <map>
+#include <string>
+#include <string_view>
 
 #include "connection.hpp"
 #include "channel.hpp"
+#include "flat_map.hpp"
+#include "slot_map.hpp"
 
 namespace irc {
 
@@ -22,13 +25,13 @@ namespace irc {
         struct conn_info {
             // As per the RFC, a user could be in multiple channels, but here we only consider a single
             // channel.
-            //
-            // This `string_view` points into a key of the `_channels` member.
-            std::optional<std::string_view> joined_channel = std::nullopt;
+            std::optional<channel_handle> joined_channel = std::nullopt;
             std::optional<std::string> nick = std::nullopt;
             std::optional<std::string> realname = std::nullopt;
             std::optional<std::string> username = std::nullopt;
             conn_state state = conn_state::init;
+            // Whether the client is a server operator (see the OPER command).
+            bool is_oper = false;
             uint32_t ipv4;
             connection_id_t id;
 
@@ -41,34 +44,54 @@ namespace irc {
 
         // Remove a connection from a channel. Returns `false` if the operation is unsuccessful.
         bool quit_chan(connection_id_t id, std::string_view channel_name);
+        bool quit_chan(connection_id_t id, channel_handle chan);
 
         // Registers a new connection in the database with the given ip.
         void register_connection(connection_id_t id, uint32_t ipv4);
 
         // Gets the information about a particular conection. It is undefined behavior to call this
-        // function when the connectio `id` is not registered in the database.
+        // function when the connectio `id` is not registered in the database. The reference is
+        // only valid until a connection is registered or removed.
         conn_info& get_conn_info(connection_id_t id);
 
         // Gets a connection info by the nick name. Returns `nullptr` if the nickname `nick` is not
-        // registered.
+        // registered. Nicks are compared with the RFC 1459 casemapping (see `casefold`).
         conn_info* get_conn_info_by_nick(std::string_view nick);
 
+        // Sets the nick of a connection. Returns `false`, leaving the current nick in place, if the
+        // nick is in use by another connection. A connection can change the case of its own nick.
+        bool set_nick(connection_id_t id, std::string_view nick);
+
+        // Folds a nick to the lowercase of the RFC 1459 casemapping, where `[]\~` are the
+        // uppercase of `{}|^`. Two nicks are the same if they fold to the same string.
+        static std::string casefold(std::string_view nick);
+
         // Gets a channel by name. Returns `nullptr` if there is no registered channel with name
-        // `name`.
+        // `name`. The pointer is only valid until a channel is created or deleted.
         channel* get_channel(std::string_view name);
 
+        // Gets a channel by handle. Returns `nullptr` if the channel was deleted.
+        channel* get_channel(channel_handle chan);
+
         // Removes a connection from the database. If the connection isn't present, nothing is
         // done.
         void remove_connection(connection_id_t id);
 
     private:
-        std::map<std::string, channel, std::less<>> _channels;
-        //                             ^^^^^^^^^^^~~~ needed since we want to compare strings against
-        //                                            string views, which are not the same type, but
-        //                                            compare the same.
+        // Hashes strings as `string_view`s, so the string keys can be looked up by `string_view`
+        // without allocating.
+        using string_hash = std::hash<std::string_view>;
+
+        slot_map<channel> _channels;
+        // The handle of each channel, by name.
+        flat_map<std::string, channel_handle, string_hash> _channel_names;
 
         // Information about each connection. The index is the connection id
-        std::unordered_map<connection_id_t, conn_info> _connections;
+        flat_map<connection_id_t, conn_info> _connections;
+
+        // The connection with each nick, by casefolded nick. Kept in sync with `conn_info::nick`
+        // by `set_nick` and `remove_connection`.
+        flat_map<std::string, connection_id_t, string_hash> _nicks;
     };
 }
 
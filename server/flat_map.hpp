@@ -0,0 +1,197 @@
+#ifndef _FLAT_MAP_H
+#define _FLAT_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace irc {
+
+    // A hash map with open addressing. The entries are kept back to back in a vector, so iterating
+    // over the map is a linear walk over contiguous memory, and the table of buckets only holds the
+    // index of each entry and a few bits of its hash. Collisions are resolved by linear probing,
+    // and erasing shifts the following buckets back instead of leaving tombstones.
+    //
+    // Unlike `std::unordered_map`, entries move around: inserting may reallocate the entries, and
+    // erasing moves the last entry into the hole. Any insert or erase invalidates iterators and
+    // references to the entries.
+    //
+    // `Hash` and `KeyEqual` may be transparent, to look keys up without building a `Key` (like
+    // looking a `std::string` key up by a `std::string_view`).
+    template<typename Key, typename Value, typename Hash = std::hash<Key>,
+             typename KeyEqual = std::equal_to<>>
+    class flat_map {
+    public:
+        using value_type = std::pair<Key, Value>;
+        using iterator = typename std::vector<value_type>::iterator;
+        using const_iterator = typename std::vector<value_type>::const_iterator;
+
+        iterator begin() { return _entries.begin(); }
+        iterator end() { return _entries.end(); }
+        const_iterator begin() const { return _entries.begin(); }
+        const_iterator end() const { return _entries.end(); }
+
+        size_t size() const { return _entries.size(); }
+        bool empty() const { return _entries.empty(); }
+
+        template<typename K>
+        iterator find(const K& key) {
+            size_t b = find_bucket(key);
+            return b == npos ? end() : begin() + _buckets[b].entry;
+        }
+
+        template<typename K>
+        const_iterator find(const K& key) const {
+            size_t b = find_bucket(key);
+            return b == npos ? end() : begin() + _buckets[b].entry;
+        }
+
+        template<typename K>
+        bool contains(const K& key) const { return find_bucket(key) != npos; }
+
+        template<typename K>
+        Value& at(const K& key) {
+            auto it = find(key);
+            if (it == end()) throw std::out_of_range("flat_map::at");
+            return it->second;
+        }
+
+        // Inserts an entry if there's none with the same key. Returns the entry with the key, and
+        // whether it was inserted.
+        template<typename K, typename... Args>
+        std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+            if ((_entries.size() + 1) * max_load_den > _buckets.size() * max_load_num)
+                rehash(_buckets.empty() ? min_buckets : _buckets.size() * 2);
+
+            uint32_t tag = tag_of(Hash{}(key));
+            size_t mask = _buckets.size() - 1;
+            for (size_t b = home_of(tag);; b = (b + 1) & mask) {
+                auto& bucket = _buckets[b];
+                if (bucket.tag == empty_tag) {
+                    bucket = { tag, static_cast<uint32_t>(_entries.size()) };
+                    _entries.emplace_back(std::piecewise_construct,
+                                          std::forward_as_tuple(std::forward<K>(key)),
+                                          std::forward_as_tuple(std::forward<Args>(args)...));
+                    return { end() - 1, true };
+                }
+                if (bucket.tag == tag && KeyEqual{}(_entries[bucket.entry].first, key))
+                    return { begin() + bucket.entry, false };
+            }
+        }
+
+        template<typename K>
+        size_t erase(const K& key) {
+            size_t b = find_bucket(key);
+            if (b == npos) return 0;
+            erase_bucket(b);
+            return 1;
+        }
+
+        // Returns an iterator to the entry that took the place of the erased one, which is `end()`
+        // if the erased entry was the last.
+        iterator erase(const_iterator it) {
+            size_t entry = it - begin();
+            erase_bucket(bucket_of_entry(entry));
+            return begin() + entry;
+        }
+
+        iterator erase(iterator it) { return erase(const_iterator(it)); }
+
+        void clear() {
+            _entries.clear();
+            _buckets.clear();
+        }
+
+    private:
+        // The low bits of the tag are never zero, so a zero tag marks an empty bucket.
+        static const constexpr uint32_t empty_tag = 0;
+        static const constexpr size_t npos = static_cast<size_t>(-1);
+        static const constexpr size_t min_buckets = 16;
+
+        // At most 7/8 of the buckets are used.
+        static const constexpr size_t max_load_num = 7;
+        static const constexpr size_t max_load_den = 8;
+
+        struct bucket {
+            // The hash of the key of the entry, compared before the keys themselves.
+            uint32_t tag;
+            // The index of the entry in `_entries`.
+            uint32_t entry;
+        };
+
+        // Mixes the hash, since `std::hash` of integers is the identity.
+        static uint32_t tag_of(size_t hash) {
+            uint64_t mixed = static_cast<uint64_t>(hash) * 0x9e3779b97f4a7c15ull;
+            return static_cast<uint32_t>(mixed >> 32) | 1;
+        }
+
+        size_t home_of(uint32_t tag) const {
+            // The high bits of the tag are the best mixed ones.
+            return (static_cast<uint64_t>(tag) * _buckets.size()) >> 32;
+        }
+
+        template<typename K>
+        size_t find_bucket(const K& key) const {
+            if (_buckets.empty()) return npos;
+            uint32_t tag = tag_of(Hash{}(key));
+            size_t mask = _buckets.size() - 1;
+            for (size_t b = home_of(tag);; b = (b + 1) & mask) {
+                const auto& bucket = _buckets[b];
+                if (bucket.tag == empty_tag) return npos;
+                if (bucket.tag == tag && KeyEqual{}(_entries[bucket.entry].first, key)) return b;
+            }
+        }
+
+        size_t bucket_of_entry(size_t entry) const {
+            uint32_t tag = tag_of(Hash{}(_entries[entry].first));
+            size_t mask = _buckets.size() - 1;
+            size_t b = home_of(tag);
+            while (_buckets[b].entry != entry || _buckets[b].tag != tag) b = (b + 1) & mask;
+            return b;
+        }
+
+        void erase_bucket(size_t b) {
+            size_t entry = _buckets[b].entry;
+            size_t last = _entries.size() - 1;
+
+            // Fill the hole with the last entry, pointing its bucket to the new place.
+            if (entry != last) {
+                _buckets[bucket_of_entry(last)].entry = entry;
+                _entries[entry] = std::move(_entries[last]);
+            }
+            _entries.pop_back();
+
+            // Shift the following buckets of the run back into the hole, unless that would put them
+            // before their home.
+            size_t mask = _buckets.size() - 1;
+            for (size_t next = (b + 1) & mask;; next = (next + 1) & mask) {
+                auto& bucket = _buckets[next];
+                if (bucket.tag == empty_tag) break;
+                if (((next - home_of(bucket.tag)) & mask) >= ((next - b) & mask)) {
+                    _buckets[b] = bucket;
+                    b = next;
+                }
+            }
+            _buckets[b].tag = empty_tag;
+        }
+
+        void rehash(size_t n_buckets) {
+            _buckets.assign(n_buckets, bucket { empty_tag, 0 });
+            size_t mask = n_buckets - 1;
+            for (size_t i = 0; i < _entries.size(); i++) {
+                uint32_t tag = tag_of(Hash{}(_entries[i].first));
+                size_t b = home_of(tag);
+                while (_buckets[b].tag != empty_tag) b = (b + 1) & mask;
+                _buckets[b] = { tag, static_cast<uint32_t>(i) };
+            }
+        }
+
+        std::vector<value_type> _entries;
+        std::vector<bucket> _buckets;
+    };
+}
+
+#endif
@@ -0,0 +1,148 @@
+#include <cstdio>
+#include <ctime>
+
+#include "log.hpp"
+
+namespace irc {
+    // How long the writer sleeps when the rings are empty. Records are never in a hurry, and
+    // polling keeps the producers free of any wake-up.
+    static const constexpr auto writer_interval = std::chrono::milliseconds(10);
+
+    static const char* level_name(uint8_t level) {
+        switch ((log_level)level) {
+            case log_level::error: return "error";
+            case log_level::warn:  return "warn ";
+            case log_level::info:  return "info ";
+            case log_level::debug: return "debug";
+        }
+        return "?    ";
+    }
+
+    logger& logger::instance() {
+        static logger global_instance;
+        return global_instance;
+    }
+
+    logger::~logger() { stop(); }
+
+    void logger::set_level(log_level level) { _level.store(level, std::memory_order_relaxed); }
+
+    void logger::start() {
+        std::lock_guard<std::mutex> lock(_wake_mutex);
+        if (_running) return;
+        _running = true;
+        _writer = std::thread([this] { this->run(); });
+    }
+
+    void logger::stop() {
+        {
+            std::lock_guard<std::mutex> lock(_wake_mutex);
+            if (!_running) return;
+            _running = false;
+        }
+        _wake.notify_one();
+        _writer.join();
+    }
+
+    uint64_t logger::dropped() const {
+        std::lock_guard<std::mutex> lock(_rings_mutex);
+        uint64_t dropped = 0;
+        for (auto& ring : _rings) dropped += ring->dropped();
+        return dropped;
+    }
+
+    log_ring* logger::add_ring() {
+        std::lock_guard<std::mutex> lock(_rings_mutex);
+        _reported_drops.push_back(0);
+        return _rings.emplace_back(std::make_unique<log_ring>()).get();
+    }
+
+    void logger::run() {
+        std::unique_lock<std::mutex> lock(_wake_mutex);
+        while (_running) {
+            lock.unlock();
+            drain();
+            lock.lock();
+            _wake.wait_for(lock, writer_interval, [this] { return !_running; });
+        }
+        lock.unlock();
+
+        // What was logged until `stop` was called.
+        drain();
+    }
+
+    void logger::drain() {
+        {
+            std::lock_guard<std::mutex> lock(_rings_mutex);
+            for (size_t i = 0; i < _rings.size(); i++) {
+                _rings[i]->consume([this](auto& h, const uint8_t *args) { this->format(h, args); });
+
+                uint64_t dropped = _rings[i]->dropped();
+                if (dropped > _reported_drops[i]) {
+                    _err += "log: dropped " + std::to_string(dropped - _reported_drops[i])
+                          + " records, the ring of a thread was full\n";
+                    _reported_drops[i] = dropped;
+                }
+            }
+        }
+
+        if (!_out.empty()) {
+            fwrite(_out.data(), 1, _out.size(), stdout);
+            fflush(stdout);
+            _out.clear();
+        }
+        if (!_err.empty()) {
+            fwrite(_err.data(), 1, _err.size(), stderr);
+            fflush(stderr);
+            _err.clear();
+        }
+    }
+
+    void logger::format(const log_ring::record_header& h, const uint8_t *args) {
+        auto& out = h.level <= (uint8_t)log_level::warn ? _err : _out;
+
+        time_t seconds = h.time_ns / 1000000000;
+        struct tm tm;
+        localtime_r(&seconds, &tm);
+        char prefix[64];
+        size_t n = strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &tm);
+        snprintf(prefix + n, sizeof(prefix) - n, ".%03u %s ",
+                 (unsigned)(h.time_ns / 1000000 % 1000), level_name(h.level));
+        out += prefix;
+
+        size_t args_left = h.n_args;
+        for (const char *c = h.fmt; *c; c++) {
+            if (c[0] != '{' || c[1] != '}' || args_left == 0) {
+                out += *c;
+                continue;
+            }
+            c++;
+            args_left--;
+
+            uint8_t tag = *args++;
+            if (tag == int_arg || tag == uint_arg) {
+                uint64_t value;
+                memcpy(&value, args, sizeof(value));
+                args += sizeof(value);
+                out += tag == int_arg ? std::to_string((int64_t)value) : std::to_string(value);
+                continue;
+            }
+
+            uint32_t size;
+            memcpy(&size, args, sizeof(size));
+            std::string_view s((const char*)args + sizeof(size), size);
+            args += sizeof(size) + size;
+            if (tag == string_arg) {
+                out += s;
+                continue;
+            }
+            out += '"';
+            for (char ch : s) {
+                if (ch == '"' || ch == '\\') out += '\\';
+                out += ch;
+            }
+            out += '"';
+        }
+        out += '\n';
+    }
+}
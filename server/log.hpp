@@ -0,0 +1,237 @@
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Logs a record if `lvl` (`error`, `warn`, `info` or `debug`) is enabled. The arguments are only
+// evaluated if it is, so records of disabled levels cost a single load.
+//
+// ```
+// LOG(info, "client {} registered as {}", id, nick);
+// ```
+#define LOG(lvl, ...)                                                                                      \
+    do {                                                                                                   \
+        auto& _logger = irc::logger::instance();                                                           \
+        if (_logger.enabled(irc::log_level::lvl)) _logger.write(irc::log_level::lvl, __VA_ARGS__);         \
+    } while (0)
+
+namespace irc {
+
+    enum class log_level : uint8_t {
+        error,
+        warn,
+        info,
+        debug,
+    };
+
+    // A string argument written between quotes, with quotes and backslashes escaped (like
+    // `std::quoted`).
+    struct log_quoted {
+        std::string_view s;
+    };
+
+    // A single-producer single-consumer ring of log records. Each thread that logs has its own,
+    // so producers never contend with each other, and only the writer thread consumes them.
+    class log_ring {
+    public:
+        static const constexpr size_t capacity = 256 * 1024;
+
+        // The start of every record, which is followed by its arguments. A record with a `level`
+        // of `padding` only fills the end of the ring, when the next record doesn't fit there.
+        struct record_header {
+            uint32_t size;
+            uint8_t level;
+            uint8_t n_args;
+            const char *fmt;
+            int64_t time_ns;
+        };
+        static const constexpr uint8_t padding = 0xff;
+
+        log_ring() : _data(new uint8_t[capacity]) { }
+
+        // Reserves `size` contiguous bytes for a record, or returns `nullptr` (and counts the
+        // record as dropped) if the ring is full. Only called by the owner thread.
+        uint8_t* reserve(size_t size) {
+            size = (size + 7) & ~(size_t)7;
+            uint64_t head = _head.load(std::memory_order_relaxed);
+            uint64_t tail = _tail.load(std::memory_order_acquire);
+            size_t offset = head % capacity;
+            size_t contiguous = capacity - offset;
+            size_t needed = size <= contiguous ? size : contiguous + size;
+            if (head + needed - tail > capacity) {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            if (size > contiguous) {
+                record_header pad = { (uint32_t)contiguous, padding, 0, nullptr, 0 };
+                memcpy(_data.get() + offset, &pad, std::min(sizeof(pad), contiguous));
+                head += contiguous;
+                offset = 0;
+            }
+            _reserved = head + size;
+            return _data.get() + offset;
+        }
+
+        // Publishes the record reserved last.
+        void commit() { _head.store(_reserved, std::memory_order_release); }
+
+        // Calls `f` with every record published so far, then frees them. Only called by the
+        // writer thread.
+        template<typename F>
+        void consume(F&& f) {
+            uint64_t head = _head.load(std::memory_order_acquire);
+            uint64_t tail = _tail.load(std::memory_order_relaxed);
+            while (tail < head) {
+                const uint8_t *p = _data.get() + tail % capacity;
+                record_header h = {};
+                memcpy(&h, p, std::min(sizeof(h), capacity - tail % capacity));
+                if (h.level != padding) f(h, p + sizeof(h));
+                tail += (h.size + 7) & ~(size_t)7;
+            }
+            _tail.store(tail, std::memory_order_release);
+        }
+
+        uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+    private:
+        std::unique_ptr<uint8_t[]> _data;
+        alignas(64) std::atomic<uint64_t> _head = 0;
+        uint64_t _reserved = 0;
+        alignas(64) std::atomic<uint64_t> _tail = 0;
+        std::atomic<uint64_t> _dropped = 0;
+    };
+
+    // An asynchronous logger. Threads write records into rings of their own, without locks or
+    // system calls: a record is a format string, which must outlive the logger (a literal), and
+    // its arguments in binary. A writer thread turns the records into text and writes them out,
+    // so the event loops never wait on the terminal or the journal. When a ring is full, records
+    // are dropped and counted instead of blocking the thread.
+    //
+    // Records of `warn` and `error` go to stderr, the rest to stdout. Records written while the
+    // writer isn't running wait in the rings until it starts.
+    class logger {
+    public:
+        static logger& instance();
+
+        logger() = default;
+        logger(const logger&) = delete;
+        logger(logger&&) = delete;
+        ~logger();
+
+        bool enabled(log_level level) const {
+            return level <= _level.load(std::memory_order_relaxed);
+        }
+        void set_level(log_level level);
+
+        // Starts the writer thread. `stop` writes every record still in the rings before
+        // returning.
+        void start();
+        void stop();
+
+        // Writes a record. Every `{}` in `fmt` is replaced by the next argument, which can be an
+        // integer, a string or a `log_quoted` string. Strings are truncated to `max_string` bytes.
+        template<typename... Args>
+        void write(log_level level, const char *fmt, const Args&... args) {
+            size_t size = sizeof(log_ring::record_header) + (0 + ... + arg_size(args));
+            uint8_t *p = thread_ring().reserve(size);
+            if (!p) return;
+
+            log_ring::record_header h = {
+                (uint32_t)size, (uint8_t)level, (uint8_t)sizeof...(args), fmt,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count(),
+            };
+            memcpy(p, &h, sizeof(h));
+            p += sizeof(h);
+            (encode_arg(p, args), ...);
+            thread_ring().commit();
+        }
+
+        // The number of records dropped because a ring was full, since the server started.
+        uint64_t dropped() const;
+
+        static const constexpr size_t max_string = 1024;
+
+    private:
+        enum arg_tag : uint8_t {
+            int_arg,
+            uint_arg,
+            string_arg,
+            quoted_arg,
+        };
+
+        template<typename T>
+        static std::string_view string_of(const T& arg) {
+            std::string_view s;
+            if constexpr (std::is_same_v<T, log_quoted>) s = arg.s;
+            else s = std::string_view(arg);
+            return s.substr(0, max_string);
+        }
+
+        template<typename T>
+        static size_t arg_size(const T& arg) {
+            if constexpr (std::is_integral_v<T>) return 1 + sizeof(uint64_t);
+            else return 1 + sizeof(uint32_t) + string_of(arg).size();
+        }
+
+        template<typename T>
+        static void encode_arg(uint8_t *&p, const T& arg) {
+            if constexpr (std::is_integral_v<T>) {
+                *p++ = std::is_signed_v<T> ? int_arg : uint_arg;
+                uint64_t value = (uint64_t)arg;
+                memcpy(p, &value, sizeof(value));
+                p += sizeof(value);
+            } else {
+                *p++ = std::is_same_v<T, log_quoted> ? quoted_arg : string_arg;
+                auto s = string_of(arg);
+                uint32_t size = s.size();
+                memcpy(p, &size, sizeof(size));
+                memcpy(p + sizeof(size), s.data(), size);
+                p += sizeof(size) + size;
+            }
+        }
+
+        log_ring& thread_ring() {
+            static thread_local log_ring *ring = add_ring();
+            return *ring;
+        }
+        log_ring* add_ring();
+
+        // The body of the writer thread, and a pass over every ring.
+        void run();
+        void drain();
+        void format(const log_ring::record_header& h, const uint8_t *args);
+
+        std::atomic<log_level> _level = log_level::info;
+
+        // The rings of every thread. They outlive their threads, so the records of a thread that
+        // exited are still written.
+        mutable std::mutex _rings_mutex;
+        std::vector<std::unique_ptr<log_ring>> _rings;
+        std::vector<uint64_t> _reported_drops;
+
+        // Only used to wake the writer up early when stopping. Producers never touch it.
+        std::mutex _wake_mutex;
+        std::condition_variable _wake;
+        bool _running = false;
+        std::thread _writer;
+
+        // The text of the records drained by the last pass, for stdout and stderr.
+        std::string _out;
+        std::string _err;
+    };
+}
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef _MAILBOX_H
+#define _MAILBOX_H
+
+#include <atomic>
+#include <thread>
+#include <cstdint>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "utils.hpp"
+
+namespace irc {
+
+    // A lock-free multiple-producer single-consumer queue that wakes its consumer up through an
+    // eventfd. Any thread can `post` to it, but only the thread running the event loop that owns
+    // the mailbox may `drain` it.
+    //
+    // The queue is the intrusive MPSC queue by Dmitry Vyukov: producers only do an atomic exchange
+    // on the head, and the consumer walks the list from the tail without any atomic read-modify-
+    // write operation.
+    template<typename T>
+    class mailbox {
+    public:
+        mailbox() : _head(&_stub), _tail(&_stub) {
+            _eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (_eventfd < 0) THROW_ERRNO("eventfd failed");
+        }
+
+        mailbox(const mailbox&) = delete;
+        mailbox(mailbox&&) = delete;
+
+        ~mailbox() {
+            T item;
+            while (pop(item)) { }
+            close(_eventfd);
+        }
+
+        // The file descriptor that becomes readable when there are new items to drain.
+        int fd() const { return _eventfd; }
+
+        // Enqueues an item. Can be called from any thread.
+        void post(T item) {
+            node *n = new node { std::move(item), nullptr };
+            node *prev = _head.exchange(n, std::memory_order_acq_rel);
+            prev->next.store(n, std::memory_order_release);
+
+            // Only the first post after a drain has to wake the consumer up.
+            if (!_notified.exchange(true, std::memory_order_acq_rel)) {
+                uint64_t one = 1;
+                if (write(_eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                    THROW_ERRNO("write to eventfd failed");
+            }
+        }
+
+        // Calls `f` for every item posted so far. Must only be called by the consumer.
+        template<typename F>
+        void drain(F&& f) {
+            uint64_t value;
+            while (read(_eventfd, &value, sizeof(value)) > 0) { }
+            // Items posted from now on notify again, so none of them can be missed.
+            _notified.store(false, std::memory_order_seq_cst);
+
+            T item;
+            while (pop(item)) f(std::move(item));
+        }
+
+    private:
+        struct node {
+            T item;
+            std::atomic<node*> next;
+        };
+
+        // Pops the oldest item. Returns `false` if the queue is empty.
+        bool pop(T& out) {
+            node *tail = _tail;
+            node *next = tail->next.load(std::memory_order_acquire);
+
+            if (tail == &_stub) {
+                if (!next) return false;
+                // Skip the stub.
+                _tail = next;
+                tail = next;
+                next = next->next.load(std::memory_order_acquire);
+            }
+
+            if (!next) {
+                // `tail` looks like the last node, but a producer might be in the middle of
+                // linking a new one after it. Put the stub back at the end so `tail` can be
+                // consumed.
+                if (tail != _head.load(std::memory_order_acquire)) {
+                    // A producer exchanged the head but hasn't linked it yet: wait for it, it
+                    // only takes a couple of instructions.
+                    while (!(next = tail->next.load(std::memory_order_acquire)))
+                        std::this_thread::yield();
+                } else {
+                    _stub.next.store(nullptr, std::memory_order_relaxed);
+                    node *prev = _head.exchange(&_stub, std::memory_order_acq_rel);
+                    prev->next.store(&_stub, std::memory_order_release);
+                    while (!(next = tail->next.load(std::memory_order_acquire)))
+                        std::this_thread::yield();
+                }
+            }
+
+            _tail = next;
+            out = std::move(tail->item);
+            delete tail;
+            return true;
+        }
+
+        std::atomic<node*> _head;
+        node *_tail;
+        node _stub { T(), nullptr };
+
+        std::atomic<bool> _notified { false };
+        int _eventfd;
+    };
+}
+
+#endif
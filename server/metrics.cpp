@@ -0,0 +1,213 @@
+#include <cstdio>
+#include <memory>
+#include <mutex>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.hpp"
+#include "connection.hpp"
+#include "utils.hpp"
+#include "log.hpp"
+
+namespace irc {
+    // The metrics of every thread. They outlive their threads, so the totals still count the
+    // threads that already exited.
+    static std::mutex all_metrics_mutex;
+    static std::vector<std::unique_ptr<thread_metrics>> all_metrics;
+
+    thread_metrics& thread_metrics::local() {
+        static thread_local thread_metrics *metrics = [] {
+            std::lock_guard<std::mutex> lock(all_metrics_mutex);
+            return all_metrics.emplace_back(std::make_unique<thread_metrics>()).get();
+        }();
+        return *metrics;
+    }
+
+    metrics_snapshot metrics_snapshot::total() {
+        metrics_snapshot s;
+        std::lock_guard<std::mutex> lock(all_metrics_mutex);
+        for (auto& m : all_metrics) {
+            m->fanout_latency.add_to(s.fanout_latency);
+            m->send_latency.add_to(s.send_latency);
+            m->tick_duration.add_to(s.tick_duration);
+            m->ready_events.add_to(s.ready_events);
+            m->send_queue_depth.add_to(s.send_queue_depth);
+            for (size_t i = 0; i < s.commands.size(); i++) s.commands[i] += m->commands[i].get();
+            s.malformed_lines += m->malformed_lines.get();
+            s.pool_allocations += m->pool_allocations.get();
+            s.slab_allocations += m->slab_allocations.get();
+            s.message_allocations += m->message_allocations.get();
+            s.connections += m->connections.get();
+        }
+        return s;
+    }
+
+    static const constexpr double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    std::string metrics_snapshot::prometheus() const {
+        std::string out;
+        char line[256];
+        auto metric = [&](const char *name, const char *type, const char *help) {
+            snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+            out += line;
+        };
+        auto value = [&](const char *name, uint64_t v) {
+            snprintf(line, sizeof(line), "%s %llu\n", name, (unsigned long long)v);
+            out += line;
+        };
+        auto counter = [&](const char *name, const char *help, uint64_t v) {
+            metric(name, "counter", help);
+            value(name, v);
+        };
+        auto gauge = [&](const char *name, const char *help, uint64_t v) {
+            metric(name, "gauge", help);
+            value(name, v);
+        };
+        // Durations are recorded in nanoseconds, and exposed in seconds.
+        auto summary = [&](const char *name, const char *help, const histogram::snapshot& h,
+                           double scale) {
+            metric(name, "summary", help);
+            for (double q : quantiles) {
+                snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %.9g\n", name, q,
+                         h.quantile(q) * scale);
+                out += line;
+            }
+            snprintf(line, sizeof(line), "%s_sum %.9g\n%s_count %llu\n", name, h.sum * scale, name,
+                     (unsigned long long)h.count);
+            out += line;
+        };
+
+        metric("irc_commands_total", "counter", "Lines handled, by command.");
+        for (size_t i = 0; i < commands.size(); i++) {
+            snprintf(line, sizeof(line), "irc_commands_total{command=\"%.*s\"} %llu\n",
+                     (int)command_table[i].name.size(), command_table[i].name.data(),
+                     (unsigned long long)commands[i]);
+            out += line;
+        }
+        counter("irc_malformed_lines_total", "Lines that couldn't be parsed.", malformed_lines);
+
+        summary("irc_fanout_latency_seconds",
+                "From a chat message being received to it being queued to its channel.",
+                fanout_latency, 1e-9);
+        summary("irc_send_latency_seconds",
+                "From a message queued to a connection to the write that sends its last byte.",
+                send_latency, 1e-9);
+        summary("irc_tick_duration_seconds", "Time an event loop iteration spends after waiting.",
+                tick_duration, 1e-9);
+        summary("irc_ready_events", "Events returned by each wait of the event loop.",
+                ready_events, 1);
+        summary("irc_send_queue_depth_messages",
+                "Messages in the send queue of a connection whenever one is queued.",
+                send_queue_depth, 1);
+
+        counter("irc_pool_allocations_total", "Blocks handed out by the slab allocators.",
+                pool_allocations);
+        counter("irc_slab_allocations_total", "Slabs allocated from the heap.", slab_allocations);
+        counter("irc_message_allocations_total", "Messages encoded.", message_allocations);
+
+        auto stats = connection::total_stats();
+        gauge("irc_connections", "Open connections.", connections);
+        gauge("irc_queued_bytes", "Bytes waiting in send queues.", stats.queued_bytes);
+        counter("irc_sent_bytes_total", "Bytes sent.", stats.bytes);
+        counter("irc_send_calls_total", "Socket writes.", stats.calls);
+        counter("irc_dropped_messages_total", "Messages dropped from send queues.",
+                stats.dropped_messages);
+        counter("irc_dropped_bytes_total", "Bytes dropped from send queues.", stats.dropped_bytes);
+        counter("irc_overflow_disconnects_total", "Clients disconnected for a full send queue.",
+                stats.overflow_disconnects);
+        counter("irc_read_pauses_total", "Senders paused by congested channels.",
+                stats.read_pauses);
+        counter("irc_throttled_lines_total", "Lines held back by the flood control.",
+                stats.throttled_lines);
+        counter("irc_budget_yields_total", "Clients that used up their line budget.",
+                stats.budget_yields);
+        counter("irc_log_dropped_records_total", "Log records dropped because a ring was full.",
+                logger::instance().dropped());
+        return out;
+    }
+
+    std::vector<std::string> metrics_snapshot::summary() const {
+        std::vector<std::string> lines;
+        char line[256];
+        auto durations = [&](const char *name, const histogram::snapshot& h) {
+            snprintf(line, sizeof(line), "%s: %llu samples, p50 %.1fus, p99 %.1fus, p999 %.1fus, "
+                     "max %.1fus", name, (unsigned long long)h.count, h.quantile(0.5) / 1e3,
+                     h.quantile(0.99) / 1e3, h.quantile(0.999) / 1e3, h.max / 1e3);
+            lines.push_back(line);
+        };
+        auto counts_of = [&](const char *name, const histogram::snapshot& h) {
+            snprintf(line, sizeof(line), "%s: %llu samples, p50 %llu, p99 %llu, p999 %llu, max %llu",
+                     name, (unsigned long long)h.count, (unsigned long long)h.quantile(0.5),
+                     (unsigned long long)h.quantile(0.99), (unsigned long long)h.quantile(0.999),
+                     (unsigned long long)h.max);
+            lines.push_back(line);
+        };
+        snprintf(line, sizeof(line), "malformed lines: %llu", (unsigned long long)malformed_lines);
+        lines.push_back(line);
+        durations("fanout latency", fanout_latency);
+        durations("send latency", send_latency);
+        durations("tick duration", tick_duration);
+        counts_of("ready events", ready_events);
+        counts_of("send queue depth", send_queue_depth);
+
+        snprintf(line, sizeof(line), "allocations: %llu from pools, %llu slabs, %llu messages",
+                 (unsigned long long)pool_allocations, (unsigned long long)slab_allocations,
+                 (unsigned long long)message_allocations);
+        lines.push_back(line);
+
+        auto stats = connection::total_stats();
+        snprintf(line, sizeof(line), "connections: %llu, %llu bytes queued, %llu messages dropped",
+                 (unsigned long long)connections, (unsigned long long)stats.queued_bytes,
+                 (unsigned long long)stats.dropped_messages);
+        lines.push_back(line);
+        return lines;
+    }
+
+    metrics_endpoint::metrics_endpoint(const std::string& path) : _path(path) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            throw std::runtime_error("metrics socket path '" + path + "' is too long");
+        memcpy(addr.sun_path, path.data(), path.size());
+
+        _fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (_fd < 0) THROW_ERRNO("socket failed");
+
+        unlink(path.c_str());
+        if (bind(_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(_fd, 16) < 0) {
+            int saved_errno = errno;
+            close(_fd);
+            errno = saved_errno;
+            THROW_ERRNO("failed to listen on metrics socket '" << path << "'");
+        }
+    }
+
+    metrics_endpoint::~metrics_endpoint() {
+        close(_fd);
+        unlink(_path.c_str());
+    }
+
+    int metrics_endpoint::fd() const { return _fd; }
+
+    void metrics_endpoint::serve() {
+        while (1) {
+            int fd = accept4(_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno != EWOULDBLOCK && errno != EAGAIN)
+                    LOG(error, "accept on the metrics socket failed ({})", strerror(errno));
+                return;
+            }
+
+            // The exposition is a few KiB, which fits in the socket buffer, so a single send that
+            // doesn't block is enough.
+            auto text = metrics_snapshot::total().prometheus();
+            ssize_t n = send(fd, text.data(), text.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < (ssize_t)text.size())
+                LOG(warn, "sent {} of the {} bytes of metrics", std::max<ssize_t>(n, 0), text.size());
+            close(fd);
+        }
+    }
+}
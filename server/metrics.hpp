@@ -0,0 +1,105 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "protocol.hpp"
+#include "histogram.hpp"
+
+namespace irc {
+
+    // The metrics of a thread. They are only written by their own thread, so recording is a few
+    // plain stores, without locks, and cheap enough to always be on. Any thread can read them to
+    // compute the totals (see `metrics_snapshot`).
+    struct thread_metrics {
+        // The metrics of the calling thread.
+        static thread_metrics& local();
+
+        // Durations, in nanoseconds. `fanout_latency` goes from a chat message being framed out of
+        // the data received to the message being queued to every member of the channel, and
+        // `send_latency` from a message being queued to a connection (or posted to the reactor
+        // that owns it) to the socket write that sends its last byte. `tick_duration` is the time
+        // an iteration of the event loop spends after waiting.
+        histogram fanout_latency;
+        histogram send_latency;
+        histogram tick_duration;
+
+        // The events (ready file descriptors or completions) each wait of the event loop returned,
+        // and the messages in the send queue of a connection every time one is queued.
+        histogram ready_events;
+        histogram send_queue_depth;
+
+        // The lines handled, by command, and the ones that couldn't be parsed.
+        std::array<metric_value, std::size(command_table)> commands;
+        metric_value malformed_lines;
+
+        // The blocks handed out by the slab allocators (for connections and buffers), the slabs
+        // they allocated from the heap, and the messages encoded, each a heap allocation shared by
+        // its recipients.
+        metric_value pool_allocations;
+        metric_value slab_allocations;
+        metric_value message_allocations;
+
+        // The connections of the reactor of the thread.
+        metric_value connections;
+    };
+
+    // The metrics of every thread, added up.
+    struct metrics_snapshot {
+        static metrics_snapshot total();
+
+        // The snapshot, along with the send counters of the connections (see
+        // `connection::send_stats`), in the Prometheus text format.
+        std::string prometheus() const;
+
+        // The snapshot as a few lines of text, for the STATS command, which sends the command
+        // counters on their own.
+        std::vector<std::string> summary() const;
+
+        histogram::snapshot fanout_latency;
+        histogram::snapshot send_latency;
+        histogram::snapshot tick_duration;
+        histogram::snapshot ready_events;
+        histogram::snapshot send_queue_depth;
+
+        std::array<uint64_t, std::size(command_table)> commands {};
+        uint64_t malformed_lines = 0;
+
+        uint64_t pool_allocations = 0;
+        uint64_t slab_allocations = 0;
+        uint64_t message_allocations = 0;
+
+        uint64_t connections = 0;
+    };
+
+    // Serves the metrics on a Unix socket: every client that connects is sent
+    // `metrics_snapshot::prometheus` and disconnected, like a scrape through
+    // `socat - UNIX-CONNECT:<path>`. Serving happens on the event loop the socket is registered
+    // in, and never blocks.
+    class metrics_endpoint {
+    public:
+        // Replaces whatever is at `path`, like the socket left behind by a previous run.
+        metrics_endpoint(const std::string& path);
+        metrics_endpoint(const metrics_endpoint&) = delete;
+        metrics_endpoint(metrics_endpoint&&) = delete;
+        ~metrics_endpoint();
+
+        // The listening socket, which becomes readable when clients connect.
+        int fd() const;
+
+        // Serves every client waiting to be accepted.
+        void serve();
+
+    private:
+        std::string _path;
+        int _fd = -1;
+    };
+}
+
+#endif
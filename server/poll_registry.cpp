@@ -1,51 +1,654 @@
 #include <iostream>
 #include <algorithm>
 
+#include <unistd.h>
+#include <sys/socket.h>
+
 #include "poll_registry.hpp"
+#include "utils.hpp"
+
+// The events are passed straight to `epoll_ctl` and back to the callbacks, so the bit values must
+// match the ones from `poll`.
+static_assert(POLLIN == EPOLLIN && POLLOUT == EPOLLOUT && POLLERR == EPOLLERR && POLLHUP == EPOLLHUP,
+              "poll and epoll event bits differ");
+
+// Sizes used for the io_uring backend: the number of submission queue entries, and the number and
+// size of the buffers shared by all multishot receives.
+static const constexpr unsigned uring_entries = 1024;
+static const constexpr unsigned uring_buffers = 1024;
+static const constexpr unsigned uring_buffer_size = 4096;
 
-poll_registry poll_registry::global_instance;
+// `user_data` of submissions whose completions should be ignored.
+static const constexpr poll_registry::token_type ignored_token = ~(poll_registry::token_type)0;
+
+thread_local poll_registry poll_registry::global_instance;
 poll_registry& poll_registry::instance() { return global_instance; }
 
+poll_registry::poll_registry(backend b) : _backend(backend::poll) {
+    _buckets.fill(no_slot);
+    _origin = _now = clock::now();
+    set_backend(b);
+}
+
+poll_registry::~poll_registry() {
+    if (_epfd >= 0) close(_epfd);
+}
+
+void poll_registry::set_backend(backend b) {
+    if (_active > 0) throw std::runtime_error("can't change the backend with registered events");
+    if (_epfd >= 0) {
+        close(_epfd);
+        _epfd = -1;
+    }
+    _ring = nullptr;
+
+    if (b == backend::uring) {
+        _ring = uring::create(uring_entries, uring_buffers, uring_buffer_size);
+        // Not supported by this kernel, fall back to the next best thing.
+        if (!_ring) b = backend::epoll;
+    }
+
+    _backend = b;
+    // The virtual clock starts from the last tick, so simulations that start on a fresh registry
+    // always see the same times.
+    if (_backend == backend::sim) _now = _origin + _tick * timer_tick;
+    if (_backend == backend::epoll) {
+        _epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (_epfd < 0) THROW_ERRNO("epoll_create1 failed");
+    }
+}
+
+poll_registry::backend poll_registry::get_backend() const { return _backend; }
+
+bool poll_registry::supports_completions() const { return _backend == backend::uring; }
+
+poll_registry::token_type poll_registry::make_token(uint32_t slot, uint32_t generation) {
+    return ((token_type)generation << 32) | slot;
+}
+
+poll_registry::registration* poll_registry::lookup(token_type tok) {
+    uint32_t slot = tok & 0xffffffff;
+    uint32_t generation = tok >> 32;
+    if (slot >= _regs.size()) return nullptr;
+    auto& reg = _regs[slot];
+    if (!reg.active || reg.generation != generation) return nullptr;
+    return &reg;
+}
+
+uint32_t poll_registry::acquire_slot() {
+    uint32_t slot;
+    if (_free_slots.empty()) {
+        slot = _regs.size();
+        _regs.emplace_back();
+    } else {
+        slot = _free_slots.back();
+        _free_slots.pop_back();
+    }
+    _regs[slot].active = true;
+    _regs[slot].cancelling = false;
+    _active++;
+    return slot;
+}
+
+void poll_registry::release_slot(uint32_t slot) {
+    auto& reg = _regs[slot];
+    reg.active = false;
+    reg.generation++;
+    _active--;
+
+    // The callback is not destroyed here, since this might be called from inside the callback
+    // itself. It is only overwritten when the slot is reused.
+    _released_slots.push_back(slot);
+}
+
 poll_registry::token_type poll_registry::register_event(int fd, short events, callback_type cb) {
-    token_type tok = _next_tok++;
-    _fds.emplace_back((struct pollfd) {
-        .fd = fd,
-        .events = events,
-    });
-    _callbacks_and_toks.emplace_back(std::move(cb), tok);
-    return tok;
+    uint32_t slot = acquire_slot();
+    auto& reg = _regs[slot];
+    reg.fd = fd;
+    reg.events = events;
+    reg.kind = op_kind::readiness;
+    reg.cb = std::move(cb);
+
+    switch (_backend) {
+        case backend::poll:  poll_add(slot);     break;
+        case backend::epoll: epoll_add(slot);    break;
+        case backend::uring: uring_submit(slot); break;
+        case backend::sim:   sim_add(slot);      break;
+    }
+    return make_token(slot, reg.generation);
 }
 
 bool poll_registry::unregister_event(token_type tok) {
-    auto it = std::find_if(_callbacks_and_toks.cbegin(), _callbacks_and_toks.cend(),
-                           [=](auto& cb_tok){ return cb_tok.second == tok; });
-    if (it == _callbacks_and_toks.cend()) return false;
-    _callbacks_and_toks.erase(it);
+    auto reg = lookup(tok);
+    if (!reg) return false;
+    uint32_t slot = tok & 0xffffffff;
 
-    // pollfd will be in the same index
-    _fds.erase(_fds.cbegin() + std::distance(_callbacks_and_toks.cbegin(), it));
+    switch (_backend) {
+        case backend::poll:  poll_remove(slot);  break;
+        case backend::epoll: epoll_remove(slot); break;
+        case backend::uring:
+            if (reg->kind != op_kind::send) uring_cancel(tok);
+            break;
+        case backend::sim:   sim_remove(slot);   break;
+    }
+
+    release_slot(slot);
     return true;
 }
 
+poll_registry::token_type poll_registry::accept_multishot(int fd, completion_type cb) {
+    if (!supports_completions()) throw std::runtime_error("backend doesn't support completions");
+    uint32_t slot = acquire_slot();
+    auto& reg = _regs[slot];
+    reg.fd = fd;
+    reg.kind = op_kind::accept;
+    reg.completion_cb = std::move(cb);
+    uring_submit(slot);
+    return make_token(slot, reg.generation);
+}
+
+poll_registry::token_type poll_registry::recv_multishot(int fd, completion_type cb) {
+    if (!supports_completions()) throw std::runtime_error("backend doesn't support completions");
+    uint32_t slot = acquire_slot();
+    auto& reg = _regs[slot];
+    reg.fd = fd;
+    reg.kind = op_kind::recv;
+    reg.completion_cb = std::move(cb);
+    uring_submit(slot);
+    return make_token(slot, reg.generation);
+}
+
+bool poll_registry::cancel(token_type tok) {
+    auto reg = lookup(tok);
+    if (!reg || reg->kind != op_kind::recv) return false;
+    if (!reg->cancelling) uring_cancel(tok);
+    reg->cancelling = true;
+    return true;
+}
+
+poll_registry::token_type poll_registry::sendmsg(int fd, const struct msghdr *msg,
+                                                 completion_type cb) {
+    if (!supports_completions()) throw std::runtime_error("backend doesn't support completions");
+    uint32_t slot = acquire_slot();
+    auto& reg = _regs[slot];
+    reg.fd = fd;
+    reg.kind = op_kind::send;
+    reg.completion_cb = std::move(cb);
+
+    auto sqe = _ring->get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = make_token(slot, reg.generation);
+    return sqe->user_data;
+}
+
+void poll_registry::poll_add(uint32_t slot) {
+    auto& reg = _regs[slot];
+    reg.pos = _fds.size();
+    _fds.emplace_back((struct pollfd) {
+        .fd = reg.fd,
+        .events = reg.events,
+        .revents = 0,
+    });
+    _fd_slots.push_back(slot);
+}
+
+void poll_registry::poll_remove(uint32_t slot) {
+    // Swap the last pollfd into the position of the removed one, so no other entry has to move.
+    size_t pos = _regs[slot].pos;
+    _fds[pos] = _fds.back();
+    _fd_slots[pos] = _fd_slots.back();
+    _regs[_fd_slots[pos]].pos = pos;
+    _fds.pop_back();
+    _fd_slots.pop_back();
+}
+
+void poll_registry::epoll_add(uint32_t slot) {
+    int fd = _regs[slot].fd;
+    if ((size_t)fd >= _interest.size()) _interest.resize(fd + 1);
+    auto& interest = _interest[fd];
+    short old_events = interest.events;
+    interest.slots.push_back(slot);
+    interest.events |= _regs[slot].events;
+    epoll_update(fd, old_events);
+}
+
+void poll_registry::epoll_remove(uint32_t slot) {
+    int fd = _regs[slot].fd;
+    auto& interest = _interest[fd];
+    short old_events = interest.events;
+    interest.slots.erase(std::find(interest.slots.begin(), interest.slots.end(), slot));
+    interest.events = 0;
+    for (auto other : interest.slots) interest.events |= _regs[other].events;
+    epoll_update(fd, old_events);
+}
+
+void poll_registry::epoll_update(int fd, short old_events) {
+    auto& interest = _interest[fd];
+    if (interest.events == old_events && !interest.slots.empty()) return;
+
+    struct epoll_event ev = {};
+    ev.events = (uint32_t)interest.events | EPOLLET;
+    ev.data.fd = fd;
+
+    int op = EPOLL_CTL_MOD;
+    if (interest.slots.empty()) op = EPOLL_CTL_DEL;
+    else if (old_events == 0)   op = EPOLL_CTL_ADD;
+
+    if (epoll_ctl(_epfd, op, fd, &ev) < 0) THROW_ERRNO("epoll_ctl failed");
+}
+
+void poll_registry::sim_add(uint32_t slot) {
+    int fd = _regs[slot].fd;
+    if ((size_t)fd >= _interest.size()) _interest.resize(fd + 1);
+    auto& interest = _interest[fd];
+    interest.slots.push_back(slot);
+    interest.events |= _regs[slot].events;
+    // Like `epoll`, a file descriptor that is already ready is reported right away.
+    sim_notify(fd);
+}
+
+void poll_registry::sim_remove(uint32_t slot) {
+    auto& interest = _interest[_regs[slot].fd];
+    interest.slots.erase(std::find(interest.slots.begin(), interest.slots.end(), slot));
+    interest.events = 0;
+    for (auto other : interest.slots) interest.events |= _regs[other].events;
+}
+
+void poll_registry::set_sim_readiness(readiness_type readiness) {
+    _sim_readiness = std::move(readiness);
+}
+
+void poll_registry::sim_notify(int fd) {
+    if (_backend != backend::sim || fd < 0 || (size_t)fd >= _interest.size()) return;
+    auto& interest = _interest[fd];
+    if (interest.notified || interest.slots.empty()) return;
+    interest.notified = true;
+    _sim_notified.push_back(fd);
+}
+
+int poll_registry::sim_wait() {
+    int n_events = 0;
+    for (int fd : _sim_notified) {
+        auto& interest = _interest[fd];
+        interest.notified = false;
+        if (interest.slots.empty() || !_sim_readiness) continue;
+        short revents = _sim_readiness(fd) & (interest.events | POLLERR | POLLHUP);
+        if (!revents) continue;
+        n_events++;
+        for (auto slot : interest.slots)
+            _ready.emplace_back(make_token(slot, _regs[slot].generation), revents);
+    }
+    _sim_notified.clear();
+    return n_events;
+}
+
+void poll_registry::advance(clock::duration d) {
+    if (_backend == backend::sim) _now += std::max(d, clock::duration::zero());
+}
+
+bool poll_registry::has_pending_work() const {
+    return !_sim_notified.empty() || !_deferred.empty();
+}
+
+void poll_registry::uring_submit(uint32_t slot) {
+    auto& reg = _regs[slot];
+    auto sqe = _ring->get_sqe();
+    sqe->fd = reg.fd;
+    sqe->user_data = make_token(slot, reg.generation);
+    switch (reg.kind) {
+        case op_kind::readiness:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = (uint16_t)reg.events;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            break;
+        case op_kind::accept:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            break;
+        case op_kind::recv:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = uring::buffer_group;
+            break;
+        case op_kind::send:
+            UNREACHABLE();
+    }
+}
+
+void poll_registry::uring_cancel(token_type tok) {
+    auto sqe = _ring->get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = tok;
+    sqe->user_data = ignored_token;
+}
+
+int poll_registry::uring_wait(int timeout) {
+    _completions.clear();
+    struct timespec ts;
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+    }
+    // The wait timing out isn't an error, there are just no completions.
+    if (_ring->submit_and_wait(1, timeout >= 0 ? &ts : nullptr) < 0 && errno != ETIME) return -1;
+    _ring->for_each_cqe([&](const struct io_uring_cqe& cqe) {
+        _completions.push_back({ cqe.user_data, cqe.res, cqe.flags });
+    });
+    return _completions.size();
+}
+
+void poll_registry::uring_dispatch() {
+    for (auto& c : _completions) {
+        const uint8_t *data = nullptr;
+        int bid = -1;
+        if (c.flags & IORING_CQE_F_BUFFER) {
+            bid = c.flags >> IORING_CQE_BUFFER_SHIFT;
+            data = _ring->buffer(bid);
+        }
+        // The kernel terminated the multishot operation, it needs to be submitted again.
+        bool terminated = !(c.flags & IORING_CQE_F_MORE);
+        uint32_t slot = c.tok & 0xffffffff;
+
+        // The registration might have been removed, in which case this completion is stale and
+        // only its buffer matters.
+        auto reg = lookup(c.tok);
+        if (reg) {
+            switch (reg->kind) {
+                case op_kind::readiness:
+                    if (c.res > 0 && (c.res & reg->events)) reg->cb((short)c.res);
+                    if (terminated && c.res >= 0 && lookup(c.tok)) uring_submit(slot);
+                    break;
+
+                case op_kind::accept:
+                    reg->completion_cb(c.res, nullptr);
+                    if (terminated && c.res != -ECANCELED && c.res != -EBADF && c.res != -EINVAL
+                     && lookup(c.tok))
+                        uring_submit(slot);
+                    break;
+
+                case op_kind::recv:
+                    // The last completion of a cancelled receive. Whatever ended it, the owner
+                    // only needs to know that it's over.
+                    if (terminated && reg->cancelling) {
+                        release_slot(slot);
+                        completion_type cb = std::move(reg->completion_cb);
+                        if (c.res > 0) cb(c.res, data);
+                        cb(-ECANCELED, nullptr);
+                        break;
+                    }
+                    // Ran out of buffers. Some are returned below, so try again; the data is still
+                    // waiting in the socket.
+                    if (c.res == -ENOBUFS) {
+                        if (terminated) uring_submit(slot);
+                        break;
+                    }
+                    reg->completion_cb(c.res, data);
+                    if (terminated && c.res > 0 && lookup(c.tok)) uring_submit(slot);
+                    break;
+
+                case op_kind::send:
+                    // Sends complete exactly once, so the slot can go. The callback is still
+                    // valid until the next wait.
+                    release_slot(slot);
+                    reg->completion_cb(c.res, nullptr);
+                    break;
+            }
+        }
+
+        if (bid >= 0) _ring->recycle_buffer(bid);
+    }
+}
+
+int poll_registry::wait() {
+    _ready.clear();
+
+    // No callback is running now, so released slots can be reused.
+    _free_slots.insert(_free_slots.end(), _released_slots.begin(), _released_slots.end());
+    _released_slots.clear();
+
+    // What was deferred during the last iteration runs once this one is dispatched, so don't
+    // keep it waiting.
+    _iteration++;
+    _running_deferred.swap(_deferred);
+    _deferred.clear();
+
+    if (_backend == backend::sim) return sim_wait();
+    int timeout = _running_deferred.empty() ? next_timeout() : 0;
+    if (_backend == backend::uring) return uring_wait(timeout);
+
+    if (_backend == backend::poll) {
+        int n_events = ::poll(_fds.data(), _fds.size(), timeout);
+        if (n_events < 0) return n_events;
+        for (size_t i = 0; i < _fds.size(); i++) {
+            if (_fds[i].revents)
+                _ready.emplace_back(make_token(_fd_slots[i], _regs[_fd_slots[i]].generation),
+                                    _fds[i].revents);
+        }
+        return n_events;
+    }
+
+    // Make room for an event for every file descriptor, but not more than needed.
+    _epoll_events.resize(std::max<size_t>(1, std::min<size_t>(_active, 1024)));
+    int n_events = epoll_wait(_epfd, _epoll_events.data(), _epoll_events.size(), timeout);
+    if (n_events < 0) return n_events;
+    for (int i = 0; i < n_events; i++) {
+        auto& ev = _epoll_events[i];
+        for (auto slot : _interest[ev.data.fd].slots)
+            _ready.emplace_back(make_token(slot, _regs[slot].generation), (short)ev.events);
+    }
+    return n_events;
+}
+
 int poll_registry::poll(std::vector<token_type>& events) {
-    int n_events = ::poll(_fds.data(), _fds.size(), -1);
+    int n_events = wait();
     if (n_events < 0) return n_events;
-    events.reserve(n_events);
-    for (size_t i = 0; i < _fds.size(); i++) {
-        if (_fds[i].revents)
-            events.push_back(_callbacks_and_toks[i].second);
+    _now = current_time();
+    events.reserve(events.size() + _ready.size() + _completions.size());
+    for (auto& [tok, _] : _ready) events.push_back(tok);
+    if (_backend == backend::uring) {
+        for (auto& c : _completions) events.push_back(c.tok);
     }
+    run_timers();
+    run_deferred();
     return n_events;
 }
 
 int poll_registry::poll_and_dispatch() {
-    int n_events = ::poll(_fds.data(), _fds.size(), -1);
+    int n_events = wait();
     if (n_events < 0) return n_events;
+    _now = current_time();
 
-    for (size_t i = 0; i < _fds.size(); i++) {
-        auto& pollfd = _fds[i];
-        auto& [cb, _] = _callbacks_and_toks[i];
-        if (pollfd.revents & pollfd.events) cb(pollfd.revents);
+    if (_backend == backend::uring) {
+        uring_dispatch();
+    } else {
+        for (auto& [tok, revents] : _ready) {
+            // The registration might have been removed by a previous callback in this same
+            // dispatch.
+            auto reg = lookup(tok);
+            if (reg && (revents & reg->events)) reg->cb(revents);
+        }
     }
+
+    run_timers();
+    run_deferred();
     return n_events;
 }
+
+poll_registry::clock::time_point poll_registry::now() const { return _now; }
+
+poll_registry::clock::time_point poll_registry::current_time() const {
+    return _backend == backend::sim ? _now : clock::now();
+}
+
+uint64_t poll_registry::tick_of(clock::time_point t) const {
+    return (t - _origin) / timer_tick;
+}
+
+poll_registry::timer* poll_registry::lookup_timer(token_type tok) {
+    uint32_t slot = tok & 0xffffffff;
+    uint32_t generation = tok >> 32;
+    if (slot >= _timers.size()) return nullptr;
+    auto& t = _timers[slot];
+    if (!t.active || t.generation != generation) return nullptr;
+    return &t;
+}
+
+void poll_registry::timer_link(uint32_t slot) {
+    auto& t = _timers[slot];
+    uint32_t bucket = t.expiry % wheel_size;
+    t.bucket = bucket;
+    t.prev = no_slot;
+    t.next = _buckets[bucket];
+    if (t.next != no_slot) _timers[t.next].prev = slot;
+    _buckets[bucket] = slot;
+    _occupied[bucket / 64] |= (uint64_t)1 << (bucket % 64);
+}
+
+void poll_registry::timer_unlink(uint32_t slot) {
+    auto& t = _timers[slot];
+    uint32_t bucket = t.bucket;
+    if (t.prev != no_slot) _timers[t.prev].next = t.next;
+    else                   _buckets[bucket] = t.next;
+    if (t.next != no_slot) _timers[t.next].prev = t.prev;
+    if (_buckets[bucket] == no_slot) _occupied[bucket / 64] &= ~((uint64_t)1 << (bucket % 64));
+    t.bucket = t.prev = t.next = no_slot;
+}
+
+uint32_t poll_registry::acquire_timer() {
+    uint32_t slot;
+    if (_free_timers.empty()) {
+        slot = _timers.size();
+        _timers.emplace_back();
+    } else {
+        slot = _free_timers.back();
+        _free_timers.pop_back();
+    }
+    _active_timers++;
+    return slot;
+}
+
+poll_registry::token_type poll_registry::schedule_timer(clock::duration delay,
+                                                        timer_callback_type cb) {
+    uint32_t slot = acquire_timer();
+
+    // Round up, so a timer never fires early, and always at least one tick from now.
+    uint64_t ticks = (std::max(delay, clock::duration::zero()) + timer_tick - clock::duration(1))
+                   / timer_tick;
+    auto& t = _timers[slot];
+    t.expiry = std::max(tick_of(current_time()), _tick) + std::max<uint64_t>(ticks, 1);
+    t.active = true;
+    t.cb = std::move(cb);
+    timer_link(slot);
+    return make_token(slot, t.generation);
+}
+
+poll_registry::token_type poll_registry::defer(timer_callback_type cb) {
+    uint32_t slot = acquire_timer();
+    auto& t = _timers[slot];
+    t.active = true;
+    t.cb = std::move(cb);
+    auto tok = make_token(slot, t.generation);
+    _deferred.push_back(tok);
+    return tok;
+}
+
+bool poll_registry::cancel_timer(token_type tok) {
+    auto t = lookup_timer(tok);
+    if (!t) return false;
+    uint32_t slot = tok & 0xffffffff;
+
+    // Timers that are about to fire in this same tick are already unlinked, and deferred
+    // callbacks are never linked.
+    if (t->bucket != no_slot) timer_unlink(slot);
+    t->active = false;
+    t->generation++;
+    t->cb = nullptr;
+    _free_timers.push_back(slot);
+    _active_timers--;
+    return true;
+}
+
+uint64_t poll_registry::iteration() const { return _iteration; }
+
+std::optional<poll_registry::clock::time_point> poll_registry::next_deadline() const {
+    if (_active_timers == 0) return std::nullopt;
+
+    // Find the first occupied bucket after the current tick, scanning a word of the bitmap at a
+    // time and wrapping around the wheel.
+    size_t start = (_tick + 1) % wheel_size;
+    uint64_t distance = wheel_size;
+    for (size_t i = 0; i <= _occupied.size(); i++) {
+        size_t word = (start / 64 + i) % _occupied.size();
+        uint64_t bits = _occupied[word];
+        // Skip the buckets before `start` in its own word, the first time it is visited.
+        if (i == 0) bits &= ~(uint64_t)0 << (start % 64);
+        if (!bits) continue;
+        size_t bucket = word * 64 + __builtin_ctzll(bits);
+        distance = (bucket + wheel_size - start) % wheel_size + 1;
+        break;
+    }
+
+    // The bucket might only hold timers of a later rotation, in which case the loop wakes up
+    // without running anything and waits again. That is at most once per rotation.
+    return _origin + (_tick + distance) * timer_tick;
+}
+
+int poll_registry::next_timeout() const {
+    auto deadline = next_deadline();
+    if (!deadline) return -1;
+    auto left = std::chrono::ceil<std::chrono::milliseconds>(*deadline - current_time()).count();
+    return (int)std::max<decltype(left)>(left, 0);
+}
+
+void poll_registry::run_timers() {
+    uint64_t now_tick = tick_of(_now);
+    if (now_tick <= _tick || _active_timers == 0) {
+        _tick = std::max(_tick, now_tick);
+        return;
+    }
+
+    // Collect the expired timers of every bucket passed since the last run. If more than a whole
+    // rotation passed, every bucket is visited once.
+    _expired.clear();
+    uint64_t n_ticks = std::min<uint64_t>(now_tick - _tick, wheel_size);
+    for (uint64_t i = 1; i <= n_ticks; i++) {
+        uint32_t slot = _buckets[(_tick + i) % wheel_size];
+        while (slot != no_slot) {
+            auto& t = _timers[slot];
+            uint32_t next = t.next;
+            if (t.expiry <= now_tick) {
+                timer_unlink(slot);
+                _expired.push_back(make_token(slot, t.generation));
+            }
+            slot = next;
+        }
+    }
+    _tick = now_tick;
+
+    // The callbacks may schedule and cancel timers, even the ones expired but not run yet.
+    for (auto tok : _expired) {
+        auto t = lookup_timer(tok);
+        if (!t) continue;
+        auto cb = std::move(t->cb);
+        cancel_timer(tok);
+        cb();
+    }
+}
+
+void poll_registry::run_deferred() {
+    // Callbacks deferred from here on go to `_deferred`, and run in the next iteration.
+    for (auto tok : _running_deferred) {
+        auto t = lookup_timer(tok);
+        if (!t) continue;
+        auto cb = std::move(t->cb);
+        cancel_timer(tok);
+        cb();
+    }
+    _running_deferred.clear();
+}
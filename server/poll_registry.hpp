@@ -4,34 +4,317 @@
 #include <vector>
 #include <utility>
 #include <functional>
+#include <memory>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
 
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "uring.hpp"
 
 class poll_registry {
 public:
     using callback_type = std::function<void(short)>;
     using token_type = size_t;
 
+    // Called when a completion-based operation finishes. `res` is the result of the operation as
+    // the equivalent system call would return it, but with errors as negative errno values. For
+    // receives, `data` points to the `res` bytes received and is only valid during the call.
+    using completion_type = std::function<void(int res, const uint8_t *data)>;
+
+    using clock = std::chrono::steady_clock;
+    using timer_callback_type = std::function<void()>;
+
+    // The resolution of the timing wheel. The wheel covers `wheel_size` ticks per rotation.
+    static constexpr clock::duration timer_tick = std::chrono::milliseconds(10);
+
+    // The mechanism used to wait for events.
+    //
+    // - `poll` waits with `poll(2)`, so every call scans every registered file descriptor. It is
+    //   level-triggered.
+    // - `epoll` waits with `epoll(7)` in edge-triggered mode (`EPOLLET`), so every call only
+    //   touches the file descriptors that are ready. Callbacks registered in this mode **must**
+    //   consume the event (recv, send or accept until the operation would block), otherwise they
+    //   won't be notified again.
+    //
+    // - `uring` uses io_uring. Besides readiness notifications (multishot polls), it supports the
+    //   completion-based operations below, which let callers accept, receive and send without
+    //   a system call per operation: everything queued during a tick is submitted by the single
+    //   `io_uring_enter` that waits for the next events.
+    //
+    // - `sim` doesn't wait for anything: file descriptors are virtual (see `memory_network`), and
+    //   whoever changes their state notifies the registry with `sim_notify`. Time is virtual too,
+    //   and only moves with `advance`, so a simulation runs the same way every time. Waiting never
+    //   blocks.
+    //
+    // Callbacks should always be written for the edge-triggered case, since that also works for
+    // the level-triggered backend.
+    enum class backend {
+        poll,
+        epoll,
+        uring,
+        sim,
+    };
+
+    // The registry of the calling thread. Every thread has its own registry, so each reactor
+    // thread has an independent event loop.
     static poll_registry& instance();
 
-    poll_registry() = default;
-    ~poll_registry() = default;
+    poll_registry(backend b = backend::poll);
+    poll_registry(const poll_registry&) = delete;
+    poll_registry(poll_registry&&) = delete;
+    ~poll_registry();
+
+    // Changes the backend used by the registry. This can only be done while there are no events
+    // registered, otherwise an exception is thrown. If the kernel doesn't support io_uring (or
+    // the features needed), `uring` falls back to `epoll`; check `get_backend` for the backend
+    // actually in use.
+    void set_backend(backend b);
+    backend get_backend() const;
+
+    // Whether the completion-based operations are available (only with the `uring` backend).
+    bool supports_completions() const;
 
     // Register to wait for `events` in file descriptor `fd` that, when notified, should call `cb`.
     // This function returns a token which can be used to unregister this listener. This is
     // necessary because it is possible to register multiple listeners for the same file
     // descriptor.
+    //
+    // Both registering and unregistering are O(1).
     token_type register_event(int fd, short events, callback_type cb);
+
+    // Unregisters a listener or cancels a multishot operation. Once this returns, the callback
+    // associated with `tok` won't be called again.
     bool unregister_event(token_type tok);
+
+    // Accepts connections from the listening socket `fd` until cancelled. `cb` is called with the
+    // file descriptor of each accepted connection.
+    token_type accept_multishot(int fd, completion_type cb);
+
+    // Receives from `fd` until cancelled, into buffers picked by the kernel from a pool shared by
+    // every connection. `cb` is called with every chunk received, or with zero at end of stream.
+    token_type recv_multishot(int fd, completion_type cb);
+
+    // Stops a multishot receive without losing what it already received: unlike
+    // `unregister_event`, the callback keeps getting the completions that are on their way, and
+    // is called a last time with `-ECANCELED`. After that, the token is no longer valid.
+    bool cancel(token_type tok);
+
+    // Sends the buffers described by `msg` to `fd`. `msg` and everything it points to must stay
+    // valid until `cb` is called, which always happens exactly once, with the number of bytes
+    // sent. Sends can't be cancelled, shutting the socket down makes them complete early.
+    token_type sendmsg(int fd, const struct msghdr *msg, completion_type cb);
+
+    // Calls `cb` once, from the event loop, after at least `delay` has passed. Timers have the
+    // resolution of a tick of the timing wheel (`timer_tick`), and are rounded up to it.
+    //
+    // Both scheduling and cancelling are O(1). Timer tokens are independent of event tokens.
+    token_type schedule_timer(clock::duration delay, timer_callback_type cb);
+
+    // Calls `cb` once, from the next iteration of the event loop, after the events and timers of
+    // that iteration. Waiting doesn't block while anything is deferred, so this is how work that
+    // stopped to give the rest of the loop a turn resumes right away. Callbacks deferred in
+    // the same iteration run in the order they were deferred.
+    //
+    // The token is a timer token, and can be cancelled with `cancel_timer`.
+    token_type defer(timer_callback_type cb);
+
+    // Cancels a timer. Once this returns, its callback won't be called. Returns `false` if the
+    // timer already fired or was cancelled.
+    bool cancel_timer(token_type tok);
+
+    // The number of iterations of the event loop so far, for budgets that are renewed every
+    // iteration.
+    uint64_t iteration() const;
+
+    // The time at which the last wait returned. Cheaper than reading the clock, and precise enough
+    // for anything measured in ticks. With the `sim` backend, this is the virtual clock.
+    clock::time_point now() const;
+
+    // The function the `sim` backend asks for the events a virtual file descriptor is ready for.
+    using readiness_type = std::function<short(int fd)>;
+    void set_sim_readiness(readiness_type readiness);
+
+    // Tells the `sim` backend that the state of `fd` changed, so the next wait checks if it is
+    // ready for the events registered on it. Like `epoll`, registrations are notified once per
+    // change (and once when registered), not for as long as they are ready.
+    void sim_notify(int fd);
+
+    // Moves the virtual clock of the `sim` backend forward. The timers that expire run in the next
+    // iteration of the event loop.
+    void advance(clock::duration d);
+
+    // Whether the next iteration of the event loop has anything to do without time passing:
+    // notified file descriptors or deferred callbacks. Only meaningful with the `sim` backend.
+    bool has_pending_work() const;
+
+    // When the next timer is due, if there are timers.
+    std::optional<clock::time_point> next_deadline() const;
+
+    // Both of these run the callbacks of the timers that expired while waiting, and then the
+    // callbacks deferred in the previous iteration.
     int poll(std::vector<token_type>& events);
     int poll_and_dispatch();
 
 private:
-    token_type _next_tok = 0;
+    // What a registration is waiting for.
+    enum class op_kind {
+        readiness,
+        accept,
+        recv,
+        send,
+    };
+
+    struct registration {
+        int fd = -1;
+        short events = 0;
+        op_kind kind = op_kind::readiness;
+        // Incremented every time the slot is released, so stale tokens never match a new
+        // registration that reuses the same slot.
+        uint32_t generation = 0;
+        bool active = false;
+        // Whether a multishot operation was asked to stop (see `cancel`).
+        bool cancelling = false;
+        // Index into `_fds` (only used by the `poll` backend).
+        size_t pos = 0;
+        callback_type cb;
+        completion_type completion_cb;
+    };
+
+    // A completion taken from the io_uring completion queue.
+    struct completion {
+        token_type tok;
+        int res;
+        uint32_t flags;
+    };
+
+    // The events registered for a single file descriptor (only used by the `epoll` and `sim`
+    // backends). There is rarely more than two registrations per file descriptor (one for reading
+    // and one for writing) so a plain vector is enough.
+    struct fd_interest {
+        short events = 0;
+        // Whether the file descriptor is in `_sim_notified`.
+        bool notified = false;
+        std::vector<uint32_t> slots;
+    };
+
+    // A timer in the wheel. Timers of the same bucket form a doubly linked list of slots, so one
+    // can be unlinked without walking its bucket.
+    struct timer {
+        // The tick at which the timer expires. A bucket holds every timer whose expiry is equal to
+        // its index modulo the wheel size, so timers more than a rotation away stay in their
+        // bucket until their tick actually comes.
+        uint64_t expiry = 0;
+        uint32_t generation = 0;
+        bool active = false;
+        // The bucket the timer is linked into, or `no_slot` if it isn't linked.
+        uint32_t bucket = no_slot;
+        uint32_t prev = no_slot;
+        uint32_t next = no_slot;
+        timer_callback_type cb;
+    };
+
+    static const constexpr uint32_t no_slot = ~(uint32_t)0;
+    static const constexpr size_t wheel_size = 1024;
+
+    static token_type make_token(uint32_t slot, uint32_t generation);
+    registration* lookup(token_type tok);
+    timer* lookup_timer(token_type tok);
+
+    uint32_t acquire_timer();
+
+    uint32_t acquire_slot();
+    void release_slot(uint32_t slot);
+
+    // Waits for events and fills `_ready` with the tokens that were notified, along with the
+    // events received. Waits for no longer than the next timer due.
+    int wait();
+
+    uint64_t tick_of(clock::time_point t) const;
+    void timer_link(uint32_t slot);
+    void timer_unlink(uint32_t slot);
+
+    // The number of milliseconds until the next bucket with timers is due, or -1 if there are no
+    // timers.
+    int next_timeout() const;
+
+    // The real time, or the virtual time with the `sim` backend.
+    clock::time_point current_time() const;
+
+    // Advances the wheel up to `_now`, calling the callbacks of every timer that expired.
+    void run_timers();
+    void run_deferred();
+
+    void poll_add(uint32_t slot);
+    void poll_remove(uint32_t slot);
+
+    void epoll_add(uint32_t slot);
+    void epoll_remove(uint32_t slot);
+    void epoll_update(int fd, short old_events);
+
+    void sim_add(uint32_t slot);
+    void sim_remove(uint32_t slot);
+    int sim_wait();
+
+    // Queues the submission for the operation of `slot` (used both to start it and to restart
+    // multishot operations that the kernel terminated).
+    void uring_submit(uint32_t slot);
+    void uring_cancel(token_type tok);
+    int uring_wait(int timeout);
+    void uring_dispatch();
+
+    backend _backend;
+
+    std::vector<registration> _regs;
+    std::vector<uint32_t> _free_slots;
+    // Slots released while dispatching. They can only be reused after the dispatch is done,
+    // since the callback that released them might still be running.
+    std::vector<uint32_t> _released_slots;
+    size_t _active = 0;
+
+    std::vector<std::pair<token_type, short>> _ready;
+
+    // State for the `poll` backend. `_fd_slots[i]` is the slot that owns `_fds[i]`.
     std::vector<struct pollfd> _fds;
-    std::vector<std::pair<callback_type, token_type>> _callbacks_and_toks;
+    std::vector<uint32_t> _fd_slots;
+
+    // State for the `epoll` backend. `_interest` is indexed by file descriptor.
+    int _epfd = -1;
+    std::vector<fd_interest> _interest;
+    std::vector<struct epoll_event> _epoll_events;
+
+    // State for the `uring` backend.
+    std::unique_ptr<uring> _ring;
+    std::vector<completion> _completions;
+
+    // State for the `sim` backend, which shares `_interest` with the `epoll` backend.
+    readiness_type _sim_readiness;
+    std::vector<int> _sim_notified;
+
+    // State for the timing wheel. `_buckets` holds the first timer of each bucket, and
+    // `_occupied` has a bit set for every bucket that isn't empty, so finding the next timer due
+    // only scans a few words. `_tick` is the last tick processed.
+    std::vector<timer> _timers;
+    std::vector<uint32_t> _free_timers;
+    std::array<uint32_t, wheel_size> _buckets;
+    std::array<uint64_t, wheel_size / 64> _occupied {};
+    size_t _active_timers = 0;
+    clock::time_point _origin;
+    clock::time_point _now;
+    uint64_t _tick = 0;
+    std::vector<token_type> _expired;
+
+    // The callbacks deferred during this iteration, and the ones deferred during the previous
+    // iteration, which run at the end of this one. Both are timers that aren't in the wheel.
+    std::vector<token_type> _deferred;
+    std::vector<token_type> _running_deferred;
+    uint64_t _iteration = 0;
 
-    static poll_registry global_instance;
+    static thread_local poll_registry global_instance;
 };
 
 #endif
@@ -0,0 +1,88 @@
+#ifndef _POOLED_QUEUE_H
+#define _POOLED_QUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+#include "buffer_pool.hpp"
+
+namespace irc {
+
+    // A double-ended queue in a ring buffer leased from the `buffer_pool` of the calling thread.
+    // The buffer is only held while the queue isn't empty, so an idle queue takes no memory
+    // besides the queue itself (unlike `std::deque`, which always holds a chunk). When full, the
+    // elements move to a buffer twice as big.
+    template<typename T>
+    class pooled_queue {
+    public:
+        pooled_queue() = default;
+        pooled_queue(const pooled_queue&) = delete;
+        pooled_queue& operator=(const pooled_queue&) = delete;
+        ~pooled_queue() { clear(); }
+
+        bool empty() const { return _size == 0; }
+        size_t size() const { return _size; }
+
+        // The `i`th element, counting from the front.
+        T& operator[](size_t i) { return slots()[wrap(_head + i)]; }
+        T& front() { return (*this)[0]; }
+
+        void push_back(T value) {
+            if (_size == _capacity) grow();
+            new (&slots()[wrap(_head + _size)]) T(std::move(value));
+            _size++;
+        }
+
+        void pop_front() {
+            front().~T();
+            _head = wrap(_head + 1);
+            if (--_size == 0) release();
+        }
+
+        void pop_back() {
+            (*this)[_size - 1].~T();
+            if (--_size == 0) release();
+        }
+
+        void clear() {
+            while (!empty()) pop_back();
+        }
+
+    private:
+        // The first buffer leased, in bytes.
+        static const constexpr size_t initial_bytes = 256;
+
+        T* slots() { return reinterpret_cast<T*>(_buffer.data()); }
+
+        size_t wrap(size_t i) const { return i >= _capacity ? i - _capacity : i; }
+
+        void grow() {
+            auto buffer = buffer_pool::instance().acquire(_capacity > 0 ? _capacity * sizeof(T) * 2
+                                                                         : initial_bytes);
+            T *to = reinterpret_cast<T*>(buffer.data());
+            for (size_t i = 0; i < _size; i++) {
+                T& from = (*this)[i];
+                new (&to[i]) T(std::move(from));
+                from.~T();
+            }
+            _buffer = std::move(buffer);
+            _capacity = _buffer.size() / sizeof(T);
+            _head = 0;
+        }
+
+        void release() {
+            _buffer.reset();
+            _capacity = 0;
+            _head = 0;
+        }
+
+        buffer_pool::lease _buffer;
+        uint32_t _capacity = 0;
+        uint32_t _head = 0;
+        uint32_t _size = 0;
+    };
+}
+
+#endif
@@ -0,0 +1,241 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include <sched.h>
+
+#include "reactor.hpp"
+#include "server.hpp"
+#include "utils.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+
+namespace irc {
+    // How long accepting pauses once there are no file descriptors or memory left for new
+    // connections, for some to be released.
+    static const constexpr auto accept_backoff = std::chrono::milliseconds(100);
+
+    reactor::reactor(server& srv, size_t index)
+        : _server(srv)
+        , _index(index)
+        , _listener(srv.cfg().port, srv.cfg().backlog)
+        , _on_message([this](connection *conn, std::string_view s) { _server.handle_message(conn, s); })
+    { }
+
+    reactor::~reactor() { join(); }
+
+    void reactor::start() {
+        _thread = std::thread([this] { this->run(); });
+    }
+
+    void reactor::join() {
+        if (_thread.joinable()) _thread.join();
+    }
+
+    void reactor::pin_to_cpu() {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) THROW_ERRNO("sched_getaffinity failed");
+
+        // Find the `n`th allowed CPU, wrapping around if there are more reactors than CPUs.
+        size_t n = _index % CPU_COUNT(&allowed);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &allowed) || n-- > 0) continue;
+
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if (sched_setaffinity(0, sizeof(set), &set) < 0) THROW_ERRNO("sched_setaffinity failed");
+            return;
+        }
+    }
+
+    void reactor::run() {
+        const auto& cfg = _server.cfg();
+        if (cfg.pin_cpus) pin_to_cpu();
+
+        // The registry is thread local, so this is the registry of this reactor only.
+        auto& registry = poll_registry::instance();
+        registry.set_backend(cfg.reactor);
+
+        _listener.start();
+        watch_listener();
+
+        // Nothing to do when notified, the loop checks if it should quit after every dispatch.
+        _quit_tok = registry.register_event(server::quit_fd(), POLLIN, [](short) { });
+        _mailbox_tok = registry.register_event(_mailbox.fd(), POLLIN, [&](short) { this->deliver_mail(); });
+
+        // A single reactor serves the metrics, which cover every reactor anyway.
+        if (_index == 0 && !cfg.metrics_socket.empty()) {
+            _metrics_endpoint = std::make_unique<metrics_endpoint>(cfg.metrics_socket);
+            _metrics_tok = registry.register_event(_metrics_endpoint->fd(), POLLIN, [&](short) {
+                _metrics_endpoint->serve();
+            });
+            LOG(info, "Serving metrics on {}", cfg.metrics_socket);
+        }
+
+        LOG(info, "Listening localhost, port {} ({} reactor {})", cfg.port,
+            config::backend_name(registry.get_backend()), _index);
+
+        auto& metrics = thread_metrics::local();
+        while (!server::should_quit()) {
+            // If the poll call failed because of an interrupt, skip this iteration of the loop.
+            // Note that if the SIGINT signal was the cause, the quit flag will be set and the loop
+            // will exit. If any other error occurs, throw.
+            int n_events = registry.poll_and_dispatch();
+            if (n_events < 0) {
+                if (errno == EINTR) continue;
+                THROW_ERRNO("poll failed");
+            }
+
+            reap_connections();
+            outbox::instance().flush();
+            if (auto capture = _server.traffic_capture()) capture->flush();
+
+            metrics.ready_events.record(n_events);
+            metrics.tick_duration.record(poll_registry::clock::now() - registry.now());
+            metrics.connections.set(_connections.size());
+        }
+
+        // Tear everything down from this thread, since the registrations belong to its registry.
+        // All `tcpstream` destructors will run, closing any open connections.
+        if (_listener_tok) registry.unregister_event(*_listener_tok);
+        if (_accept_tok) registry.cancel_timer(*_accept_tok);
+        registry.unregister_event(*_quit_tok);
+        registry.unregister_event(*_mailbox_tok);
+        if (_metrics_tok) registry.unregister_event(*_metrics_tok);
+        _metrics_endpoint.reset();
+        _connections.clear();
+        _closing.clear();
+        outbox::instance().flush();
+        if (auto capture = _server.traffic_capture()) capture->flush();
+
+        auto stats = connection::stats();
+        LOG(info, "reactor {} sent {} bytes of {} buffers in {} calls ({} bytes per call), dropped {} "
+                  "messages, throttled {} lines, yielded {} times", _index, stats.bytes,
+            stats.buffers, stats.calls, stats.calls > 0 ? stats.bytes / stats.calls : 0,
+            stats.dropped_messages, stats.throttled_lines, stats.budget_yields);
+        print_pool_stats();
+    }
+
+    void reactor::print_pool_stats() {
+        auto print = [&](const std::string& name, const slab_allocator::stats& s) {
+            LOG(info, "reactor {} {} pool: {} in use, {} idle, peak {} ({} bytes each), {} allocations",
+                _index, name, s.in_use, s.idle, s.peak_in_use, s.block_size, s.allocations);
+        };
+
+        print("connection", _connection_pool.get_stats());
+        for (const auto& s : buffer_pool::instance().stats()) {
+            if (s.allocations == 0) continue;
+            print(std::to_string(s.block_size) + " byte buffer", s);
+        }
+    }
+
+    void reactor::watch_listener() {
+        auto& registry = poll_registry::instance();
+        if (registry.supports_completions()) {
+            _listener_tok = registry.accept_multishot(_listener.fd(), [&](int res, const uint8_t*) {
+                this->complete_accept(res);
+            });
+        } else {
+            _listener_tok = registry
+                .register_event(_listener.fd(), POLLIN, [&](short) { this->poll_accept(); });
+        }
+    }
+
+    void reactor::pause_accept(int err) {
+        auto& registry = poll_registry::instance();
+        LOG(error, "accept failed ({}), pausing accepts for {} ms", strerror(err),
+            std::chrono::duration_cast<std::chrono::milliseconds>(accept_backoff).count());
+
+        // The connections keep waiting in the backlog, so the listener would be ready again right
+        // away. Stop watching it until the backoff is over.
+        if (_listener_tok) registry.unregister_event(*_listener_tok);
+        _listener_tok.reset();
+        if (_accept_tok) registry.cancel_timer(*_accept_tok);
+        _accept_tok = registry.schedule_timer(accept_backoff, [this] {
+            _accept_tok.reset();
+            this->watch_listener();
+            // An edge-triggered backend won't notify us of the connections that were already
+            // waiting.
+            if (!poll_registry::instance().supports_completions()) this->poll_accept();
+        });
+    }
+
+    void reactor::poll_accept() {
+        auto& registry = poll_registry::instance();
+        if (_accept_tok) registry.cancel_timer(*_accept_tok);
+        _accept_tok.reset();
+
+        // Accept the pending connections up to the budget. An edge-triggered backend won't notify
+        // us again for the ones still waiting, so if the budget runs out, come back for them in
+        // the next iteration, after the other events had their turn.
+        for (size_t n = 0; n < _server.cfg().accept_budget; n++) {
+            auto accepted = _listener.accept();
+            if (!accepted) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) pause_accept(errno);
+                return;
+            }
+            add_connection(std::move(accepted->stream), accepted->peer_ipv4());
+        }
+        _accept_tok = registry.defer([this] { this->poll_accept(); });
+    }
+
+    void reactor::complete_accept(int res) {
+        if (res < 0) {
+            // The multishot accept goes on by itself after an error of a single connection.
+            if (tcplistener::is_connection_error(-res)) return;
+            if (tcplistener::is_resource_error(-res)) pause_accept(-res);
+            else LOG(error, "accept failed ({})", strerror(-res));
+            return;
+        }
+        auto accepted = _listener.adopt(res);
+        if (!accepted) {
+            LOG(debug, "dropped a connection reset before it was handled ({})", strerror(errno));
+            return;
+        }
+        add_connection(std::move(accepted->stream), accepted->peer_ipv4());
+    }
+
+    void reactor::add_connection(tcpstream stream, uint32_t ipv4) {
+        connection_id_t id = _server.next_connection_id();
+
+        LOG(info, "client {} connected", id);
+
+        auto ptr = _connection_pool.make(std::move(stream), id, _on_message, _server.cfg(),
+                                         &_mailbox, _connections.next_handle());
+        auto conn = ptr.get();
+        _connections.insert(std::move(ptr));
+        _server.add_connection(conn, ipv4);
+    }
+
+    void reactor::deliver_mail() {
+        _mailbox.drain([&](letter_batch batch) {
+            for (auto& l : batch) {
+                // The connection might have been closed after the letter was posted.
+                if (auto conn = _connections.get(l.to)) (*conn)->deliver(std::move(l));
+            }
+        });
+    }
+
+    void reactor::reap_connections() {
+        // All connections that are about to close, quit all of their channels.
+        for (auto i = _connections.begin(); i != _connections.end();) {
+            if (!(*i)->is_connected()) {
+                _server.remove_connection(i->get());
+
+                // Operations still in flight might reference the connection, so it has to wait for
+                // them before being destroyed.
+                if ((*i)->has_pending_io()) _closing.push_back(std::move(*i));
+                // The last connection takes the place of the erased one, so `i` isn't advanced.
+                i = _connections.erase(i);
+            } else {
+                i++;
+            }
+        }
+
+        _closing.erase(std::remove_if(_closing.begin(), _closing.end(),
+                                      [](auto& conn) { return !conn->has_pending_io(); }),
+                       _closing.end());
+    }
+}
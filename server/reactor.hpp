@@ -0,0 +1,109 @@
+#ifndef _REACTOR_H
+#define _REACTOR_H
+
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "tcplistener.hpp"
+#include "poll_registry.hpp"
+#include "connection.hpp"
+#include "mailbox.hpp"
+#include "slot_map.hpp"
+#include "slab.hpp"
+#include "metrics.hpp"
+
+namespace irc {
+    class server;
+
+    // A reactor is an event loop running on its own thread, with its own `poll_registry` and its
+    // own listener socket. The listeners of every reactor are bound to the same port with
+    // `SO_REUSEPORT`, so the kernel spreads new connections between them. Each connection belongs
+    // to the reactor that accepted it for its whole life.
+    class reactor {
+    public:
+        reactor(server& srv, size_t index);
+        reactor(const reactor&) = delete;
+        reactor(reactor&&) = delete;
+        ~reactor();
+
+        // Spawns the thread of the reactor.
+        void start();
+
+        // Waits for the thread of the reactor to exit, which happens once the server quits.
+        void join();
+
+    private:
+        // The body of the reactor thread.
+        void run();
+
+        // Pins the calling thread to a CPU, picked by the index of the reactor among the CPUs the
+        // process is allowed to run on.
+        void pin_to_cpu();
+
+        // Registers the listener with the registry: a multishot accept with a completion-based
+        // backend, readiness otherwise.
+        void watch_listener();
+
+        // Stops accepting for `accept_backoff`, after an accept failed with `err` for lack of file
+        // descriptors or memory.
+        void pause_accept(int err);
+
+        // Accepts the connections waiting on the listener, at most `config::accept_budget` at a
+        // time.
+        void poll_accept();
+
+        // Called for every connection accepted by the multishot accept of a completion-based
+        // backend.
+        void complete_accept(int res);
+
+        // `ipv4` is the address of the peer, in host byte order.
+        void add_connection(tcpstream stream, uint32_t ipv4);
+
+        // Delivers the messages other reactors posted for connections of this reactor.
+        void deliver_mail();
+
+        // Destroys the connections that are disconnected.
+        void reap_connections();
+
+        // Prints the occupancy of the pools of the reactor.
+        void print_pool_stats();
+
+        server& _server;
+        size_t _index;
+
+        tcplistener _listener;
+
+        // The message handler of every connection of the reactor.
+        connection::message_handler_type _on_message;
+        std::optional<poll_registry::token_type> _listener_tok;
+        // Resumes accepting when the budget ran out with connections still waiting, or once the
+        // backoff after running out of file descriptors is over. The listener isn't registered
+        // during the backoff.
+        std::optional<poll_registry::token_type> _accept_tok;
+        std::optional<poll_registry::token_type> _mailbox_tok;
+        std::optional<poll_registry::token_type> _quit_tok;
+
+        // Only the first reactor serves the metrics, if `config::metrics_socket` is set.
+        std::unique_ptr<metrics_endpoint> _metrics_endpoint;
+        std::optional<poll_registry::token_type> _metrics_tok;
+
+        // The connections are allocated from slabs of the reactor, so a storm of reconnects keeps
+        // reusing the same memory. Declared first, so it outlives the connections.
+        object_pool<irc::connection> _connection_pool;
+
+        // The letters in the mailbox are addressed by handle, so delivering one is a lookup in the
+        // table, and a letter to a connection that already closed doesn't reach a newer connection
+        // that took its slot.
+        slot_map<object_pool<irc::connection>::pointer, irc::connection> _connections;
+        // Disconnected connections waiting for their operations in flight to finish.
+        std::vector<object_pool<irc::connection>::pointer> _closing;
+
+        mailbox<letter_batch> _mailbox;
+
+        std::thread _thread;
+    };
+}
+
+#endif
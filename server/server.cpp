@@ -0,0 +1,550 @@
+#include <algorithm>
+#include <csignal>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "server.hpp"
+#include "reactor.hpp"
+#include "message.hpp"
+#include "utils.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+
+namespace irc {
+    // Set by the interrupt handler. The eventfd is written at the same time, so reactors blocked
+    // waiting for events wake up and see the flag.
+    // The flag is read by every reactor thread, so it is a (lock-free) atomic instead of a plain
+    // `sig_atomic_t`.
+    static std::atomic<bool> quit = false;
+    static int quit_eventfd = -1;
+
+    // How long the clients sending to congested channels stop being read, with the `pause` send
+    // queue policy.
+    static const constexpr auto congestion_pause = std::chrono::milliseconds(100);
+
+    server::server(const irc::config& cfg) : _cfg(cfg) {
+        if (!_cfg.capture.empty()) _capture = std::make_unique<irc::capture>(_cfg.capture);
+    }
+
+    server::~server() {
+        // The reactors must stop before the state they reference goes away.
+        _reactors.clear();
+    }
+
+    const irc::config& server::cfg() const { return _cfg; }
+
+    irc::capture* server::traffic_capture() { return _capture.get(); }
+
+    bool server::should_quit() { return quit; }
+    int server::quit_fd() { return quit_eventfd; }
+
+    void server::run() {
+        auto& log = logger::instance();
+        log.set_level(_cfg.log_level);
+        log.start();
+
+        quit_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (quit_eventfd < 0) THROW_ERRNO("eventfd failed");
+
+        // Interrupt handler that sets the quit flag and wakes every reactor up. Both operations
+        // are async-signal-safe.
+        std::signal(SIGINT, [](int){
+            int saved_errno = errno;
+            quit = true;
+            uint64_t one = 1;
+            if (write(quit_eventfd, &one, sizeof(one)) < 0) { }
+            errno = saved_errno;
+        });
+
+        for (size_t i = 0; i < _cfg.threads; i++)
+            _reactors.emplace_back(std::make_unique<reactor>(*this, i));
+        for (auto& r : _reactors) r->start();
+        for (auto& r : _reactors) r->join();
+        _reactors.clear();
+
+        close(quit_eventfd);
+        quit_eventfd = -1;
+        log.stop();
+    }
+
+    connection_id_t server::next_connection_id() {
+        return _curr_id_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void server::add_connection(irc::connection *conn, uint32_t ipv4) {
+        if (_capture) _capture->connected(conn->id(), ipv4);
+        std::unique_lock<std::shared_mutex> lock(_db_mutex);
+        _db.register_connection(conn->id(), ipv4);
+    }
+
+    void server::remove_connection(irc::connection *conn) {
+        connection_id_t id = conn->id();
+        if (_capture) _capture->disconnected(id);
+        std::unique_lock<std::shared_mutex> lock(_db_mutex);
+        auto info = _db.get_conn_info(id);
+        if (info.joined_channel) {
+            auto chan = _db.get_channel(*info.joined_channel);
+            chan->send_message(irc::message(info.nick.value(), irc::command::privmsg,
+                                            {std::string(chan->name()),
+                                             info.nick.value() + " quit"}));
+            _db.quit_chan(id, *info.joined_channel);
+        }
+        _db.remove_connection(id);
+    }
+
+    bool server::check_oper_password(std::string_view password) const {
+        const auto& expected = _cfg.oper_password;
+        if (expected.empty() || password.size() != expected.size()) return false;
+        // Compare every byte, so the time taken doesn't tell how much of the password matched.
+        unsigned char diff = 0;
+        for (size_t i = 0; i < expected.size(); i++) diff |= expected[i] ^ password[i];
+        return diff == 0;
+    }
+
+    std::optional<std::string_view> server::get_chan_name(std::string_view param, db::conn_info& conn_info) {
+        // This diverges from the RFC. Originally the command would have to provide a
+        // channel name. However, in this implementation a client can only be in one
+        // channel at a time. So this `---` special channel name means "whatever
+        // channel the client happens to be on".
+        if (param == "---") {
+            if (!conn_info.joined_channel) return std::nullopt;
+            return _db.get_channel(*conn_info.joined_channel)->name();
+        }
+        return param;
+    }
+
+    bool server::reads_db_only(irc::command cmd) {
+        // Sending to a channel only reads its members, and sending to a connection of another
+        // reactor is safe from any thread.
+        switch (cmd) {
+            case irc::command::privmsg:
+            case irc::command::whois:
+            case irc::command::stats:
+            case irc::command::ping:
+            case irc::command::pong:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    void server::handle_message(irc::connection *conn, std::string_view s) {
+        // Should never happen!
+        if (!conn) std::terminate();
+        auto id = conn->id();
+
+        auto& metrics = thread_metrics::local();
+        irc::message_view message;
+        auto status = irc::message_view::parse(s, message);
+        if (_capture) {
+            // Operators would be giving their password away to whoever reads the capture.
+            auto command = std::get_if<irc::command>(&message.command);
+            bool is_oper = status == irc::message_view::parse_status::ok
+                        && command && *command == irc::command::oper;
+            _capture->line(id, is_oper ? std::string_view("OPER * :<redacted>") : s);
+        }
+        if (status != irc::message_view::parse_status::ok) {
+            metrics.malformed_lines.add();
+            LOG(warn, "client {} sent a malformed message: {}", conn->id(),
+                irc::message_view::describe(status));
+            return;
+        }
+
+        // Numeric replies are only sent by servers, so one from a client is as malformed as an
+        // unknown command.
+        auto command = std::get_if<irc::command>(&message.command);
+        if (!command) {
+            metrics.malformed_lines.add();
+            LOG(warn, "client {} sent a numeric reply", conn->id());
+            return;
+        }
+
+        irc::command cmd = *command;
+        std::shared_lock<std::shared_mutex> shared(_db_mutex, std::defer_lock);
+        std::unique_lock<std::shared_mutex> exclusive(_db_mutex, std::defer_lock);
+        if (reads_db_only(cmd)) shared.lock();
+        else                    exclusive.lock();
+        auto& conn_info = _db.get_conn_info(id);
+
+        metrics.commands[static_cast<size_t>(cmd)].add();
+
+        // First command must be a NICK.
+        if (conn_info.state == db::conn_state::init && cmd != irc::command::nick) {
+            LOG(debug, "Ignoring unexpected message. Expected 'NICK' command. Got {}", log_quoted { s });
+            return;
+        }
+
+        // After a NICK command, must send a USER command.
+        if (conn_info.state == db::conn_state::registered_nick && cmd != irc::command::user) {
+            LOG(debug, "Ignoring unexpected message. Expected 'USER' command. Got {}", log_quoted { s });
+            return;
+        }
+
+        // Keepalives don't count as activity, otherwise the idle timeout would never expire for
+        // clients that answer our PINGs.
+        if (cmd != irc::command::ping && cmd != irc::command::pong) conn->mark_active();
+
+        switch (cmd) {
+            // Ignore
+            case irc::command::pong: return;
+
+            case irc::command::nick:
+            {
+                if (message.params.size() < 1) {
+                    conn->send_need_more_params(cmd);
+                    return;
+                }
+
+                auto nick = message.params.at(0);
+                if (nick.size() > 50) {
+                    conn->send_reply(irc::ERR_ERRONEUSNICKNAME);
+                    return;
+                }
+
+                if (!_db.set_nick(id, nick)) {
+                    conn->send_reply(irc::ERR_NICKNAMEINUSE);
+                    return;
+                }
+
+                LOG(info, "client {} registered as {}", id, nick);
+                if (conn_info.state == db::conn_state::init) {
+                    conn_info.state = db::conn_state::registered_nick;
+                }
+                return;
+            }
+
+            case irc::command::user:
+            {
+                // Command: USER
+                // Parameters: <username> <hostname> <servername> <realname>
+                //
+                // For the purposes of this implementation, <hostname> and <servername> are
+                // ignored.
+
+                if (message.params.size() < 4) {
+                    conn->send_need_more_params(cmd);
+                    return;
+                }
+
+                if (conn_info.state == db::conn_state::registered_user) {
+                    conn->send_reply(irc::ERR_ALREADYREGISTERED);
+                    return;
+                }
+
+                conn_info.username = message.params.at(0);
+                conn_info.realname = message.params.at(3);
+                conn_info.state = db::conn_state::registered_user;
+                conn->mark_registered();
+
+                LOG(info, "registered user with username {} and real name {}",
+                    log_quoted { *conn_info.username }, log_quoted { *conn_info.realname });
+                return;
+            }
+
+            case irc::command::oper:
+            {
+                // Command: OPER
+                // Parameters: <user> <password>
+                //
+                // There is a single password for every operator, so <user> is ignored.
+
+                if (message.params.size() < 2) {
+                    conn->send_need_more_params(cmd);
+                    return;
+                }
+
+                if (!check_oper_password(message.params.at(1))) {
+                    LOG(warn, "client {} failed to become an operator", id);
+                    conn->send_reply(irc::ERR_PASSWDMISMATCH);
+                    return;
+                }
+
+                conn_info.is_oper = true;
+                LOG(info, "client {} is now an operator", id);
+                conn->send_reply(irc::RPL_YOUREOPER);
+                return;
+            }
+
+            case irc::command::stats:
+            {
+                // Command: STATS
+                // Parameters: [<query>]
+                //
+                // Diverges from the RFC: every query gets the same report, the metrics of the
+                // server (see `metrics_snapshot`), and only operators can ask for it.
+
+                if (!conn_info.is_oper) {
+                    conn->send_reply(irc::ERR_NOPRIVILEGES);
+                    return;
+                }
+
+                auto snapshot = metrics_snapshot::total();
+                for (size_t i = 0; i < snapshot.commands.size(); i++) {
+                    conn->send_message(irc::message("server", irc::RPL_STATSCOMMANDS,
+                                                    { std::string(command_table[i].name),
+                                                      std::to_string(snapshot.commands[i]) }));
+                }
+                for (auto& line : snapshot.summary())
+                    conn->send_message(irc::message("server", irc::RPL_STATSDEBUG, { line }));
+
+                std::string query = message.params.empty() ? "*" : std::string(message.params.at(0));
+                conn->send_message(irc::message("server", irc::RPL_ENDOFSTATS,
+                                                { query, "End of STATS report" }));
+                return;
+            }
+
+            case irc::command::ping:
+            {
+                // Here we are diverging from the RFC. In the RFC, PING commands
+                // can only be sent by servers and answered by clients. Here we do
+                // it the other way around.
+                conn->send_message(irc::message(irc::command::pong));
+                return;
+            }
+
+            case irc::command::join:
+            {
+                if (message.params.size() < 1) {
+                    conn->send_need_more_params(cmd);
+                    return;
+                }
+
+                auto chan_name = message.params.at(0);
+                if (chan_name.size() == 0
+                 || chan_name.size() > 200
+                 || (chan_name[0] != '#' && chan_name[0] != '&')
+                 || chan_name.find(',') != std::string::npos) {
+                    conn->send_reply(irc::ERR_NOSUCHCHANNEL);
+                    return;
+                }
+
+                if (conn_info.joined_channel) _db.quit_chan(id, *conn_info.joined_channel);
+
+                auto& chan = _db.join_chan(conn, chan_name);
+                auto member = chan.get_member(id);
+                std::stringstream ss;
+                ss << conn_info.nick.value();
+                ss << " joined " << chan_name;
+                if (member->is_operator) ss << " as moderator";
+                chan.send_message(irc::message("system", command::privmsg,
+                                               {std::string(chan_name), ss.str()}));
+                return;
+            }
+
+            case irc::command::mode:
+            {
+                if (message.params.size() < 3) {
+                    conn->send_need_more_params(cmd);
+                    return;
+                }
+
+                auto opt_chan_name = get_chan_name(message.params.at(0), conn_info);
+                if (!opt_chan_name) {
+                    conn->send_reply(irc::ERR_NOTONCHANNEL);
+                    return;
+                }
+                std::string_view chan_name = *opt_chan_name;
+
+                auto chan = _db.get_channel(chan_name);
+
+                if (!chan) {
+                    conn->send_reply(irc::ERR_NOSUCHCHANNEL);
+                    return;
+                }
+
+                auto member = chan->get_member(id);
+                if (!member) {
+                    conn->send_reply(irc::ERR_NOTONCHANNEL);
+                    return;
+                }
+
+                if (!member->is_operator) {
+                    conn->send_reply(irc::ERR_CHANOPRIVSNEEDED);
+                    return;
+                }
+
+                auto modifiers = message.params.at(1);
+                auto target_id = _db.get_conn_info_by_nick(message.params.at(2));
+                if (!target_id) {
+                    conn->send_reply(irc::ERR_NOSUCHNICK);
+                    return;
+                }
+
+                bool ok = true;
+                if      (modifiers.find("+v") != std::string::npos) ok = chan->unmute(target_id->id);
+                else if (modifiers.find("-v") != std::string::npos) ok = chan->mute(target_id->id);
+
+                if (!ok) {
+                    // TODO: Should probably be a better message. This happens when trying to alter
+                    // the permissions of a user that exists but is not on the channel. It's not
+                    // that the operator isn't on the channel.
+                    conn->send_reply(irc::ERR_NOTONCHANNEL);
+                    return;
+                }
+
+                // TODO: implement more modifiers.
+                return;
+            }
+
+            case irc::command::whois:
+            {
+                if (message.params.size() < 1) {
+                    conn->send_need_more_params(cmd);
+                    return;
+                }
+
+                // I think this diverges from the RFC. As per the RFC, anyone can ask who is
+                // anyone else in my understanding.
+
+                if (!conn_info.joined_channel) {
+                    conn->send_reply(irc::ERR_NOTONCHANNEL);
+                    return;
+                }
+
+                auto chan = _db.get_channel(*conn_info.joined_channel);
+                auto member = chan->get_member(id);
+                if (!member->is_operator) {
+                    conn->send_reply(irc::ERR_CHANOPRIVSNEEDED);
+                    return;
+                }
+
+                auto target = _db.get_conn_info_by_nick(message.params.at(0));
+                if (!target) {
+                    conn->send_reply(irc::ERR_NOSUCHNICK);
+                    return;
+                }
+
+                uint32_t ipv4 = target->ipv4;
+
+                std::ostringstream ss;
+                ss << ((ipv4 >> 24) & 0xff) << "."
+                   << ((ipv4 >> 16) & 0xff) << "."
+                   << ((ipv4 >>  8) & 0xff) << "."
+                   << (ipv4 & 0xff);
+
+                conn->send_message(irc::message(irc::RPL_WHOISUSER,
+                                                {target->username.value_or("uknown"),
+                                                 ss.str(), "*",
+                                                 target->realname.value_or("uknown")}));
+                return;
+            }
+
+            case irc::command::privmsg:
+            {
+                if (message.params.size() < 2) {
+                    conn->send_need_more_params(cmd);
+                    return;
+                }
+
+                auto opt_chan_name = get_chan_name(message.params.at(0), conn_info);
+                if (!opt_chan_name) {
+                    conn->send_reply(irc::ERR_NOTONCHANNEL);
+                    return;
+                }
+                std::string_view chan_name = *opt_chan_name;
+
+                auto chan = _db.get_channel(chan_name);
+                if (!chan) {
+                    conn->send_reply(irc::ERR_NOSUCHCHANNEL);
+                    return;
+                }
+
+                auto member = chan->get_member(id);
+                if (!member) {
+                    conn->send_reply(irc::ERR_NOTONCHANNEL);
+                    return;
+                }
+
+                if (member->is_muted) {
+                    conn->send_reply(irc::ERR_CANNOTSENDTOCHAN);
+                    return;
+                }
+
+                LOG(debug, "client {} sent message {} on channel {}", id,
+                    log_quoted { message.params.back() }, chan_name);
+
+                auto& nick = conn_info.nick.value();
+                irc::message chat(nick, irc::command::privmsg, { std::string(chan_name), std::string(message.params.back()) });
+                // Chat can be dropped for members that can't keep up.
+                bool congested = chan->send_message(chat, true);
+                metrics.fanout_latency.record(poll_registry::clock::now() - conn->line_framed_at());
+
+                // Slow the sender down to the pace of the members that can't keep up.
+                if (congested && _cfg.sendq_policy == config::overflow_policy::pause)
+                    conn->pause_reading(congestion_pause);
+                return;
+            }
+
+            case irc::command::quit:
+            {
+                std::string quit_msg = *conn_info.nick + " quit";
+                if (message.params.size() >= 1) {
+                    quit_msg = message.params.at(0);
+                }
+
+                LOG(info, "client {} quitting now", id);
+                if (conn_info.joined_channel) {
+                    auto chan = _db.get_channel(*conn_info.joined_channel);
+                    chan->send_message(irc::message(*conn_info.nick, irc::command::privmsg, { quit_msg }));
+                    _db.quit_chan(id, *conn_info.joined_channel);
+                    conn_info.joined_channel = std::nullopt;
+                }
+                // Just mark it as disconnected and close the connection. The actual connection
+                // object will be destroyed in the `run` loop sometime soon.
+                conn->disconnect();
+                return;
+            }
+
+            case irc::command::kick:
+            {
+                if (message.params.size() < 2) {
+                    conn->send_need_more_params(cmd);
+                    return;
+                }
+
+                auto opt_chan_name = get_chan_name(message.params.at(0), conn_info);
+                if (!opt_chan_name) {
+                    conn->send_reply(irc::ERR_NOTONCHANNEL);
+                    return;
+                }
+                std::string_view chan_name = *opt_chan_name;
+
+                auto chan = _db.get_channel(chan_name);
+                if (!chan) {
+                    conn->send_reply(irc::ERR_NOTONCHANNEL);
+                    return;
+                }
+
+                auto member = chan->get_member(id);
+                if (!member) {
+                    conn->send_reply(irc::ERR_NOTONCHANNEL);
+                    return;
+                }
+
+                if (!member->is_operator) {
+                    conn->send_reply(irc::ERR_CHANOPRIVSNEEDED);
+                    return;
+                }
+
+                auto kicked_nick = message.params.at(1);
+                auto kicked = _db.get_conn_info_by_nick(kicked_nick);
+                if (!kicked) {
+                    conn->send_reply(irc::ERR_NOSUCHNICK);
+                    return;
+                }
+
+                bool ok = _db.quit_chan(kicked->id, chan_name);
+                if (!ok) {
+                    conn->send_reply(irc::ERR_NOTONCHANNEL);
+                    return;
+                }
+                kicked->joined_channel = std::nullopt;
+
+                LOG(info, "client {} was kicked", kicked_nick);
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef _IRC_SERVER_H
+#define _IRC_SERVER_H
+
+#include <memory>
+#include <shared_mutex>
+#include <atomic>
+#include <vector>
+#include <optional>
+#include <string_view>
+
+#include "connection.hpp"
+#include "config.hpp"
+#include "db.hpp"
+#include "capture.hpp"
+
+namespace irc {
+    class reactor;
+
+    // The server holds the state shared by every reactor: the database of connections and
+    // channels, and the logic of the protocol. The reactors own the connections themselves and
+    // call back into the server whenever a connection is accepted, receives a message or
+    // disconnects.
+    //
+    // The database is protected by a readers-writer lock, so the server methods can be called
+    // from any reactor thread. The bulk of the traffic (chat, keepalives) only reads it, and is
+    // handled by every reactor at once; the commands that change it (registering, joining,
+    // leaving) are handled one at a time. Messages sent to connections owned by other reactors go
+    // through their mailboxes (see `connection::send_message`).
+    class server {
+    public:
+        server(const irc::config& cfg);
+        server(const server&) = delete;
+        server(server&&) = delete;
+        ~server();
+
+        // Starts every reactor and blocks until the server is interrupted (SIGINT).
+        void run();
+
+        const irc::config& cfg() const;
+
+        // Whether the server was asked to stop.
+        static bool should_quit();
+
+        // A file descriptor that becomes readable once the server is asked to stop, so reactors
+        // blocked waiting for events wake up.
+        static int quit_fd();
+
+        // Allocates an id for a new connection. Ids are unique across all reactors.
+        connection_id_t next_connection_id();
+
+        // Registers a newly accepted connection in the database, with the address of its peer (in
+        // host byte order), as returned when it was accepted.
+        void add_connection(irc::connection *conn, uint32_t ipv4);
+
+        // Removes a disconnected connection from the database, leaving its channel. After this
+        // returns, the connection isn't referenced by the database anymore and can be destroyed.
+        void remove_connection(irc::connection *conn);
+
+        void handle_message(irc::connection *conn, std::string_view s);
+
+        // The recording of the traffic, if `config::capture` is set. Threads that handle messages
+        // flush it once per iteration of their event loop.
+        irc::capture* traffic_capture();
+
+    private:
+        std::optional<std::string_view> get_chan_name(std::string_view param, db::conn_info& conn_info);
+
+        // Whether `password` is the password of the OPER command.
+        bool check_oper_password(std::string_view password) const;
+
+        irc::config _cfg;
+
+        // Whether handling `cmd` only reads the database, so it can share the lock.
+        static bool reads_db_only(irc::command cmd);
+
+        std::shared_mutex _db_mutex;
+        db _db;
+
+        std::atomic<connection_id_t> _curr_id_count = 0;
+        std::unique_ptr<irc::capture> _capture;
+        std::vector<std::unique_ptr<reactor>> _reactors;
+    };
+}
+
+#endif
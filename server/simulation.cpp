@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+
+#include "simulation.hpp"
+#include "utils.hpp"
+
+namespace irc {
+    // What simulated clients receive into.
+    static const constexpr size_t client_recv_size = 64 * 1024;
+
+    simulation::simulation(const config& cfg)
+        : _server(cfg)
+        , _on_message([this](connection *conn, std::string_view s) { _server.handle_message(conn, s); })
+    {
+        auto& registry = poll_registry::instance();
+        registry.set_backend(poll_registry::backend::sim);
+        registry.set_sim_readiness([](int fd) { return memory_network::instance().readiness(fd); });
+    }
+
+    simulation::~simulation() {
+        for (client_id c = 0; c < _clients.size(); c++) close_client(c);
+        // The connections unregister themselves from the registry as they are destroyed.
+        _connections.clear();
+
+        auto& registry = poll_registry::instance();
+        registry.set_sim_readiness(nullptr);
+        registry.set_backend(poll_registry::backend::poll);
+    }
+
+    simulation::client_id simulation::connect(uint32_t ipv4) {
+        auto& network = memory_network::instance();
+        auto [server_fd, client_fd] = network.connect();
+
+        // Connections of a simulation have no mailbox: everything runs on the thread that owns
+        // them.
+        auto ptr = _connection_pool.make(transport::memory(server_fd), _server.next_connection_id(),
+                                         _on_message, _server.cfg());
+        auto conn = ptr.get();
+        _connections.push_back(std::move(ptr));
+        _server.add_connection(conn, ipv4);
+
+        client_id c = _clients.size();
+        auto& cl = _clients.emplace_back();
+        cl.fd = client_fd;
+        cl.recv_tok = poll_registry::instance()
+            .register_event(client_fd, POLLIN, [this, c](short) { this->client_recv(c); });
+        return c;
+    }
+
+    void simulation::send(client_id c, std::string_view data) {
+        auto& cl = _clients.at(c);
+        if (cl.fd < 0) return;
+        cl.outbox += data;
+        if (!cl.send_tok) {
+            cl.send_tok = poll_registry::instance()
+                .register_event(cl.fd, POLLOUT, [this, c](short) { this->client_send(c); });
+        }
+    }
+
+    std::string simulation::take_received(client_id c) {
+        std::string received;
+        received.swap(_clients.at(c).inbox);
+        return received;
+    }
+
+    void simulation::set_receiver(receiver_type receiver) { _receiver = std::move(receiver); }
+
+    void simulation::set_reading(client_id c, bool reading) {
+        auto& cl = _clients.at(c);
+        cl.reading = reading;
+        // Notifications were ignored while not reading, so catch up with what is waiting.
+        if (reading) client_recv(c);
+    }
+
+    void simulation::disconnect(client_id c) { close_client(c); }
+
+    bool simulation::is_connected(client_id c) const { return _clients.at(c).fd >= 0; }
+
+    size_t simulation::clients() const { return _clients.size(); }
+
+    void simulation::client_recv(client_id c) {
+        // Per thread, like the network and the registry, since each thread can run a simulation.
+        static thread_local std::array<uint8_t, client_recv_size> buf;
+        auto& network = memory_network::instance();
+        while (_clients[c].reading && _clients[c].fd >= 0) {
+            ssize_t n = network.recv(_clients[c].fd, buf.data(), buf.size());
+            if (n == 0) {
+                // The server closed the connection.
+                close_client(c);
+                return;
+            }
+            if (n < 0) {
+                if (errno == EAGAIN) return;
+                THROW_ERRNO("simulated client " << c << " failed to recv");
+            }
+
+            std::string_view data((const char*)buf.data(), n);
+            if (_receiver) _receiver(c, data);
+            else _clients[c].inbox += data;
+        }
+    }
+
+    void simulation::client_send(client_id c) {
+        auto& cl = _clients[c];
+        auto& network = memory_network::instance();
+        size_t sent = 0;
+        while (sent < cl.outbox.size()) {
+            ssize_t n = network.send(cl.fd, (const uint8_t*)cl.outbox.data() + sent,
+                                     cl.outbox.size() - sent);
+            if (n < 0) {
+                if (errno == EAGAIN) break;
+                // The server closed the connection, so the rest will never be sent.
+                sent = cl.outbox.size();
+                break;
+            }
+            sent += n;
+        }
+        cl.outbox.erase(0, sent);
+
+        if (cl.outbox.empty() && cl.send_tok) {
+            poll_registry::instance().unregister_event(*cl.send_tok);
+            cl.send_tok = std::nullopt;
+        }
+    }
+
+    void simulation::close_client(client_id c) {
+        auto& cl = _clients[c];
+        if (cl.fd < 0) return;
+        auto& registry = poll_registry::instance();
+        if (cl.recv_tok) registry.unregister_event(*cl.recv_tok);
+        if (cl.send_tok) registry.unregister_event(*cl.send_tok);
+        cl.recv_tok = cl.send_tok = std::nullopt;
+        cl.outbox.clear();
+        memory_network::instance().close(cl.fd);
+        cl.fd = -1;
+    }
+
+    size_t simulation::run() {
+        size_t iterations = 0;
+        do {
+            step();
+            iterations++;
+        } while (poll_registry::instance().has_pending_work());
+        return iterations;
+    }
+
+    void simulation::advance(clock::duration d) {
+        auto& registry = poll_registry::instance();
+        auto until = registry.now() + d;
+        run();
+
+        // Stop at every timer due on the way, so each one sees the time it was due at.
+        while (true) {
+            auto deadline = registry.next_deadline();
+            if (!deadline || *deadline > until) break;
+            registry.advance(*deadline - registry.now());
+            run();
+        }
+        registry.advance(until - registry.now());
+        run();
+    }
+
+    simulation::clock::time_point simulation::now() const { return poll_registry::instance().now(); }
+
+    irc::server& simulation::server() { return _server; }
+
+    void simulation::step() {
+        if (poll_registry::instance().poll_and_dispatch() < 0) THROW_ERRNO("simulation step failed");
+        reap_connections();
+        if (auto capture = _server.traffic_capture()) capture->flush();
+    }
+
+    void simulation::reap_connections() {
+        // Like a reactor, but without completions there is never anything in flight, so a
+        // disconnected connection can be destroyed right away.
+        for (size_t i = 0; i < _connections.size();) {
+            if (_connections[i]->is_connected()) {
+                i++;
+                continue;
+            }
+            _server.remove_connection(_connections[i].get());
+            std::swap(_connections[i], _connections.back());
+            _connections.pop_back();
+        }
+    }
+}
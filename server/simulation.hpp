@@ -0,0 +1,111 @@
+#ifndef _SIMULATION_H
+#define _SIMULATION_H
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "server.hpp"
+#include "connection.hpp"
+#include "poll_registry.hpp"
+#include "transport.hpp"
+#include "slab.hpp"
+
+namespace irc {
+
+    // Runs the whole server on the calling thread, without sockets and without real time. Clients
+    // are connected through the `memory_network` of the thread, and the event loop is the `sim`
+    // backend of its registry, whose clock only moves with `advance`. The connections and the
+    // protocol are the same as with a reactor, but nothing waits on the kernel, and the same calls
+    // in the same order always produce the same bytes at the same virtual times. That makes it a
+    // benchmark of the protocol core without system calls, and a way to replay a scenario exactly.
+    //
+    // Simulated clients are driven by the same event loop: what they send goes out as fast as the
+    // server reads it, and what they receive is taken as soon as it arrives, unless they stop
+    // reading (see `set_reading`).
+    //
+    // The registry of the thread is switched to the `sim` backend, so a simulation can't share its
+    // thread with a reactor, and there can only be one at a time per thread.
+    class simulation {
+    public:
+        using clock = poll_registry::clock;
+        using client_id = size_t;
+
+        // Called with what a client receives instead of keeping it (see `set_receiver`).
+        using receiver_type = std::function<void(client_id, std::string_view)>;
+
+        simulation(const config& cfg);
+        simulation(const simulation&) = delete;
+        simulation(simulation&&) = delete;
+        ~simulation();
+
+        // Connects a new client from `ipv4` (in host byte order). Clients are numbered from zero,
+        // in the order they connect.
+        client_id connect(uint32_t ipv4 = 0x7f000001);
+
+        // Sends `data` as the client. Nothing happens until the event loop runs.
+        void send(client_id c, std::string_view data);
+
+        // Takes what the client received so far.
+        std::string take_received(client_id c);
+
+        // Hands what clients receive to `receiver` as it arrives, instead of keeping it for
+        // `take_received`.
+        void set_receiver(receiver_type receiver);
+
+        // Stops or resumes reading as the client, like a client that doesn't keep up.
+        void set_reading(client_id c, bool reading);
+
+        // Closes the connection of the client.
+        void disconnect(client_id c);
+
+        // Whether the server didn't close the connection of the client, as far as the client knows
+        // (it might still have to read up to the end of the stream).
+        bool is_connected(client_id c) const;
+
+        // The number of clients connected so far, including the ones that disconnected since.
+        size_t clients() const;
+
+        // Runs iterations of the event loop until nothing is left to do without time passing.
+        // Returns the number of iterations.
+        size_t run();
+
+        // Moves the virtual clock forward by `d`, running everything on the way: each timer runs
+        // at the time it is due, and the loop runs until idle after each of them.
+        void advance(clock::duration d);
+
+        clock::time_point now() const;
+
+        irc::server& server();
+
+    private:
+        struct client {
+            // The end of the client, or -1 once closed.
+            int fd = -1;
+            bool reading = true;
+            // What wasn't sent to the server yet, and what was received and not taken yet.
+            std::string outbox;
+            std::string inbox;
+            std::optional<poll_registry::token_type> recv_tok;
+            std::optional<poll_registry::token_type> send_tok;
+        };
+
+        void step();
+        void client_recv(client_id c);
+        void client_send(client_id c);
+        void close_client(client_id c);
+        void reap_connections();
+
+        irc::server _server;
+        connection::message_handler_type _on_message;
+        receiver_type _receiver;
+
+        object_pool<irc::connection> _connection_pool;
+        std::vector<object_pool<irc::connection>::pointer> _connections;
+
+        std::vector<client> _clients;
+    };
+}
+
+#endif
@@ -0,0 +1,69 @@
+#include <algorithm>
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#else
+#define ASAN_POISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#define ASAN_UNPOISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#endif
+
+#include "slab.hpp"
+#include "metrics.hpp"
+
+// Free blocks are poisoned when built with AddressSanitizer, so using an object after giving it
+// back to its pool is still reported.
+namespace irc {
+    static size_t round_up(size_t n, size_t to) { return (n + to - 1) / to * to; }
+
+    slab_allocator::slab_allocator(size_t block_size, size_t blocks_per_slab)
+        : _block_size(round_up(std::max(block_size, sizeof(free_block)), alignof(std::max_align_t)))
+        , _blocks_per_slab(std::max(blocks_per_slab, (size_t)1))
+    { }
+
+    void slab_allocator::add_slab() {
+        auto& slab = _slabs.emplace_back(new std::byte[_block_size * _blocks_per_slab]);
+        thread_metrics::local().slab_allocations.add();
+
+        // Chain the blocks in address order, so consecutive allocations are next to each other.
+        for (size_t i = _blocks_per_slab; i-- > 0;) {
+            auto block = reinterpret_cast<free_block*>(slab.get() + i * _block_size);
+            block->next = _free;
+            _free = block;
+            ASAN_POISON_MEMORY_REGION(block, _block_size);
+        }
+    }
+
+    void* slab_allocator::allocate() {
+        if (!_free) add_slab();
+        free_block *block = _free;
+        ASAN_UNPOISON_MEMORY_REGION(block, _block_size);
+        _free = block->next;
+
+        _allocations++;
+        thread_metrics::local().pool_allocations.add();
+        _in_use++;
+        _peak_in_use = std::max(_peak_in_use, _in_use);
+        return block;
+    }
+
+    void slab_allocator::deallocate(void *ptr) {
+        auto block = static_cast<free_block*>(ptr);
+        block->next = _free;
+        _free = block;
+        ASAN_POISON_MEMORY_REGION(block, _block_size);
+        _in_use--;
+    }
+
+    size_t slab_allocator::block_size() const { return _block_size; }
+
+    slab_allocator::stats slab_allocator::get_stats() const {
+        stats s;
+        s.block_size = _block_size;
+        s.slabs = _slabs.size();
+        s.in_use = _in_use;
+        s.idle = _slabs.size() * _blocks_per_slab - _in_use;
+        s.peak_in_use = _peak_in_use;
+        s.allocations = _allocations;
+        return s;
+    }
+}
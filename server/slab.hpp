@@ -0,0 +1,98 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace irc {
+
+    // Hands out blocks of a fixed size, carved out of larger slabs. Freed blocks go to a free list
+    // and are reused by the next allocations, so objects that come and go (like the connections of
+    // a reconnect storm) keep reusing the same memory instead of fragmenting the heap. Slabs are
+    // only given back when the allocator is destroyed, so the memory held is the peak in use.
+    //
+    // Not thread safe. Each reactor has its own allocators.
+    class slab_allocator {
+    public:
+        struct stats {
+            size_t block_size = 0;
+            size_t slabs = 0;
+            // Blocks allocated right now, and free blocks in the slabs.
+            size_t in_use = 0;
+            size_t idle = 0;
+            size_t peak_in_use = 0;
+            // Total allocations since the allocator was created.
+            uint64_t allocations = 0;
+        };
+
+        // Blocks are aligned to `alignof(std::max_align_t)`.
+        slab_allocator(size_t block_size, size_t blocks_per_slab);
+        slab_allocator(const slab_allocator&) = delete;
+        slab_allocator(slab_allocator&&) = default;
+
+        void* allocate();
+        void deallocate(void *block);
+
+        size_t block_size() const;
+        stats get_stats() const;
+
+    private:
+        struct free_block {
+            free_block *next;
+        };
+
+        void add_slab();
+
+        size_t _block_size;
+        size_t _blocks_per_slab;
+        std::vector<std::unique_ptr<std::byte[]>> _slabs;
+        free_block *_free = nullptr;
+
+        size_t _in_use = 0;
+        size_t _peak_in_use = 0;
+        uint64_t _allocations = 0;
+    };
+
+    // Allocates objects of type `T` from a `slab_allocator`. The pointers it makes give the
+    // objects back to the pool when destroyed, so the pool must outlive them.
+    template<typename T>
+    class object_pool {
+    public:
+        struct deleter {
+            object_pool *pool;
+
+            void operator()(T *object) const {
+                object->~T();
+                pool->_slab.deallocate(object);
+            }
+        };
+
+        using pointer = std::unique_ptr<T, deleter>;
+
+        static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types aren't supported");
+
+        object_pool(size_t objects_per_slab = 64) : _slab(sizeof(T), objects_per_slab) { }
+
+        template<typename... Args>
+        pointer make(Args&&... args) {
+            void *block = _slab.allocate();
+            try {
+                return pointer(new (block) T(std::forward<Args>(args)...), deleter { this });
+            } catch (...) {
+                _slab.deallocate(block);
+                throw;
+            }
+        }
+
+        slab_allocator::stats get_stats() const { return _slab.get_stats(); }
+
+    private:
+        slab_allocator _slab;
+    };
+}
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef _SLOT_MAP_H
+#define _SLOT_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace irc {
+
+    // A reference to a value of a `slot_map`. The generation tells apart the values that used the
+    // same slot over time, so a handle kept after its value was erased doesn't resolve to
+    // whatever value took the slot afterwards. `Tag` keeps handles of different maps apart.
+    template<typename Tag>
+    struct slot_handle {
+        uint32_t slot;
+        uint32_t generation;
+
+        bool operator==(const slot_handle& other) const {
+            return slot == other.slot && generation == other.generation;
+        }
+        bool operator!=(const slot_handle& other) const { return !(*this == other); }
+    };
+
+    // A container of values referenced by generation-checked handles. Looking a handle up is an
+    // index into the slots and a comparison, and the values are kept back to back, so iterating
+    // over them is a linear walk over contiguous memory. Like in `flat_map`, values move: erasing
+    // one moves the last value into its place, and inserting may reallocate all of them, but the
+    // handles stay valid until their value is erased.
+    template<typename T, typename Tag = T>
+    class slot_map {
+    public:
+        using handle = slot_handle<Tag>;
+        using iterator = typename std::vector<T>::iterator;
+        using const_iterator = typename std::vector<T>::const_iterator;
+
+        iterator begin() { return _values.begin(); }
+        iterator end() { return _values.end(); }
+        const_iterator begin() const { return _values.begin(); }
+        const_iterator end() const { return _values.end(); }
+
+        size_t size() const { return _values.size(); }
+        bool empty() const { return _values.empty(); }
+
+        // The handle that the next call to `insert` will return.
+        handle next_handle() const {
+            if (_free_head != no_slot) return { _free_head, _slots[_free_head].generation };
+            return { static_cast<uint32_t>(_slots.size()), 0 };
+        }
+
+        template<typename... Args>
+        handle insert(Args&&... args) {
+            uint32_t slot = _free_head;
+            if (slot == no_slot) {
+                slot = static_cast<uint32_t>(_slots.size());
+                _slots.push_back({ 0, 0 });
+            } else {
+                _free_head = _slots[slot].index;
+            }
+            _slots[slot].index = static_cast<uint32_t>(_values.size());
+            _values.emplace_back(std::forward<Args>(args)...);
+            _value_slots.push_back(slot);
+            return { slot, _slots[slot].generation };
+        }
+
+        // Returns `nullptr` if the value of the handle was erased.
+        T* get(handle h) {
+            if (h.slot >= _slots.size() || _slots[h.slot].generation != h.generation) return nullptr;
+            return &_values[_slots[h.slot].index];
+        }
+
+        const T* get(handle h) const {
+            return const_cast<slot_map*>(this)->get(h);
+        }
+
+        // The handle of the value at `it`.
+        handle handle_of(const_iterator it) const {
+            uint32_t slot = _value_slots[it - begin()];
+            return { slot, _slots[slot].generation };
+        }
+
+        // Returns `false` if the value of the handle was already erased.
+        bool erase(handle h) {
+            if (!get(h)) return false;
+            erase(begin() + _slots[h.slot].index);
+            return true;
+        }
+
+        // Returns an iterator to the value that took the place of the erased one, which is `end()`
+        // if the erased value was the last.
+        iterator erase(const_iterator it) {
+            size_t index = it - begin();
+            uint32_t slot = _value_slots[index];
+
+            if (index != _values.size() - 1) {
+                _values[index] = std::move(_values.back());
+                _value_slots[index] = _value_slots.back();
+                _slots[_value_slots[index]].index = static_cast<uint32_t>(index);
+            }
+            _values.pop_back();
+            _value_slots.pop_back();
+
+            // Any handle still around for the slot is now stale.
+            _slots[slot].generation++;
+            _slots[slot].index = _free_head;
+            _free_head = slot;
+            return begin() + index;
+        }
+
+        void clear() {
+            // Erase one by one, so the generations of the slots move on.
+            while (!_values.empty()) erase(end() - 1);
+        }
+
+    private:
+        static const constexpr uint32_t no_slot = static_cast<uint32_t>(-1);
+
+        struct slot {
+            // The index of the value in `_values`, or the next free slot if the slot is free.
+            uint32_t index;
+            uint32_t generation;
+        };
+
+        std::vector<T> _values;
+        // The slot of each value, to find the slot of the value moved by an erase.
+        std::vector<uint32_t> _value_slots;
+        std::vector<slot> _slots;
+        uint32_t _free_head = no_slot;
+    };
+}
+
+#endif
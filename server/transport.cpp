@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+
+#include "transport.hpp"
+#include "poll_registry.hpp"
+
+namespace irc {
+    // Received bytes are only moved out of the front of an inbox once this many piled up, so
+    // receiving in small chunks doesn't move the rest every time.
+    static const constexpr size_t compact_threshold = 64 * 1024;
+
+    memory_network& memory_network::instance() {
+        static thread_local memory_network network;
+        return network;
+    }
+
+    std::pair<int, int> memory_network::connect(size_t capacity) {
+        int fds[2];
+        for (auto& fd : fds) {
+            if (_free.empty()) {
+                fd = _ends.size();
+                _ends.emplace_back();
+            } else {
+                fd = _free.back();
+                _free.pop_back();
+            }
+            _ends[fd] = end();
+            _ends[fd].open = true;
+            _ends[fd].capacity = capacity;
+        }
+        _ends[fds[0]].peer = fds[1];
+        _ends[fds[1]].peer = fds[0];
+        _open += 2;
+        return { fds[0], fds[1] };
+    }
+
+    memory_network::end* memory_network::lookup(int fd) {
+        if (fd < 0 || (size_t)fd >= _ends.size() || !_ends[fd].open) return nullptr;
+        return &_ends[fd];
+    }
+
+    const memory_network::end* memory_network::lookup(int fd) const {
+        if (fd < 0 || (size_t)fd >= _ends.size() || !_ends[fd].open) return nullptr;
+        return &_ends[fd];
+    }
+
+    bool memory_network::at_eof(const end& e) const {
+        return e.shut || e.peer < 0 || _ends[e.peer].shut;
+    }
+
+    void memory_network::notify(int fd) { poll_registry::instance().sim_notify(fd); }
+
+    ssize_t memory_network::recv(int fd, uint8_t *buf, size_t len) {
+        auto e = lookup(fd);
+        if (!e) {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (e->pending() == 0) {
+            if (at_eof(*e)) return 0;
+            errno = EAGAIN;
+            return -1;
+        }
+
+        size_t n = std::min(len, e->pending());
+        memcpy(buf, e->inbox.data() + e->head, n);
+        e->head += n;
+        if (e->head == e->inbox.size()) {
+            e->inbox.clear();
+            e->head = 0;
+        } else if (e->head >= compact_threshold) {
+            e->inbox.erase(e->inbox.begin(), e->inbox.begin() + e->head);
+            e->head = 0;
+        }
+
+        // There is room for the peer to send again.
+        if (e->peer >= 0) notify(e->peer);
+        return n;
+    }
+
+    ssize_t memory_network::send(int fd, const uint8_t *buf, size_t len) {
+        struct iovec iov = { const_cast<uint8_t*>(buf), len };
+        return sendmsg(fd, &iov, 1);
+    }
+
+    ssize_t memory_network::sendmsg(int fd, const struct iovec *iov, size_t iovcnt) {
+        auto e = lookup(fd);
+        if (!e) {
+            errno = EBADF;
+            return -1;
+        }
+        if (at_eof(*e)) {
+            errno = EPIPE;
+            return -1;
+        }
+
+        auto& peer = _ends[e->peer];
+        size_t space = peer.capacity - peer.pending();
+        if (space == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        size_t sent = 0;
+        for (size_t i = 0; i < iovcnt && sent < space; i++) {
+            size_t n = std::min(iov[i].iov_len, space - sent);
+            auto data = static_cast<const uint8_t*>(iov[i].iov_base);
+            peer.inbox.insert(peer.inbox.end(), data, data + n);
+            sent += n;
+        }
+
+        if (sent > 0) notify(e->peer);
+        return sent;
+    }
+
+    void memory_network::shutdown(int fd) {
+        auto e = lookup(fd);
+        if (!e || e->shut) return;
+        e->shut = true;
+        notify(fd);
+        if (e->peer >= 0) notify(e->peer);
+    }
+
+    void memory_network::close(int fd) {
+        auto e = lookup(fd);
+        if (!e) return;
+        shutdown(fd);
+        if (e->peer >= 0) _ends[e->peer].peer = -1;
+
+        // Nothing refers to the end anymore, so its file descriptor can be reused right away.
+        *e = end();
+        _free.push_back(fd);
+        _open--;
+    }
+
+    short memory_network::readiness(int fd) const {
+        auto e = lookup(fd);
+        if (!e) return POLLNVAL;
+
+        // Like a socket whose peer is gone, an end at the end of the stream is also writable, so
+        // a writer waiting to send finds out that it can't.
+        if (at_eof(*e)) return POLLIN | POLLOUT | POLLHUP;
+
+        short events = 0;
+        if (e->pending() > 0) events |= POLLIN;
+        auto& peer = _ends[e->peer];
+        if (peer.pending() < peer.capacity) events |= POLLOUT;
+        return events;
+    }
+
+    size_t memory_network::open_ends() const { return _open; }
+
+    transport::transport(tcpstream stream) : _stream(std::move(stream)) { }
+
+    transport::transport(transport&& rhs)
+        : _stream(std::move(rhs._stream))
+        , _memory_fd(rhs._memory_fd)
+    {
+        rhs._memory_fd = -1;
+    }
+
+    transport::~transport() { close(); }
+
+    transport transport::memory(int fd) {
+        transport t{tcpstream()};
+        t._memory_fd = fd;
+        return t;
+    }
+
+    ssize_t transport::nonblocking_recv(uint8_t *buf, size_t len) {
+        if (_memory_fd >= 0) return memory_network::instance().recv(_memory_fd, buf, len);
+        return _stream.nonblocking_recv(buf, len);
+    }
+
+    ssize_t transport::nonblocking_sendmsg(const struct iovec *iov, size_t iovcnt) {
+        if (_memory_fd >= 0) return memory_network::instance().sendmsg(_memory_fd, iov, iovcnt);
+        return _stream.nonblocking_sendmsg(iov, iovcnt);
+    }
+
+    int transport::fd() const { return _memory_fd >= 0 ? _memory_fd : _stream.fd(); }
+
+    void transport::close() {
+        if (_memory_fd >= 0) memory_network::instance().close(_memory_fd);
+        _memory_fd = -1;
+        _stream.close();
+    }
+
+    void transport::shutdown() {
+        if (_memory_fd >= 0) memory_network::instance().shutdown(_memory_fd);
+        else _stream.shutdown();
+    }
+
+    bool transport::is_memory() const { return _memory_fd >= 0; }
+}
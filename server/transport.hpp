@@ -0,0 +1,108 @@
+#ifndef _TRANSPORT_H
+#define _TRANSPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "tcpstream.hpp"
+
+namespace irc {
+
+    // In-memory connections, for running the server without sockets (see `simulation`). Each
+    // connection has two ends, each with a virtual file descriptor, and each end has a buffer of
+    // at most `capacity` bytes for what the other end sent, so a reader that falls behind blocks
+    // the writer like a full socket would. Whenever the state of an end changes, the `sim` backend
+    // of the registry of the calling thread is notified (see `poll_registry::sim_notify`).
+    //
+    // Operations behave like their nonblocking system calls, including `errno`: `EAGAIN` when they
+    // would block, `EPIPE` when sending to a closed peer and `EBADF` for unknown ends. Virtual file
+    // descriptors are unrelated to real ones, and are reused once closed.
+    //
+    // Not thread safe. Every thread has its own network, like its own registry.
+    class memory_network {
+    public:
+        static const constexpr size_t default_capacity = 256 * 1024;
+
+        // The network of the calling thread.
+        static memory_network& instance();
+
+        // Opens a connection, returning the file descriptors of its two ends.
+        std::pair<int, int> connect(size_t capacity = default_capacity);
+
+        ssize_t recv(int fd, uint8_t *buf, size_t len);
+        ssize_t send(int fd, const uint8_t *buf, size_t len);
+        ssize_t sendmsg(int fd, const struct iovec *iov, size_t iovcnt);
+
+        // Shuts down both directions of an end: the peer receives what was already sent and then
+        // the end of the stream, and sending fails on both ends.
+        void shutdown(int fd);
+        void close(int fd);
+
+        // The events (as in `poll`) an end is ready for.
+        short readiness(int fd) const;
+
+        // The ends that are still open.
+        size_t open_ends() const;
+
+    private:
+        struct end {
+            bool open = false;
+            // Whether this end was shut down.
+            bool shut = false;
+            // The other end, or -1 once it was closed.
+            int peer = -1;
+            size_t capacity = 0;
+            // The bytes sent to this end, from `head` on.
+            std::vector<uint8_t> inbox;
+            size_t head = 0;
+
+            size_t pending() const { return inbox.size() - head; }
+        };
+
+        end* lookup(int fd);
+        const end* lookup(int fd) const;
+
+        // Whether `e` will never receive anything else than what is in its inbox already.
+        bool at_eof(const end& e) const;
+        void notify(int fd);
+
+        std::vector<end> _ends;
+        std::vector<int> _free;
+        size_t _open = 0;
+    };
+
+    // The byte stream of a connection: a TCP socket, or an end of an in-memory connection of the
+    // `memory_network` of the thread. It only branches on which one it is, so connections don't
+    // need to know, and pay no virtual calls for it.
+    class transport {
+    public:
+        transport(tcpstream stream);
+        transport(transport&& rhs);
+        transport(const transport&) = delete;
+        ~transport();
+
+        // Takes over an end of an in-memory connection.
+        static transport memory(int fd);
+
+        ssize_t nonblocking_recv(uint8_t *buf, size_t len);
+        ssize_t nonblocking_sendmsg(const struct iovec *iov, size_t iovcnt);
+
+        // The file descriptor, virtual for in-memory connections, or -1 once closed.
+        int fd() const;
+        void close();
+        void shutdown();
+
+        bool is_memory() const;
+
+    private:
+        tcpstream _stream;
+        int _memory_fd = -1;
+    };
+}
+
+#endif
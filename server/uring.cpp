@@ -0,0 +1,187 @@
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#include "uring.hpp"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                          void *arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Multishot receives (the newest feature we rely on) were added in Linux 6.0, and there is no way
+// to probe for operation flags, so check the kernel version instead.
+static bool kernel_supports_multishot_recv() {
+    struct utsname u;
+    if (uname(&u) < 0) return false;
+    int major = 0;
+    if (sscanf(u.release, "%d.", &major) != 1) return false;
+    return major >= 6;
+}
+
+std::unique_ptr<uring> uring::create(unsigned entries, unsigned n_buffers, unsigned buffer_size) {
+    if (!kernel_supports_multishot_recv()) return nullptr;
+    std::unique_ptr<uring> ring(new uring());
+    if (!ring->setup(entries)) return nullptr;
+    if (!ring->setup_buffers(n_buffers, buffer_size)) return nullptr;
+    return ring;
+}
+
+bool uring::setup(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // Completions come in bursts (every multishot operation can post many of them), so make the
+    // completion queue larger than the submission queue.
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * 4;
+    _fd = io_uring_setup(entries, &p);
+    if (_fd < 0) return false;
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)
+     || !(p.features & IORING_FEAT_EXT_ARG))
+        return false;
+
+    // Check that every operation we use is supported.
+    const uint8_t needed_ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD,
+        IORING_OP_ASYNC_CANCEL,
+    };
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    std::vector<uint8_t> probe_buf(probe_size, 0);
+    auto probe = reinterpret_cast<struct io_uring_probe*>(probe_buf.data());
+    if (io_uring_register(_fd, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+    for (auto op : needed_ops) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+    }
+
+    _sq_ptr_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cq_ptr_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    _sq_ptr_size = std::max(_sq_ptr_size, _cq_ptr_size);
+    _sq_ptr = mmap(nullptr, _sq_ptr_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd,
+                   IORING_OFF_SQ_RING);
+    if (_sq_ptr == MAP_FAILED) {
+        _sq_ptr = nullptr;
+        return false;
+    }
+    // Single mmap: the completion ring lives in the same mapping.
+    _cq_ptr = _sq_ptr;
+
+    _sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd,
+                      IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+    _sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+    auto sq = static_cast<uint8_t*>(_sq_ptr);
+    _sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    _sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    _sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    _sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    _sq_entries = p.sq_entries;
+
+    auto cq = static_cast<uint8_t*>(_cq_ptr);
+    _cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    _cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    _cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    _cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+    return true;
+}
+
+bool uring::setup_buffers(unsigned n_buffers, unsigned buffer_size) {
+    // The number of buffers in the ring must be a power of two.
+    unsigned entries = 1;
+    while (entries < n_buffers) entries <<= 1;
+
+    _buf_ring_size = entries * sizeof(struct io_uring_buf);
+    void *ptr = mmap(nullptr, _buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+    if (ptr == MAP_FAILED) return false;
+    _buf_ring = static_cast<struct io_uring_buf_ring*>(ptr);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(_buf_ring);
+    reg.ring_entries = entries;
+    reg.bgid = buffer_group;
+    if (io_uring_register(_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+
+    _buf_mask = entries - 1;
+    _buf_size = buffer_size;
+    _buf_data.resize((size_t)entries * buffer_size);
+    _buf_ring->tail = 0;
+    for (unsigned bid = 0; bid < entries; bid++) recycle_buffer(bid);
+    return true;
+}
+
+uring::~uring() {
+    if (_buf_ring) munmap(_buf_ring, _buf_ring_size);
+    if (_sqes) munmap(_sqes, _sqes_size);
+    if (_sq_ptr) munmap(_sq_ptr, _sq_ptr_size);
+    if (_fd >= 0) close(_fd);
+}
+
+struct io_uring_sqe* uring::get_sqe() {
+    unsigned head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *_sq_tail + _sq_pending;
+    if (tail - head >= _sq_entries) {
+        // Full: hand the pending entries to the kernel without waiting for anything.
+        submit_and_wait(0);
+        head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+        tail = *_sq_tail + _sq_pending;
+    }
+
+    unsigned idx = tail & _sq_mask;
+    auto sqe = &_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    _sq_array[idx] = idx;
+    _sq_pending++;
+    return sqe;
+}
+
+int uring::submit_and_wait(unsigned wait_nr, const struct timespec *timeout) {
+    unsigned to_submit = _sq_pending;
+    if (to_submit > 0) {
+        __atomic_store_n(_sq_tail, *_sq_tail + to_submit, __ATOMIC_RELEASE);
+        _sq_pending = 0;
+    }
+
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    struct __kernel_timespec ts;
+    if (timeout) {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_nsec;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+    }
+    return io_uring_enter(_fd, to_submit, wait_nr, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+uint8_t* uring::buffer(uint16_t bid) { return _buf_data.data() + (size_t)bid * _buf_size; }
+unsigned uring::buffer_size() const { return _buf_size; }
+
+void uring::recycle_buffer(uint16_t bid) {
+    unsigned short tail = _buf_ring->tail;
+    // Don't use `_buf_ring->bufs`: the flexible array macro of the kernel header gives it the
+    // wrong offset when compiled as C++. The entries start at the beginning of the ring (the tail
+    // overlays a reserved field of the first one).
+    auto& buf = reinterpret_cast<struct io_uring_buf*>(_buf_ring)[tail & _buf_mask];
+    buf.addr = reinterpret_cast<uint64_t>(buffer(bid));
+    buf.len = _buf_size;
+    buf.bid = bid;
+    __atomic_store_n(&_buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
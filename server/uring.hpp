@@ -0,0 +1,97 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+
+#include <linux/io_uring.h>
+
+// A thin wrapper around an io_uring instance, using the raw system calls. It owns the submission
+// and completion rings and a single ring of provided buffers which the kernel picks from when
+// completing multishot receives.
+//
+// The class is not thread safe: it is meant to be driven by a single event loop.
+class uring {
+public:
+    // The buffer group id used for every buffer-selecting operation.
+    static const constexpr uint16_t buffer_group = 0;
+
+    // Tries to create a ring with room for `entries` submissions and register `n_buffers` provided
+    // buffers of `buffer_size` bytes each. Returns `nullptr` if the kernel doesn't support
+    // io_uring or any of the features needed (multishot accept and recv, provided buffer rings),
+    // so the caller can fall back to another mechanism.
+    static std::unique_ptr<uring> create(unsigned entries, unsigned n_buffers, unsigned buffer_size);
+
+    uring(const uring&) = delete;
+    uring(uring&&) = delete;
+    ~uring();
+
+    // Gets a free submission queue entry, already zeroed. If the submission queue is full, the
+    // pending entries are submitted first.
+    struct io_uring_sqe* get_sqe();
+
+    // Submits the pending entries and waits until at least `wait_nr` completions are available
+    // or `timeout` expires (if not `nullptr`). Returns a negative value with `errno` set on
+    // failure.
+    int submit_and_wait(unsigned wait_nr, const struct timespec *timeout = nullptr);
+
+    // Calls `f` for every available completion, then marks them as consumed. Returns the number
+    // of completions seen.
+    template<typename F>
+    unsigned for_each_cqe(F&& f) {
+        unsigned head = *_cq_head;
+        unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        unsigned n = 0;
+        for (; head != tail; head++, n++) f(_cqes[head & _cq_mask]);
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+        return n;
+    }
+
+    // The data of the provided buffer with id `bid`.
+    uint8_t* buffer(uint16_t bid);
+    unsigned buffer_size() const;
+
+    // Gives a provided buffer back to the kernel, once its data has been consumed.
+    void recycle_buffer(uint16_t bid);
+
+private:
+    uring() = default;
+
+    bool setup(unsigned entries);
+    bool setup_buffers(unsigned n_buffers, unsigned buffer_size);
+
+    int _fd = -1;
+
+    // Submission ring.
+    void *_sq_ptr = nullptr;
+    size_t _sq_ptr_size = 0;
+    unsigned *_sq_head;
+    unsigned *_sq_tail;
+    unsigned *_sq_array;
+    unsigned _sq_mask;
+    unsigned _sq_entries;
+    struct io_uring_sqe *_sqes = nullptr;
+    size_t _sqes_size = 0;
+    // Entries filled but not yet handed to the kernel.
+    unsigned _sq_pending = 0;
+
+    // Completion ring. With `IORING_FEAT_SINGLE_MMAP` it shares the mapping with the
+    // submission ring.
+    void *_cq_ptr = nullptr;
+    size_t _cq_ptr_size = 0;
+    unsigned *_cq_head;
+    unsigned *_cq_tail;
+    unsigned _cq_mask;
+    struct io_uring_cqe *_cqes;
+
+    // Provided buffers.
+    struct io_uring_buf_ring *_buf_ring = nullptr;
+    size_t _buf_ring_size = 0;
+    unsigned _buf_mask = 0;
+    unsigned _buf_size = 0;
+    std::vector<uint8_t> _buf_data;
+};
+
+#endif
@@ -1,23 +1,35 @@
 #include <cstring>
+#include <cerrno>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "tcpstream.hpp"
 #include "tcplistener.hpp"
 #include "utils.hpp"
 
+// Turns Nagle's algorithm off on an accepted socket. Connections gather their queued messages into
+// a single send already, so holding back the last partial segment until the client ACKs the
+// previous one only delays replies by as much as the delayed ACK timer (about 40 ms). A socket
+// that can't take it still works, so errors are ignored.
+static void set_nodelay(int fd) {
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+}
 
-tcplistener::tcplistener(uint16_t port)
+tcplistener::tcplistener(uint16_t port, int backlog)
     : _port(port)
+    , _backlog(backlog)
     , _init(false)
 {
 }
 
 tcplistener::tcplistener(tcplistener&& rhs)
     : _port(rhs._port)
+    , _backlog(rhs._backlog)
     , _init(rhs._init)
-    , _fd(rhs._init)
+    , _fd(rhs._fd)
     , _address(rhs._address)
 {
     rhs._init = false;
@@ -31,32 +43,73 @@ tcplistener::~tcplistener() {
 }
 
 void tcplistener::start() {
-    _fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (_fd == 0) THROW_ERRNO("socket failed");
+    _fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_fd < 0) THROW_ERRNO("socket failed");
 
     _address.sin_family = AF_INET;
     _address.sin_addr.s_addr = INADDR_ANY;
     _address.sin_port = htons(_port);
 
+    // `SO_REUSEPORT` lets several listeners (one per reactor thread) bind to the same port, with
+    // the kernel balancing new connections between them.
     int opt = 1;
-    if (setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)))
+    if (setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
+        THROW_ERRNO("setsockopt failed");
+    if (setsockopt(_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))
         THROW_ERRNO("setsockopt failed");
 
     if (bind(_fd, (struct sockaddr*)&_address, sizeof(_address)) < 0)
         THROW_ERRNO("bind failed");
 
-    if (listen(_fd, 3) < 0)
+    if (listen(_fd, _backlog) < 0)
         THROW_ERRNO("listen failed");
 
     _init = true;
 }
 
-tcpstream tcplistener::accept() {
+std::optional<accepted_stream> tcplistener::accept() {
     assert_init();
-    size_t addrlen = sizeof(_address);
-    int fd = ::accept(_fd, (struct sockaddr*)&_address, (socklen_t*)&addrlen);
-    if (fd < 0) THROW_ERRNO("accept failed");
-    return tcpstream(fd);
+    while (true) {
+        struct sockaddr_in peer = {};
+        socklen_t addrlen = sizeof(peer);
+        // `accept4` sets the flags of the new socket in the same call, instead of an `fcntl` each.
+        int fd = ::accept4(_fd, (struct sockaddr*)&peer, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd >= 0) {
+            set_nodelay(fd);
+            return accepted_stream { tcpstream(fd), peer };
+        }
+
+        if (errno == EWOULDBLOCK || errno == EAGAIN || is_resource_error(errno)) return std::nullopt;
+        if (!is_connection_error(errno)) THROW_ERRNO("accept failed");
+    }
+}
+
+std::optional<accepted_stream> tcplistener::adopt(int fd) {
+    assert_init();
+    accepted_stream accepted { tcpstream(fd), {} };
+    socklen_t addrlen = sizeof(accepted.peer);
+    // The peer might have reset the connection since it was accepted. The stream closes the
+    // socket on the way out.
+    if (getpeername(fd, (struct sockaddr*)&accepted.peer, &addrlen) < 0) return std::nullopt;
+    set_nodelay(fd);
+    return accepted;
+}
+
+bool tcplistener::is_connection_error(int err) {
+    switch (err) {
+        // Besides the connection being aborted and the call interrupted, accept(2) reports the
+        // network errors pending on the new socket, which are to be treated like `EAGAIN`.
+        case EINTR: case ECONNABORTED: case EPROTO: case EPERM:
+        case ENETDOWN: case ENOPROTOOPT: case EHOSTDOWN: case ENONET: case EHOSTUNREACH:
+        case EOPNOTSUPP: case ENETUNREACH:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool tcplistener::is_resource_error(int err) {
+    return err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM;
 }
 
 int tcplistener::fd() const {
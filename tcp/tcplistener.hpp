@@ -2,19 +2,51 @@
 #define _SERVER_H_
 
 #include <cstdint>
+#include <optional>
 
 #include <netinet/in.h>
+#include <sys/socket.h>
 
 #include "tcpstream.hpp"
 
+// A connection accepted by a `tcplistener`, with the address of its peer.
+struct accepted_stream {
+    tcpstream stream;
+    struct sockaddr_in peer;
+
+    // The IPv4 address of the peer, in host byte order.
+    uint32_t peer_ipv4() const { return ntohl(peer.sin_addr.s_addr); }
+};
+
 class tcplistener {
 public:
-    tcplistener(uint16_t port);
+    // `backlog` is the length of the queue of connections waiting to be accepted. The kernel caps
+    // it at `net.core.somaxconn`.
+    tcplistener(uint16_t port, int backlog = SOMAXCONN);
     tcplistener(const tcplistener&) = delete;
     tcplistener(tcplistener&& rhs);
     ~tcplistener();
 
-    tcpstream accept();
+    // Accepts a pending connection, already non-blocking, close-on-exec and with `TCP_NODELAY`
+    // set, with the address the kernel returned for it. The listener socket is non-blocking, so if
+    // there is no connection waiting to be accepted, `std::nullopt` is returned. It is also
+    // returned, with `errno` set, when the process or the system ran out of resources (see
+    // `is_resource_error`); the connections keep waiting. Connections that failed before being
+    // accepted are skipped.
+    std::optional<accepted_stream> accept();
+
+    // Takes ownership of a connection accepted from this listener by other means (e.g. by an
+    // asynchronous accept), looking up the address of its peer and setting `TCP_NODELAY`. If the
+    // peer already reset the connection, the socket is closed and `std::nullopt` is returned.
+    std::optional<accepted_stream> adopt(int fd);
+
+    // Whether an error of accept(2) only concerns the connection being accepted, so the next one
+    // can be accepted right away.
+    static bool is_connection_error(int err);
+
+    // Whether an error of accept(2) means that there are no file descriptors or memory left for
+    // the connection. Accepting again right away would fail the same way.
+    static bool is_resource_error(int err);
 
     int fd() const;
     void start();
@@ -23,6 +55,7 @@ private:
     void assert_init() const;
 
     uint16_t _port;
+    int _backlog;
     int _fd;
     struct sockaddr_in _address;
     bool _init;
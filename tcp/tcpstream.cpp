@@ -38,8 +38,20 @@ ssize_t tcpstream::nonblocking_send(const uint8_t* buf, size_t len) {
     return ::send(_fd, buf, len, MSG_DONTWAIT);
 }
 
+ssize_t tcpstream::nonblocking_sendmsg(const struct iovec* iov, size_t iovcnt) {
+    struct msghdr msg = {};
+    msg.msg_iov = const_cast<struct iovec*>(iov);
+    msg.msg_iovlen = iovcnt;
+    return ::sendmsg(_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
 int tcpstream::fd() const { return _fd; }
-void tcpstream::close() { if (_fd > 0) ::close(_fd); }
+void tcpstream::close() {
+    if (_fd >= 0) ::close(_fd);
+    _fd = -1;
+}
+
+void tcpstream::shutdown() { if (_fd >= 0) ::shutdown(_fd, SHUT_RDWR); }
 
 tcpstream tcpstream::connect(const char *ip, uint16_t server_port) {
     struct sockaddr_in remote = {0};
@@ -7,11 +7,14 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 class tcpstream {
 public:
     static tcpstream connect(const char *ip, uint16_t port);
 
+    // A stream without a socket, like one that was moved from.
+    tcpstream() : _fd(-1) {}
     tcpstream(tcpstream&& rhs);
     tcpstream(const tcpstream&) = delete;
     ~tcpstream();
@@ -27,9 +30,17 @@ public:
 
     ssize_t nonblocking_send(const uint8_t* buf, size_t len);
 
+    // Sends the `iovcnt` buffers of `iov` with a single system call, as if they were contiguous.
+    // A closed peer is reported with `EPIPE` instead of raising `SIGPIPE`.
+    ssize_t nonblocking_sendmsg(const struct iovec* iov, size_t iovcnt);
+
     int fd() const;
     void close();
 
+    // Shuts down both directions of the connection without closing the file descriptor. Any
+    // operation still pending on the socket completes right away.
+    void shutdown();
+
 private:
     tcpstream(int fd) : _fd(fd) {}
 